@@ -0,0 +1,99 @@
+
+#ifndef HWT_H
+#define HWT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rankbv.h"
+#include "wt.h"
+
+    /* entropy shaped wavelet tree. the shape is a weight balanced
+     * alphabetic tree (every node splits its symbols where the weight is
+     * closest to half), so symbol order is kept for quantile/range queries
+     * and a symbol of frequency w sits at depth at most about log(n/w)+2,
+     * so the levels take at most about n(H0+2) bits. splits are pulled
+     * toward the middle where a skewed subtree would outgrow HWT_MAXDEPTH.
+     * the bits of level d are the nodes of depth d left to right, each node
+     * knows where it starts and how many 1s precede it on its level */
+#define HWT_LEAF        (1ULL<<63)
+#define HWT_MAXDEPTH    64
+
+    typedef struct hwt_node {
+        uint64_t start;     /* first bit of the node on its level */
+        uint64_t ones;      /* 1s on the level before start */
+        uint64_t split;     /* smallest symbol of the right subtree */
+        uint64_t child[2];  /* internal node id or HWT_LEAF|leaf */
+    } hwt_node_t;
+
+    typedef struct hwt {
+        uint64_t n;
+        uint64_t sigma;     /* distinct symbols = leaves */
+        uint32_t height;
+        uint64_t root;
+        uint64_t* syms;     /* leaf -> symbol, increasing */
+        uint64_t* freq;     /* leaf -> occurrences */
+        hwt_node_t* nodes;  /* sigma-1 internal nodes in preorder */
+        rankbv_t** levels;
+    } hwt_t;
+
+    /* on-disk format, a magic word and the version lead the file */
+#define HWT_MAGIC       0x3130786469747768ULL  /* "hwtidx01" */
+#define HWT_VERSION     1
+
+    static inline size_t
+    hwt_length(hwt_t* hwt)
+    {
+        return hwt->n;
+    }
+
+    /* leaf of sym or sigma if it does not occur. fills the internal nodes
+     * on the path if path is not NULL and returns the depth in *depth */
+    static inline uint64_t
+    hwt_leaf(hwt_t* hwt,uint64_t sym,uint64_t* path,uint32_t* depth)
+    {
+        uint64_t v = hwt->root;
+        uint32_t d = 0;
+        if (!hwt->sigma) return 0;
+        while (!(v & HWT_LEAF)) {
+            if (path) path[d] = v;
+            v = hwt->nodes[v].child[sym >= hwt->nodes[v].split];
+            d++;
+        }
+        if (depth) *depth = d;
+        v &= ~HWT_LEAF;
+        return hwt->syms[v] == sym ? v : hwt->sigma;
+    }
+
+    /* hwt functions share the wt result types. index memory comes from the
+     * memalloc allocator, hwt_create/hwt_load return NULL if it cannot be
+     * allocated. hwt_create leaves A to the caller */
+    hwt_t*       hwt_init(size_t n);
+    hwt_t*       hwt_create(uint64_t* A,size_t bits,size_t n,uint32_t f);
+    void         hwt_free(hwt_t* hwt);
+    uint64_t     hwt_access(hwt_t* hwt,size_t i);
+    size_t       hwt_rank(hwt_t* hwt,uint64_t sym,size_t i);
+    size_t       hwt_select(hwt_t* hwt,uint64_t sym,size_t x);
+    size_t       hwt_count(hwt_t* hwt,uint64_t sym);
+    uint64_t     hwt_quantile(hwt_t* hwt,size_t left,size_t right,size_t quantile);
+    wt_quant_t   hwt_quantile_freq(hwt_t* hwt,size_t left,size_t right,size_t quantile);
+    wt_result_t* hwt_mostfrequent(hwt_t* hwt,size_t left,size_t right,size_t k);
+    /* as wt_mostfrequent_ctx, the result belongs to ctx */
+    const wt_result_t* hwt_mostfrequent_ctx(hwt_t* hwt,wt_ctx_t* ctx,size_t left,size_t right,size_t k);
+
+    /* save/load */
+    size_t    hwt_spaceusage(hwt_t* hwt);
+    hwt_t*    hwt_load(FILE* f);
+    void      hwt_save(hwt_t* hwt,FILE* f);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+
+#ifndef MEMALLOC_H
+#define MEMALLOC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+    /* allocator used for all index memory (rankbv, occ, wt levels and
+     * construction buffers, cbheap arrays). alloc returns zeroed memory
+     * aligned to MEMALLOC_ALIGN or NULL, free gets back the size that was
+     * requested. set the allocator before building an index and keep it
+     * until the index is freed: memalloc_free always goes to the current
+     * allocator, so memory from a previous one must not be live when it
+     * is swapped. */
+
+    typedef struct memalloc {
+        void* (*alloc)(size_t n,void* ctx);
+        void (*free)(void* mem,size_t n,void* ctx);
+        void* ctx;
+    } memalloc_t;
+
+#define MEMALLOC_ALIGN      64
+#define MEMALLOC_HUGEPAGE   (2UL<<20)
+#define MEMALLOC_HUGEMIN    (1UL<<20)  /* smaller huge requests use the heap */
+
+    typedef struct memalloc_arena {
+        char* mem;
+        size_t size;
+        size_t used;
+    } memalloc_arena_t;
+
+    void              memalloc_set(const memalloc_t* a);
+    const memalloc_t* memalloc_get(void);
+    void*             memalloc_calloc(size_t n);
+    void              memalloc_free(void* mem,size_t n);
+    void*             memalloc_realloc(void* mem,size_t n,size_t new_n);
+
+    /* built-in allocators */
+    memalloc_t        memalloc_default(void);
+    memalloc_t        memalloc_hugepage(void);
+    /* mappings preferring numa node (-1 for none), whole huge pages if huge
+     * is set and whole pages otherwise. requests smaller than one such
+     * unit come from the heap without placement */
+    memalloc_t        memalloc_numa(int node,int huge);
+
+    /* bump allocation from one mapping, frees are no-ops until the arena
+     * is destroyed. requests that do not fit go to the default allocator */
+    memalloc_arena_t* memalloc_arena_create(size_t size);
+    void              memalloc_arena_free(memalloc_arena_t* arena);
+    memalloc_t        memalloc_arena(memalloc_arena_t* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,73 @@
+
+#ifndef OCC_H
+#define OCC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rankbv.h"
+
+    /* non-decreasing sequence C[0..m-1] (cumulative symbol counts).
+     * small sequences are stored as a plain array, large ones with
+     * Elias-Fano: the low l bits of every value packed in L[] and the
+     * high parts in unary in a rankbv (C[i]>>l)+i. everything lives in
+     * one blob so it can be saved, loaded and mmap'd like a rankbv. */
+
+    typedef struct occ {
+        uint64_t m;
+        uint64_t u;
+        uint64_t lwords;
+        uint8_t type;
+        uint8_t l;
+        uint64_t D[0];
+    } occ_t;
+
+#define OCC_PLAIN           0
+#define OCC_EF              1
+#define OCC_PLAINMAX        65536
+#define OCC_EFSAMPLERATE    64
+
+    static inline rankbv_t*
+    occ_high(occ_t* occ)
+    {
+        return (rankbv_t*)(occ->D + occ->lwords);
+    }
+
+    static inline uint64_t
+    occ_low(occ_t* occ,size_t i)
+    {
+        size_t b = i*occ->l;
+        uint64_t v = occ->D[b/RBVW] >> (b%RBVW);
+        if (b%RBVW + occ->l > RBVW) v |= occ->D[b/RBVW+1] << (RBVW-b%RBVW);
+        return v & ((1ULL<<occ->l)-1);
+    }
+
+    static inline uint64_t
+    occ_get(occ_t* occ,size_t i)
+    {
+        if (occ->type == OCC_PLAIN) return occ->D[i];
+        size_t high = rankbv_select1(occ_high(occ),i+1) - i;
+        return (high << occ->l) | occ_low(occ,i);
+    }
+
+    occ_t*    occ_create(const uint64_t* C,size_t m);
+    occ_t*    occ_create_type(const uint64_t* C,size_t m,uint32_t type);
+    void      occ_free(occ_t* occ);
+    size_t    occ_length(occ_t* occ);
+
+    /* save/load */
+    size_t    occ_spaceusage(occ_t* occ);
+    occ_t*    occ_load(FILE* f);
+    size_t    occ_save(occ_t* occ,FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
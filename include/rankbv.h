@@ -9,37 +9,82 @@ extern "C" {
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
     /* count the bits in a bunch of junk and time it */
 
     typedef struct rankbv {
         uint64_t n;
-        uint32_t s;
+        uint64_t s;
         uint64_t ones;
-        uint8_t factor;
+        uint32_t factor;
+        uint32_t sr;
+        uint8_t hdr;
+        uint8_t pad[3];
+        uint32_t version;
+        uint64_t reserved[3]; /* keeps S[] on a cache line boundary */
         uint64_t S[0];
     } rankbv_t;
 
+    /* on-disk format, bumped when the blob layout changes.
+     * 2: 64-bit superblock size and 32-bit factor */
+#define RANKBV_VERSION      2
+
+    /* layouts: S[] is a sequence of superblocks, each made of hdr counter
+     * words followed by factor data words.
+     *
+     * - default: hdr = 1, one absolute counter every factor words
+     *   (space overhead 1/factor, rank popcounts up to factor words).
+     * - RANKBV_LINE: hdr = 2, factor = 6. An absolute counter, a word of
+     *   packed 9-bit counts relative to it and 6 data words fill exactly
+     *   one 64-byte line (space overhead 1/3, rank = one line + one
+     *   popcount). Pass RANKBV_LINE as the factor to select it. */
+#define RANKBV_LINE         0xFFFFFFFF
+#define RANKBV_LINEWORDS    6
+#define RANKBV_RELBITS      9
+
+    /* select sampling: the position of every sr-th one and every sr-th
+     * zero is stored after the data so select only has to search between
+     * two consecutive samples. sr == 0 disables the samples. */
+#define RANKBV_SAMPLERATE   4096
+
     /** bit operations */
 #define rankbv_mask63       0x00000000000003F
 #define RBVW				64
 #define RBVW32              32
 
     /* misc */
+    static inline size_t
+    rankbv_sblock(rankbv_t* rbv,size_t sb)
+    {
+        return sb*(rbv->factor+rbv->hdr);
+    }
+
+    static inline size_t
+    rankbv_word(rankbv_t* rbv,size_t w)
+    {
+        return (w/rbv->factor)*(rbv->factor+rbv->hdr)+rbv->hdr+(w%rbv->factor);
+    }
+
     static inline void
     rankbv_setbit(rankbv_t* rbv,size_t i)
     {
-        size_t bs = i/rbv->s;
-        size_t block = bs + i/RBVW + 1;
-        rbv->S[block] |= (1LL<<(i%RBVW));
+        rbv->S[rankbv_word(rbv,i/RBVW)] |= (1ULL<<(i%RBVW));
     }
 
     static inline int
     rankbv_getbit(rankbv_t* rbv,size_t i)
     {
-        size_t bs = i/rbv->s;
-        size_t block = bs + i/RBVW + 1;
-        return ((rbv->S[block] >> (i%RBVW)) & 1LL);
+        return ((rbv->S[rankbv_word(rbv,i/RBVW)] >> (i%RBVW)) & 1ULL);
+    }
+
+    /* pull in the counter and data word rankbv_rank1(rbv,i) reads */
+    static inline void
+    rankbv_prefetch(rankbv_t* rbv,size_t i)
+    {
+        i++;
+        __builtin_prefetch(&rbv->S[rankbv_sblock(rbv,i/rbv->s)]);
+        __builtin_prefetch(&rbv->S[rankbv_word(rbv,i/RBVW)]);
     }
 
     static inline size_t
@@ -50,22 +95,112 @@ extern "C" {
     void*     rankbv_safecalloc(size_t n);
     uint32_t  rankbv_bits(size_t n);
     uint32_t  rankbv_popcount8(const uint32_t x);
+    size_t    rankbv_select64(uint64_t x,uint32_t k);
+    size_t    rankbv_select64_broadword(uint64_t x,uint32_t k);
+    uint64_t  rankbv_popcount(const uint64_t* A,size_t k);
+    uint64_t  rankbv_popcount_scalar(const uint64_t* A,size_t k);
+#if defined(__x86_64__)
+    /* only callable if the CPU has the instructions, use rankbv_popcount */
+    uint64_t  rankbv_popcount_avx2(const uint64_t* A,size_t k);
+    uint64_t  rankbv_popcount_avx512(const uint64_t* A,size_t k);
+#endif
     size_t    rankbv_numsblocks(rankbv_t* rbv);
     uint64_t* rankbv_getdata(rankbv_t* rbv);
+    size_t    rankbv_numsamples(rankbv_t* rbv);
+    uint64_t* rankbv_getsamples(rankbv_t* rbv);
 
     /* rankbv functions */
     rankbv_t* rankbv_init(size_t n,uint32_t f);
+    rankbv_t* rankbv_init_sampled(size_t n,uint32_t f,uint32_t sr);
     rankbv_t* rankbv_create(uint64_t* A,size_t n,uint32_t f);
     void      rankbv_free(rankbv_t* rbv);
     void      rankbv_build(rankbv_t* rbv);
+    void      rankbv_buildsamples(rankbv_t* rbv);
+    /* rankbv_build with the counter pass split over threads superblock
+     * ranges. the result is the same as rankbv_build */
+#define RANKBV_MAXTHREADS   256
+    void      rankbv_build_mt(rankbv_t* rbv,uint32_t threads);
+    void      rankbv_runjobs(void* (*f)(void*),void* jobs,size_t size,uint32_t m);
     int       rankbv_access(rankbv_t* rbv,size_t i);
     size_t    rankbv_rank1(rankbv_t* rbv,size_t i);
     size_t    rankbv_select0(rankbv_t* rbv,size_t x);
     size_t    rankbv_select1(rankbv_t* rbv,size_t x);
     size_t    rankbv_ones(rankbv_t* rbv);
+
+    /* batched queries: memory accesses of RANKBV_BATCH independent
+     * queries are prefetched before any of them is resolved */
+#define RANKBV_BATCH        16
+
+    /* rank scans of at least this many words use the vector popcount */
+#define RANKBV_VECSCAN      8
+    void      rankbv_access_batch(rankbv_t* rbv,const size_t* pos,size_t m,int* out);
+    void      rankbv_rank1_batch(rankbv_t* rbv,const size_t* pos,size_t m,size_t* out);
+    void      rankbv_select0_batch(rankbv_t* rbv,const size_t* x,size_t m,size_t* out);
+    void      rankbv_select1_batch(rankbv_t* rbv,const size_t* x,size_t m,size_t* out);
     void      rankbv_print(rankbv_t* rbv);
 
 
+    /* streaming construction: bits are appended in order and the
+     * counters and select samples are filled in as words complete, so no
+     * separate rankbv_build pass over the data is needed */
+    typedef struct rankbv_builder {
+        rankbv_t* rbv;
+        size_t pos;         /* bits appended so far */
+        uint64_t word;      /* word being filled */
+        size_t ones;        /* ones in the completed words */
+        size_t zeros;       /* zeros (below n) in the completed words */
+        size_t next1;       /* rank of the next one/zero to sample */
+        size_t next0;
+    } rankbv_builder_t;
+
+    int       rankbv_builder_init(rankbv_builder_t* b,size_t n,uint32_t f);
+    void      rankbv_builder_flush(rankbv_builder_t* b);
+    void      rankbv_builder_pushword(rankbv_builder_t* b,uint64_t w,size_t bits);
+    rankbv_t* rankbv_builder_finish(rankbv_builder_t* b);
+
+    static inline void
+    rankbv_builder_push(rankbv_builder_t* b,int bit)
+    {
+        b->word |= (uint64_t)(bit&1) << (b->pos%RBVW);
+        if (++b->pos % RBVW == 0) rankbv_builder_flush(b);
+    }
+
+    /* as the builder, but the bv is written to f as rankbv_save would
+     * write it while bits are appended. only one superblock is held in
+     * memory. f must be seekable, its header is rewritten at the end */
+    typedef struct rankbv_writer {
+        rankbv_t hdr;       /* header of the bv being written */
+        FILE* f;
+        off_t off;          /* where the bv starts in f */
+        uint64_t* sb;       /* superblock being filled */
+        size_t sbwords;
+        size_t sbfill;      /* data words in sb */
+        size_t pos;
+        uint64_t word;
+        size_t ones;
+        size_t zeros;
+        size_t next1;
+        size_t next0;
+        FILE* s1;           /* one/zero sample positions */
+        FILE* s0;
+        int err;            /* a write failed */
+    } rankbv_writer_t;
+
+    /* init, flush and finish return 0 on an I/O or allocation error, a
+     * failed write is kept so the pushes after it do not need checking.
+     * finish and abort release the writer either way */
+    int       rankbv_writer_init(rankbv_writer_t* w,FILE* f,size_t n,uint32_t factor);
+    int       rankbv_writer_flush(rankbv_writer_t* w);
+    int       rankbv_writer_finish(rankbv_writer_t* w);
+    void      rankbv_writer_abort(rankbv_writer_t* w);
+
+    static inline void
+    rankbv_writer_push(rankbv_writer_t* w,int bit)
+    {
+        w->word |= (uint64_t)(bit&1) << (w->pos%RBVW);
+        if (++w->pos % RBVW == 0) rankbv_writer_flush(w);
+    }
+
     /* save/load */
     size_t    rankbv_spaceusage(rankbv_t* rbv);
     rankbv_t* rankbv_load(FILE* f);
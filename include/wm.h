@@ -0,0 +1,71 @@
+
+#ifndef WM_H
+#define WM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rankbv.h"
+#include "wt.h"
+
+    /* wavelet matrix: level lvl holds bit lvl (msb first) of every symbol,
+     * ordered by the lower levels' stable zero/one partition. a position
+     * moves to the next level with a single rank, no node bounds needed */
+    typedef struct wm {
+        uint64_t n;
+        uint32_t height;
+        uint64_t max_v;
+        uint64_t* zeros;    /* zeros[lvl] = number of 0 bits on level lvl */
+        rankbv_t** levels;
+    } wm_t;
+
+    /* on-disk format, a magic word and the version lead the file */
+#define WM_MAGIC        0x3130786564696d77ULL  /* "wmidex01" */
+#define WM_VERSION      1
+
+    static inline size_t
+    wm_length(wm_t* wm)
+    {
+        return wm->n;
+    }
+
+    /* ones in B[0..i-1] */
+    static inline size_t
+    wm_ones(rankbv_t* bs,size_t i)
+    {
+        return rankbv_rank1(bs,i-1);
+    }
+
+    /* wm functions share the wt result types. index memory comes from the
+     * memalloc allocator, wm_create/wm_load return NULL if it cannot be
+     * allocated. like wt_create, wm_create leaves A to the caller */
+    wm_t*        wm_init(size_t n);
+    wm_t*        wm_create(uint64_t* A,size_t bits,size_t n,uint32_t f);
+    void         wm_free(wm_t* wm);
+    uint64_t     wm_access(wm_t* wm,size_t i);
+    size_t       wm_rank(wm_t* wm,uint64_t sym,size_t i);
+    size_t       wm_select(wm_t* wm,uint64_t sym,size_t x);
+    size_t       wm_count(wm_t* wm,uint64_t sym);
+    void         wm_print(wm_t* wm);
+    uint64_t     wm_quantile(wm_t* wm,size_t left,size_t right,size_t quantile);
+    wt_quant_t   wm_quantile_freq(wm_t* wm,size_t left,size_t right,size_t quantile);
+    wt_result_t* wm_mostfrequent(wm_t* wm,size_t left,size_t right,size_t k);
+    /* as wt_mostfrequent_ctx, the result belongs to ctx */
+    const wt_result_t* wm_mostfrequent_ctx(wm_t* wm,wt_ctx_t* ctx,size_t left,size_t right,size_t k);
+
+    /* save/load */
+    size_t    wm_spaceusage(wm_t* wm);
+    wm_t*     wm_load(FILE* f);
+    void      wm_save(wm_t* wm,FILE* f);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,15 +11,25 @@ extern "C" {
 #include <stdio.h>
 
 #include "rankbv.h"
+#include "occ.h"
 
     typedef struct wt {
         uint64_t n;
         uint32_t height;
-        uint32_t max_v;
-        rankbv_t*  occ;
+        uint64_t max_v;
+        occ_t*     occ;
         rankbv_t** bittree;
+        uint64_t sigma;     /* size of the effective alphabet */
+        uint64_t* alpha;    /* code -> symbol if remapped, else NULL */
     } wt_t;
 
+    /* on-disk format: a magic word and the version lead the file. files
+     * without them (n first, 32-bit max_v, occ as a bitvector) are from
+     * before the version word and are converted on load.
+     * 1: flags word, 64-bit max_v, occ_t and alphabet map */
+#define WT_MAGIC        0x3130786564697477ULL  /* "wtidex01" */
+#define WT_VERSION      1
+
 
     /* helper ops from libcds */
     static inline void*
@@ -72,51 +82,100 @@ extern "C" {
      _a < _b ? _a : _b; })
 
     static inline int
-    wt_marked(uint32_t v,uint32_t h,uint32_t bit)
+    wt_marked(uint64_t v,uint32_t h,uint32_t bit)
     {
-        return v & (1<<(h-bit-1));
+        return (v >> (h-bit-1)) & 1;
     }
 
-    static inline uint32_t
-    wt_mark(uint32_t v,uint32_t h,uint32_t bit)
+    static inline uint64_t
+    wt_mark(uint64_t v,uint32_t h,uint32_t bit)
     {
-        return v | (1<<(h-bit-1));
+        return v | (1ULL<<(h-bit-1));
     }
 
+    /* v with the bits below level lvl cleared, i.e. the smallest symbol
+     * of the node holding v on that level */
+    static inline uint64_t
+    wt_prefix(uint64_t v,uint32_t h,uint32_t lvl)
+    {
+        uint32_t low = h-lvl;
+        return low >= RBVW ? 0 : (v >> low) << low;
+    }
 
-    static inline uint32_t
-    wt_getsym(uint64_t* B,register size_t bits,register size_t pos)
-    {
-        uint32_t* A = (uint32_t*)B;
-        register size_t i=pos*bits/RBVW32, j=pos*bits-RBVW32*i;
-        uint32_t result;
-        if (j+bits <= RBVW32)
-            result = (A[i] << (RBVW32-j-bits)) >> (RBVW32-bits);
-        else {
-            result = A[i] >> j;
-            result = result | (A[i+1] << (RBVW-j-bits)) >> (RBVW32-bits);
-        }
+    /* symbols are 1..64 bits wide, packed into 64-bit words */
+    static inline uint64_t
+    wt_getsym(uint64_t* A,register size_t bits,register size_t pos)
+    {
+        register size_t i=pos*bits/RBVW, j=pos*bits-RBVW*i;
+        uint64_t result = A[i] >> j;
+        if (j+bits > RBVW) result |= A[i+1] << (RBVW-j);
+        if (bits < RBVW) result &= (1ULL<<bits)-1;
         return result;
     }
 
     static inline void
-    wt_setsym(uint64_t* B,register size_t bits,register size_t pos,register uint32_t sym)
-    {
-        uint32_t* A = (uint32_t*)B;
-        size_t i=pos*bits/RBVW32, j=pos*bits-i*RBVW32;
-        uint32_t mask = ((j+bits) < RBVW32 ? ~0u << (j+bits) : 0)
-                        | ((RBVW32-j) < RBVW32 ? ~0u >> (RBVW32-j) : 0);
-        A[i] = (A[i] & mask) | sym << j;
-        if (j+bits>RBVW32) {
-            mask = ((~0u) << (bits+j-RBVW32));
-            A[i+1] = (A[i+1] & mask)| sym >> (RBVW32-j);
+    wt_setsym(uint64_t* A,register size_t bits,register size_t pos,register uint64_t sym)
+    {
+        size_t i=pos*bits/RBVW, j=pos*bits-i*RBVW;
+        uint64_t mask = bits < RBVW ? (1ULL<<bits)-1 : ~0ULL;
+        sym &= mask;
+        A[i] = (A[i] & ~(mask << j)) | sym << j;
+        if (j+bits>RBVW) {
+            A[i+1] = (A[i+1] & ~(mask >> (RBVW-j))) | sym >> (RBVW-j);
         }
     }
 
+    /* effective alphabet. with alpha the tree stores codes 0..sigma-1,
+     * the public functions translate symbols on the way in and out */
+    static inline uint64_t
+    wt_symbol(wt_t* wt,uint64_t c)
+    {
+        return wt->alpha ? wt->alpha[c] : c;
+    }
+
+    /* number of alphabet symbols < sym */
+    static inline uint64_t
+    wt_lowercode(wt_t* wt,uint64_t sym)
+    {
+        uint64_t lo = 0, hi = wt->sigma;
+        while (lo < hi) {
+            uint64_t mid = (lo+hi)/2;
+            if (wt->alpha[mid] < sym) lo = mid+1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    /* code of sym, 0 if it is not in the alphabet */
+    static inline int
+    wt_code(wt_t* wt,uint64_t sym,uint64_t* c)
+    {
+        if (!wt->alpha) {
+            *c = sym;
+            return 1;
+        }
+        *c = wt_lowercode(wt,sym);
+        return *c < wt->sigma && wt->alpha[*c] == sym;
+    }
+
+    /* map [lo,hi] to the codes it covers, 0 if there are none */
+    static inline int
+    wt_coderange(wt_t* wt,uint64_t* lo,uint64_t* hi)
+    {
+        if (!wt->alpha) return 1;
+        uint64_t clo = wt_lowercode(wt,*lo);
+        uint64_t chi = wt_lowercode(wt,*hi);
+        if (chi < wt->sigma && wt->alpha[chi] == *hi) chi++;
+        if (clo >= chi) return 0;
+        *lo = clo;
+        *hi = chi-1;
+        return 1;
+    }
+
     /* result structs */
 
     typedef struct wt_quant {
-        uint32_t sym;
+        uint64_t sym;
         size_t freq;
     } wt_quant_t;
 
@@ -125,10 +184,19 @@ extern "C" {
         size_t ep;
     } wt_range_t;
 
+    /* 2d range query: positions [l,r], symbols [lo,hi] */
+    typedef struct wt_rangeq {
+        size_t l;
+        size_t r;
+        uint64_t lo;
+        uint64_t hi;
+    } wt_rangeq_t;
+
     typedef struct wt_item {
-        uint32_t sym;
+        uint64_t sym;
         size_t freq;
         size_t weight;
+        double score;   /* freq times symbol weight, weighted top-k */
     } wt_item_t;
 
     typedef struct wt_result {
@@ -142,11 +210,128 @@ extern "C" {
         size_t right;
         size_t start;
         size_t end;
-        uint32_t sym;
+        uint64_t sym;
         size_t freq;
         uint32_t lvl;
     } wt_topkrange_t;
 
+    /* range report iterator. all state lives in the struct (a few KB),
+     * so it can sit on the stack and needs no heap allocation */
+    typedef struct wt_iterframe {
+        size_t start;   /* node bounds on level lvl */
+        size_t end;
+        size_t sp;      /* node relative range [sp,ep) */
+        size_t ep;
+        uint64_t sym;
+        uint32_t lvl;
+    } wt_iterframe_t;
+
+    typedef struct wt_iter {
+        wt_t* wt;
+        uint64_t lo;
+        uint64_t hi;
+        uint32_t top;
+        wt_iterframe_t stack[RBVW+1];
+        /* leaf whose positions wt_iter_nextpos is reporting */
+        wt_iterframe_t leaf;
+        size_t k;
+        size_t starts[RBVW];
+    } wt_iter_t;
+
+    /* top-k query state. node records are kept by value in a typed heap
+     * and the result lives in the context, both start in the inline
+     * buffers and only grow (and allocate) when a query needs more. keep
+     * one context per thread and reuse it, queries then do no allocation */
+#define WT_CTX_INLINE   64
+
+    typedef struct wt_topknode {
+        size_t left;    /* node relative range [left,right] */
+        size_t right;
+        size_t start;   /* node bounds on level lvl */
+        size_t end;
+        uint64_t sym;
+        uint32_t lvl;
+        double bound;   /* weighted: upper bound on the score below */
+    } wt_topknode_t;
+
+    typedef struct wt_ctx {
+        wt_topknode_t* heap;
+        size_t n;
+        size_t size;
+        int weighted;
+        wt_result_t res;
+        wt_topknode_t inlheap[WT_CTX_INLINE];
+        wt_item_t inlitems[WT_CTX_INLINE];
+    } wt_ctx_t;
+
+    /* the heap and result of a context, shared by the wt, wm and hwt
+     * top-k. a node record is ordered on its range size compared as
+     * size_t, so large ranges cannot overflow, or on its score bound in
+     * weighted queries. grow and additem return 0 if memory runs out */
+    int          wt_ctx_grow(wt_ctx_t* ctx);
+    int          wt_ctx_additem(wt_ctx_t* ctx,uint64_t sym,size_t freq,double score);
+    /* copies the result of ctx into one the caller owns and destroys ctx */
+    wt_result_t* wt_ctx_result(wt_ctx_t* ctx,const wt_result_t* r);
+
+    static inline size_t
+    wt_topknode_size(const wt_topknode_t* x)
+    {
+        return x->right - x->left + 1;
+    }
+
+    static inline int
+    wt_topknode_less(const wt_ctx_t* ctx,const wt_topknode_t* a,const wt_topknode_t* b)
+    {
+        if (ctx->weighted) return a->bound < b->bound;
+        return wt_topknode_size(a) < wt_topknode_size(b);
+    }
+
+    static inline int
+    wt_ctx_push(wt_ctx_t* ctx,const wt_topknode_t* x)
+    {
+        if (ctx->n == ctx->size && !wt_ctx_grow(ctx)) return 0;
+        wt_topknode_t* A = ctx->heap;
+        size_t child = ctx->n++;
+        while (child > 0) {
+            size_t parent = (child-1)/2;
+            if (!wt_topknode_less(ctx,&A[parent],x)) break;
+            A[child] = A[parent];
+            child = parent;
+        }
+        A[child] = *x;
+        return 1;
+    }
+
+    static inline void
+    wt_ctx_pop(wt_ctx_t* ctx,wt_topknode_t* top)
+    {
+        wt_topknode_t* A = ctx->heap;
+        *top = A[0];
+        wt_topknode_t last = A[--ctx->n];
+        size_t parent = 0, child;
+        while ((child = 2*parent+1) < ctx->n) {
+            if (child+1 < ctx->n && wt_topknode_less(ctx,&A[child],&A[child+1])) child++;
+            if (!wt_topknode_less(ctx,&last,&A[child])) break;
+            A[parent] = A[child];
+            parent = child;
+        }
+        A[parent] = last;
+    }
+
+    /* per symbol weights for weighted top-k. maxw holds, for every node of
+     * every level, the largest weight of a symbol below it. level lvl is
+     * indexed by the code prefix of the node and starts at off[lvl] */
+    typedef struct wt_weights {
+        uint32_t height;
+        size_t size;
+        size_t* off;
+        double* maxw;
+    } wt_weights_t;
+
+    /* report callbacks return non-zero to stop the traversal */
+    typedef int (*wt_report_f)(uint64_t sym,size_t freq,void* ctx);
+    typedef int (*wt_reportpos_f)(size_t pos,uint64_t sym,void* ctx);
+
     static int
     wt_item_cmp(const void* a,const void* b)
     {
@@ -155,12 +340,12 @@ extern "C" {
         float wfa = wa->freq/(float)(wa->weight+1);
         float wfb = wb->freq/(float)(wb->weight+1);
         if (wfa < wfb) return -1;
-        if (wfb > wfa) return 1;
+        if (wfa > wfb) return 1;
         return 0;
     }
 
     static inline wt_item_t*
-    wt_new_item(uint32_t sym,size_t freq,size_t weight)
+    wt_new_item(uint64_t sym,size_t freq,size_t weight)
     {
         wt_item_t* item = (wt_item_t*) wt_safecalloc(sizeof(wt_item_t));
         item->sym = sym;
@@ -170,18 +355,24 @@ extern "C" {
     }
 
     static inline wt_result_t*
-    wt_newresult()
+    wt_newresult_size(size_t size)
     {
         wt_result_t* res = (wt_result_t*) wt_safecalloc(sizeof(wt_result_t));
-        res->size = 8192;
+        res->size = size;
         res->items = (wt_item_t*) wt_safecalloc(res->size*sizeof(wt_item_t));
         res->m = 0;
 
         return res;
     }
 
+    static inline wt_result_t*
+    wt_newresult()
+    {
+        return wt_newresult_size(8192);
+    }
+
     static inline void
-    wt_addresult(wt_result_t* res,uint32_t sym,size_t freq,size_t weight)
+    wt_addresult(wt_result_t* res,uint64_t sym,size_t freq,size_t weight)
     {
         if (res->m == res->size) {
             res->items = (wt_item_t*) wt_saferealloc(res->items,2*res->size*sizeof(wt_item_t));
@@ -190,6 +381,7 @@ extern "C" {
         res->items[res->m].sym = sym;
         res->items[res->m].freq = freq;
         res->items[res->m].weight = weight;
+        res->items[res->m].score = 0;
         res->m++;
     }
 
@@ -207,20 +399,91 @@ extern "C" {
     }
 
 
-    /* rankbv functions */
+    /* rankbv functions. index memory comes from the memalloc allocator,
+     * wt_init/wt_create/wt_load return NULL if it cannot be allocated,
+     * wt_load (as wm_load and hwt_load) also on a short or malformed file.
+     * A is left to the caller and read once. besides the index, wt_create
+     * needs a copy of A (n*bits/64+1 words), four bit arrays of n/64+1
+     * words, a rankbv_builder_t per level and either a buffer of n
+     * height-bit codes or, for the last level, the (max_v+2)-word occ
+     * histogram. wt_create_remap first needs n words to collect the
+     * alphabet */
     wt_t*        wt_init(size_t n);
     wt_t*        wt_create(uint64_t* A,size_t bits,size_t n,uint32_t f);
+    /* as wt_create, but the tree is built over the symbols that occur, so
+     * the height is lg sigma instead of lg max_v */
+    wt_t*        wt_create_remap(uint64_t* A,size_t bits,size_t n,uint32_t f);
+    /* as wt_create, built by threads threads. the index is the same as
+     * the one wt_create builds, but construction holds two uncompressed
+     * copies (16n bytes) of the input */
+    wt_t*        wt_create_mt(uint64_t* A,size_t bits,size_t n,uint32_t f,uint32_t threads);
+    /* as wt_create from a plain array. levels are cut 64 symbols at a
+     * time with AVX2 and nodes split with BMI2 pext where the CPU has them */
+    wt_t*        wt_create_u8(const uint8_t* A,size_t n,uint32_t f);
+    wt_t*        wt_create_u16(const uint16_t* A,size_t n,uint32_t f);
+    wt_t*        wt_create_u32(const uint32_t* A,size_t n,uint32_t f);
+    /* build the index of a file larger than memory straight into the
+     * index file out_path, which wt_load reads. the input holds
+     * size*8/bits symbols packed as wt_setsym lays them out (for 8, 16,
+     * 32 and 64 bits: a plain little-endian array). every level is one
+     * pass over the symbols, which move between temporary runs of their
+     * codes. I/O buffers and the occ histogram stay within mem_budget
+     * bytes (occ is left out if it does not fit), levels use the default
+     * rank layout. returns 0, leaving no partial out_path, if bits is not
+     * 1 to 64, the buffers cannot be allocated or a read or write fails */
+    int          wt_create_from_file(const char* path,size_t bits,const char* out_path,size_t mem_budget);
     void         wt_free(wt_t* wt);
-    void         wt_build(wt_t* wt,uint64_t* A,size_t bits,size_t n);
-    void         wt_buildlvl(wt_t* wt,uint64_t* A,size_t bits,uint32_t lvl,size_t n,size_t offset);
-    uint32_t     wt_access(wt_t* wt,size_t i);
-    size_t       wt_rank(wt_t* wt,uint32_t sym,size_t i);
-    size_t       wt_select(wt_t* wt,uint32_t sym,size_t x);
-    size_t       wt_count(wt_t* wt,uint32_t sym);
+    /* fill a wt_init(n) index with factor f. wt_build finds max_v and the
+     * height, builds the levels and occ itself and returns 0 if memory
+     * runs out. this replaces the old void wt_build(wt,A,bits,n), which
+     * needed max_v, height, occ and bittree set up by the caller, and
+     * wt_buildlvl, which is gone. unlike the old one it does not free A */
+    int          wt_build(wt_t* wt,uint64_t* A,size_t bits,size_t n,uint32_t f);
+    int          wt_build_mt(wt_t* wt,uint64_t* A,size_t bits,size_t n,uint32_t f,uint32_t threads);
+    uint64_t     wt_access(wt_t* wt,size_t i);
+    size_t       wt_rank(wt_t* wt,uint64_t sym,size_t i);
+    size_t       wt_select(wt_t* wt,uint64_t sym,size_t x);
+    size_t       wt_count(wt_t* wt,uint64_t sym);
     void         wt_print(wt_t* wt);
-    uint32_t     wt_quantile(wt_t* wt,size_t left,size_t right,size_t quantile);
+    uint64_t     wt_quantile(wt_t* wt,size_t left,size_t right,size_t quantile);
     wt_quant_t   wt_quantile_freq(wt_t* wt,size_t left,size_t right,size_t quantile);
     wt_result_t* wt_mostfrequent(wt_t* wt,size_t left,size_t right,size_t k);
+    /* as wt_mostfrequent, the result belongs to ctx and stays valid until
+     * its next query. NULL if the context could not grow */
+    const wt_result_t* wt_mostfrequent_ctx(wt_t* wt,wt_ctx_t* ctx,size_t left,size_t right,size_t k);
+    void         wt_ctx_init(wt_ctx_t* ctx);
+    void         wt_ctx_destroy(wt_ctx_t* ctx);
+    /* top-k symbols of [left,right] by score = freq * weight[sym], best
+     * first. weight has m entries indexed by symbol, symbols >= m weigh 0.
+     * weights must be >= 0, wt_weights_create returns NULL otherwise or if
+     * the bounds (about two doubles per code) cannot be allocated */
+    wt_weights_t* wt_weights_create(wt_t* wt,const double* weight,size_t m);
+    void         wt_weights_free(wt_weights_t* w);
+    wt_result_t* wt_topk_weighted(wt_t* wt,const wt_weights_t* w,size_t left,size_t right,size_t k);
+    const wt_result_t* wt_topk_weighted_ctx(wt_t* wt,const wt_weights_t* w,wt_ctx_t* ctx,size_t left,size_t right,size_t k);
+    size_t       wt_range_count(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi);
+    void         wt_range_count_batch(wt_t* wt,const wt_rangeq_t* q,size_t m,size_t* out);
+
+    /* symbols in [lo,hi] occuring in [l,r], in increasing order. wt_range_report
+     * emits (symbol,freq), wt_range_report_pos every (position,symbol) grouped
+     * by symbol. both return the number of tuples emitted. the iterator pulls
+     * the same tuples; use either wt_iter_next or wt_iter_nextpos on it */
+    size_t       wt_range_report(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi,wt_report_f f,void* ctx);
+    size_t       wt_range_report_pos(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi,wt_reportpos_f f,void* ctx);
+    /* smallest symbol >= x (largest <= x) in [l,r] and its frequency there.
+     * freq is 0 if there is none */
+    wt_quant_t   wt_range_next_value(wt_t* wt,size_t l,size_t r,uint64_t x);
+    wt_quant_t   wt_range_prev_value(wt_t* wt,size_t l,size_t r,uint64_t x);
+    /* decode T[l..r] into out. levels are read sequentially instead of one
+     * access() per symbol. returns 0 if the range is invalid or the
+     * 2(r-l+1) words of scratch cannot be allocated */
+    int          wt_extract(wt_t* wt,size_t l,size_t r,uint64_t* out);
+    void         wt_iter_init(wt_iter_t* it,wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi);
+    int          wt_iter_next(wt_iter_t* it,uint64_t* sym,size_t* freq);
+    int          wt_iter_nextpos(wt_iter_t* it,size_t* pos,uint64_t* sym);
+    /* symbols occuring in at least threshold of the m ranges [sp,ep], in
+     * increasing order. freq is the number of occurrences over all ranges,
+     * weight the number of ranges containing the symbol */
     wt_result_t* wt_intersect(wt_t* wt,wt_range_t* ranges,size_t m,size_t threshold);
 
     /* save/load */
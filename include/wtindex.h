@@ -0,0 +1,78 @@
+
+#ifndef WTINDEX_H
+#define WTINDEX_H
+
+/* build-time choice of the index engine. the default is the pointer
+ * per level wavelet tree, -DWT_ENGINE_WM (make ENGINE=wm) selects the
+ * wavelet matrix and -DWT_ENGINE_HWT (make ENGINE=hwt) the entropy
+ * shaped tree. all share the wt result types */
+
+#if defined(WT_ENGINE_HWT)
+
+#include "hwt.h"
+
+typedef hwt_t wtindex_t;
+
+#define WTINDEX_ENGINE           "hwt"
+#define wtindex_create           hwt_create
+#define wtindex_free             hwt_free
+#define wtindex_length           hwt_length
+#define wtindex_access           hwt_access
+#define wtindex_rank             hwt_rank
+#define wtindex_select           hwt_select
+#define wtindex_count            hwt_count
+#define wtindex_quantile         hwt_quantile
+#define wtindex_quantile_freq    hwt_quantile_freq
+#define wtindex_mostfrequent     hwt_mostfrequent
+#define wtindex_mostfrequent_ctx hwt_mostfrequent_ctx
+#define wtindex_spaceusage       hwt_spaceusage
+#define wtindex_load             hwt_load
+#define wtindex_save             hwt_save
+
+#elif defined(WT_ENGINE_WM)
+
+#include "wm.h"
+
+typedef wm_t wtindex_t;
+
+#define WTINDEX_ENGINE           "wm"
+#define wtindex_create           wm_create
+#define wtindex_free             wm_free
+#define wtindex_length           wm_length
+#define wtindex_access           wm_access
+#define wtindex_rank             wm_rank
+#define wtindex_select           wm_select
+#define wtindex_count            wm_count
+#define wtindex_quantile         wm_quantile
+#define wtindex_quantile_freq    wm_quantile_freq
+#define wtindex_mostfrequent     wm_mostfrequent
+#define wtindex_mostfrequent_ctx wm_mostfrequent_ctx
+#define wtindex_spaceusage       wm_spaceusage
+#define wtindex_load             wm_load
+#define wtindex_save             wm_save
+
+#else
+
+#include "wt.h"
+
+typedef wt_t wtindex_t;
+
+#define WTINDEX_ENGINE           "wt"
+#define wtindex_create           wt_create
+#define wtindex_free             wt_free
+#define wtindex_length           wt_length
+#define wtindex_access           wt_access
+#define wtindex_rank             wt_rank
+#define wtindex_select           wt_select
+#define wtindex_count            wt_count
+#define wtindex_quantile         wt_quantile
+#define wtindex_quantile_freq    wt_quantile_freq
+#define wtindex_mostfrequent     wt_mostfrequent
+#define wtindex_mostfrequent_ctx wt_mostfrequent_ctx
+#define wtindex_spaceusage       wt_spaceusage
+#define wtindex_load             wt_load
+#define wtindex_save             wt_save
+
+#endif
+
+#endif
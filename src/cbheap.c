@@ -1,15 +1,21 @@
 
 #include "cbheap.h"
+#include "memalloc.h"
 
 
 cbheap_t*
 cbheap_create(int (*cmpfunc)(const void*,const void*),void (*del)(void*))
 {
-    cbheap_t* cbh = (cbheap_t*) cbheap_safecalloc(sizeof(cbheap_t));
+    cbheap_t* cbh = (cbheap_t*) memalloc_calloc(sizeof(cbheap_t));
+    if (!cbh) return NULL;
     cbh->n = 0;
     cbh->itemcmp = cmpfunc;
     cbh->freeitem = del;
-    cbh->A = (void**) cbheap_safecalloc(INIT_CBHEAP_SIZE*sizeof(void*));
+    cbh->A = (void**) memalloc_calloc(INIT_CBHEAP_SIZE*sizeof(void*));
+    if (!cbh->A) {
+        memalloc_free(cbh,sizeof(cbheap_t));
+        return NULL;
+    }
     cbh->size = INIT_CBHEAP_SIZE;
 
     return cbh;
@@ -20,8 +26,8 @@ cbheap_free(cbheap_t* cbh)
 {
     size_t i;
     for (i=0; i<cbh->n; i++) cbh->freeitem(cbh->A[i]);
-    free(cbh->A);
-    free(cbh);
+    memalloc_free(cbh->A,cbh->size*sizeof(void*));
+    memalloc_free(cbh,sizeof(cbheap_t));
 }
 
 void*
@@ -144,7 +150,12 @@ void
 cbheap_resize(cbheap_t* ch)
 {
     size_t new_size = 2*ch->size;
-    ch->A = (void**) cbheap_saferealloc(ch->A,new_size*sizeof(void*));
+    ch->A = (void**) memalloc_realloc(ch->A,ch->size*sizeof(void*),new_size*sizeof(void*));
+    if (!ch->A) {
+        fprintf(stderr, "ERROR: cbheap_resize() cannot allocate"
+                "%zu blocks of memory.\n", new_size*sizeof(void*));
+        exit(EXIT_FAILURE);
+    }
     ch->size = new_size;
 }
 
@@ -0,0 +1,497 @@
+
+#include "rankbv.h"
+#include "wt.h"
+#include "hwt.h"
+#include "memalloc.h"
+
+/*#define _HWT_DEBUG_*/
+
+hwt_t*
+hwt_init(size_t n)
+{
+    hwt_t* hwt = (hwt_t*) memalloc_calloc(sizeof(hwt_t));
+    if (!hwt) return NULL;
+
+    hwt->n = n;
+    hwt->sigma = 0;
+    hwt->height = 0;
+    hwt->root = HWT_LEAF;
+    hwt->syms = NULL;
+    hwt->freq = NULL;
+    hwt->nodes = NULL;
+    hwt->levels = NULL;
+
+    return hwt;
+}
+
+static int
+hwt_symcmp(const void* a,const void* b)
+{
+    uint64_t sa = *(const uint64_t*)a;
+    uint64_t sb = *(const uint64_t*)b;
+    if (sa < sb) return -1;
+    if (sa > sb) return 1;
+    return 0;
+}
+
+/* distinct symbols and their counts */
+static int
+hwt_alphabet(hwt_t* hwt,uint64_t* A,size_t bits,size_t n)
+{
+    size_t i,j;
+    size_t bytes = n*sizeof(uint64_t);
+    uint64_t* sorted = (uint64_t*) memalloc_calloc(bytes);
+    if (!sorted) return 0;
+    for (i=0; i<n; i++) sorted[i] = wt_getsym(A,bits,i);
+    qsort(sorted,n,sizeof(uint64_t),hwt_symcmp);
+    for (i=0; i<n; i++) hwt->sigma += (!i || sorted[i] != sorted[i-1]);
+
+    hwt->syms = (uint64_t*) memalloc_calloc(hwt->sigma*sizeof(uint64_t));
+    hwt->freq = (uint64_t*) memalloc_calloc(hwt->sigma*sizeof(uint64_t));
+    if (!hwt->syms || !hwt->freq) {
+        memalloc_free(sorted,bytes);
+        return 0;
+    }
+    for (i=0,j=0; i<n; i++) {
+        if (i && sorted[i] != sorted[i-1]) j++;
+        hwt->syms[j] = sorted[i];
+        hwt->freq[j]++;
+    }
+    memalloc_free(sorted,bytes);
+    return 1;
+}
+
+/* node over the leaves [a,b). P are the prefix sums of the leaf weights,
+ * off/onesoff the bits and 1s already placed on every level */
+static uint64_t
+hwt_buildnode(hwt_t* hwt,const uint64_t* P,size_t a,size_t b,uint32_t depth,
+              uint64_t* off,uint64_t* onesoff,uint64_t* next)
+{
+    if (b-a == 1) return HWT_LEAF|a;
+
+    /* split where the left weight gets closest to half */
+    size_t lo = a+1, hi = b-1;
+    while (lo < hi) {
+        size_t mid = (lo+hi)/2;
+        if (2*P[mid] < P[a]+P[b]) lo = mid+1;
+        else hi = mid;
+    }
+    size_t s = lo;
+    uint64_t total = P[a]+P[b];
+    if (s > a+1 && 2*P[s] >= total && total-2*P[s-1] < 2*P[s]-total) s--;
+
+    /* a child below depth+1 holds at most 2^(HWT_MAXDEPTH-depth-1) leaves
+     * so the tree never gets deeper than HWT_MAXDEPTH. deep in very skewed
+     * trees this moves the split toward the middle */
+    uint32_t room = HWT_MAXDEPTH-depth-1;
+    if (room < RBVW) {
+        size_t cap = (size_t)1 << room;
+        if (s-a > cap) s = a+cap;
+        if (b-s > cap) s = b-cap;
+    }
+
+    uint64_t id = (*next)++;
+    hwt_node_t* node = &hwt->nodes[id];
+    node->start = off[depth];
+    node->ones = onesoff[depth];
+    node->split = hwt->syms[s];
+    off[depth] += P[b]-P[a];
+    onesoff[depth] += P[b]-P[s];
+    if (depth+1 > hwt->height) hwt->height = depth+1;
+
+    node->child[0] = hwt_buildnode(hwt,P,a,s,depth+1,off,onesoff,next);
+    node->child[1] = hwt_buildnode(hwt,P,s,b,depth+1,off,onesoff,next);
+    return id;
+}
+
+/* shape the tree and fill the levels. the bits of a node are written in
+ * text order, so every node is a stable partition of its parent */
+static int
+hwt_build(hwt_t* hwt,uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    size_t i;
+    uint64_t off[HWT_MAXDEPTH] = {0};
+    uint64_t onesoff[HWT_MAXDEPTH] = {0};
+    uint64_t next = 0;
+    size_t nint = hwt->sigma-1;
+    int ok = 0;
+
+    size_t pbytes = (hwt->sigma+1)*sizeof(uint64_t);
+    uint64_t* P = (uint64_t*) memalloc_calloc(pbytes);
+    hwt->nodes = (hwt_node_t*) memalloc_calloc(nint*sizeof(hwt_node_t));
+    uint64_t* cnt = (uint64_t*) memalloc_calloc(nint*sizeof(uint64_t));
+    if (!P || (nint && (!hwt->nodes || !cnt))) goto done;
+
+    for (i=0; i<hwt->sigma; i++) P[i+1] = P[i] + hwt->freq[i];
+    hwt->root = hwt_buildnode(hwt,P,0,hwt->sigma,0,off,onesoff,&next);
+
+    hwt->levels = (rankbv_t**) memalloc_calloc(hwt->height*sizeof(rankbv_t*));
+    if (hwt->height && !hwt->levels) goto done;
+    for (i=0; i<hwt->height; i++) {
+        hwt->levels[i] = rankbv_init(off[i],f);
+        if (!hwt->levels[i]) goto done;
+    }
+
+    for (i=0; i<n; i++) {
+        uint64_t sym = wt_getsym(A,bits,i);
+        uint64_t v = hwt->root;
+        uint32_t d = 0;
+        while (!(v & HWT_LEAF)) {
+            hwt_node_t* node = &hwt->nodes[v];
+            int bit = sym >= node->split;
+            if (bit) rankbv_setbit(hwt->levels[d],node->start+cnt[v]);
+            cnt[v]++;
+            v = node->child[bit];
+            d++;
+        }
+    }
+    for (i=0; i<hwt->height; i++) rankbv_build(hwt->levels[i]);
+    ok = 1;
+
+done:
+    memalloc_free(P,pbytes);
+    memalloc_free(cnt,nint*sizeof(uint64_t));
+    return ok;
+}
+
+hwt_t*
+hwt_create(uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    hwt_t* hwt = hwt_init(n);
+    if (!hwt) return NULL;
+    if (!n) return hwt;
+
+    if (!hwt_alphabet(hwt,A,bits,n) || !hwt_build(hwt,A,bits,n,f)) {
+        hwt_free(hwt);
+        return NULL;
+    }
+
+#ifdef _HWT_DEBUG_
+    fprintf(stdout,"hwt::create() sigma = %zu height = %u\n",hwt->sigma,hwt->height);
+#endif
+
+    return hwt;
+}
+
+void
+hwt_free(hwt_t* hwt)
+{
+    size_t i;
+    if (hwt) {
+        if (hwt->levels) {
+            for (i=0; i<hwt->height; i++) rankbv_free(hwt->levels[i]);
+            memalloc_free(hwt->levels,hwt->height*sizeof(rankbv_t*));
+        }
+        memalloc_free(hwt->syms,hwt->sigma*sizeof(uint64_t));
+        memalloc_free(hwt->freq,hwt->sigma*sizeof(uint64_t));
+        if (hwt->sigma) memalloc_free(hwt->nodes,(hwt->sigma-1)*sizeof(hwt_node_t));
+        memalloc_free(hwt,sizeof(hwt_t));
+    }
+}
+
+uint64_t
+hwt_access(hwt_t* hwt,size_t pos)
+{
+    uint64_t v = hwt->root;
+    uint32_t d = 0;
+
+    while (!(v & HWT_LEAF)) {
+        hwt_node_t* node = &hwt->nodes[v];
+        rankbv_t* bs = hwt->levels[d];
+        /* 1s in node[0..pos] */
+        size_t ones = rankbv_rank1(bs,node->start+pos) - node->ones;
+        if (rankbv_getbit(bs,node->start+pos)) {
+            pos = ones-1;
+            v = node->child[1];
+        } else {
+            pos = pos-ones;
+            v = node->child[0];
+        }
+        d++;
+    }
+    return hwt->syms[v & ~HWT_LEAF];
+}
+
+size_t
+hwt_rank(hwt_t* hwt,uint64_t sym,size_t pos)
+{
+    uint64_t v = hwt->root;
+    uint32_t d = 0;
+    size_t p = pos+1;
+
+    if (!hwt->sigma) return 0;
+    /* p = prefix of the node holding the path of sym */
+    while (!(v & HWT_LEAF)) {
+        hwt_node_t* node = &hwt->nodes[v];
+        int bit = sym >= node->split;
+        size_t ones = rankbv_rank1(hwt->levels[d],node->start+p-1) - node->ones;
+        p = bit ? ones : p-ones;
+        if (!p) return 0;
+        v = node->child[bit];
+        d++;
+    }
+    return hwt->syms[v & ~HWT_LEAF] == sym ? p : 0;
+}
+
+size_t
+hwt_count(hwt_t* hwt,uint64_t sym)
+{
+    uint64_t leaf = hwt_leaf(hwt,sym,NULL,NULL);
+    return leaf < hwt->sigma ? hwt->freq[leaf] : 0;
+}
+
+size_t
+hwt_select(hwt_t* hwt,uint64_t sym,size_t j)
+{
+    uint64_t path[HWT_MAXDEPTH];
+    uint32_t d;
+    uint64_t leaf = hwt_leaf(hwt,sym,path,&d);
+    size_t pos = j;
+
+    if (leaf == hwt->sigma || !j || j > hwt->freq[leaf]) return (size_t)(-1);
+    while (d--) {
+        hwt_node_t* node = &hwt->nodes[path[d]];
+        rankbv_t* bs = hwt->levels[d];
+        if (sym >= node->split)
+            pos = rankbv_select1(bs,node->ones+pos) - node->start + 1;
+        else
+            pos = rankbv_select0(bs,node->start-node->ones+pos) - node->start + 1;
+    }
+    return pos-1;
+}
+
+wt_quant_t
+hwt_quantile_freq(hwt_t* hwt,size_t left,size_t right,size_t q)
+{
+    /* decrease q as the smallest element q=1 is
+     * found by searching for 0 */
+    q--;
+    uint64_t v = hwt->root;
+    uint32_t d = 0;
+    size_t sp = left, ep = right+1;
+    wt_quant_t qf;
+
+    while (!(v & HWT_LEAF)) {
+        hwt_node_t* node = &hwt->nodes[v];
+        rankbv_t* bs = hwt->levels[d];
+        size_t ones_sp = rankbv_rank1(bs,node->start+sp-1) - node->ones;
+        size_t ones_ep = rankbv_rank1(bs,node->start+ep-1) - node->ones;
+        size_t num_zeros = (ep-sp) - (ones_ep-ones_sp);
+
+        if (q >= num_zeros) { /* go right */
+            q -= num_zeros;
+            sp = ones_sp;
+            ep = ones_ep;
+            v = node->child[1];
+        } else {
+            sp -= ones_sp;
+            ep -= ones_ep;
+            v = node->child[0];
+        }
+        d++;
+    }
+    qf.sym = hwt->sigma ? hwt->syms[v & ~HWT_LEAF] : 0;
+    qf.freq = ep-sp;
+    return qf;
+}
+
+uint64_t
+hwt_quantile(hwt_t* hwt,size_t left,size_t right,size_t quantile)
+{
+    wt_quant_t q = hwt_quantile_freq(hwt,left,right,quantile);
+    return q.sym;
+}
+
+/* best-first descent as in wt_mostfrequent. a heap record keeps the
+ * node relative range in left/right, the node id in sym and its depth
+ * in lvl */
+const wt_result_t*
+hwt_mostfrequent_ctx(hwt_t* hwt,wt_ctx_t* ctx,size_t left,size_t right,size_t k)
+{
+    wt_topknode_t cr,child;
+
+    ctx->n = 0;
+    ctx->res.m = 0;
+    ctx->weighted = 0;
+    if (!hwt->sigma || left > right) return &ctx->res;
+    cr.left = left;
+    cr.right = right;
+    cr.start = cr.end = 0;
+    cr.sym = hwt->root;
+    cr.lvl = 0;
+    cr.bound = 0;
+    if (!wt_ctx_push(ctx,&cr)) return NULL;
+
+    while (ctx->n > 0) {
+        wt_ctx_pop(ctx,&cr);
+
+        if (cr.sym & HWT_LEAF) {
+            if (!wt_ctx_additem(ctx,hwt->syms[cr.sym & ~HWT_LEAF],wt_topknode_size(&cr),0)) return NULL;
+            if (ctx->res.m == k) {  /* we got the top-k */
+                break;
+            }
+            continue;
+        }
+
+        hwt_node_t* node = &hwt->nodes[cr.sym];
+        rankbv_t* bs = hwt->levels[cr.lvl];
+        size_t ones_sp = rankbv_rank1(bs,node->start+cr.left-1) - node->ones;
+        size_t ones_ep = rankbv_rank1(bs,node->start+cr.right) - node->ones;
+
+        child = cr;
+        child.lvl = cr.lvl+1;
+        if (ones_ep > ones_sp) {
+            child.left = ones_sp;
+            child.right = ones_ep-1;
+            child.sym = node->child[1];
+            if (!wt_ctx_push(ctx,&child)) return NULL;
+        }
+        if ((cr.right-cr.left+1) > (ones_ep-ones_sp)) {
+            child.left = cr.left-ones_sp;
+            child.right = cr.right-ones_ep;
+            child.sym = node->child[0];
+            if (!wt_ctx_push(ctx,&child)) return NULL;
+        }
+    }
+    return &ctx->res;
+}
+
+wt_result_t*
+hwt_mostfrequent(hwt_t* hwt,size_t left,size_t right,size_t k)
+{
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    return wt_ctx_result(&ctx,hwt_mostfrequent_ctx(hwt,&ctx,left,right,k));
+}
+
+size_t
+hwt_spaceusage(hwt_t* hwt)
+{
+    size_t i;
+    size_t levelspace = 0;
+    for (i=0; i<hwt->height; i++) {
+        levelspace += rankbv_spaceusage(hwt->levels[i]);
+    }
+    return sizeof(hwt_t) +
+           2*hwt->sigma*sizeof(uint64_t) +
+           (hwt->sigma ? hwt->sigma-1 : 0)*sizeof(hwt_node_t) +
+           levelspace;
+}
+
+/* the node ids of a loaded tree. the nodes are in preorder, so a child
+ * id is larger than its parent's, and no internal node may sit on or
+ * below the last level */
+static int
+hwt_checktree(hwt_t* hwt)
+{
+    size_t v,c,nint = hwt->sigma ? hwt->sigma-1 : 0;
+    int ok = 1;
+    if (!hwt->sigma) return 1;
+    if (hwt->root != (nint ? 0 : HWT_LEAF)) return 0;
+    uint32_t* depth = (uint32_t*) memalloc_calloc(nint*sizeof(uint32_t));
+    if (nint && !depth) return 0;
+    for (v=0; ok && v<nint; v++) {
+        if (depth[v] >= hwt->height) ok = 0;
+        for (c=0; ok && c<2; c++) {
+            uint64_t u = hwt->nodes[v].child[c];
+            if (u & HWT_LEAF) ok = (u & ~HWT_LEAF) < hwt->sigma;
+            else if (u <= v || u >= nint) ok = 0;
+            else depth[u] = depth[v]+1;
+        }
+    }
+    memalloc_free(depth,nint*sizeof(uint32_t));
+    return ok;
+}
+
+hwt_t*
+hwt_load(FILE* f)
+{
+    size_t i;
+    uint64_t magic;
+    uint32_t version;
+    if (fread(&magic,sizeof(uint64_t),1,f)!=1 || fread(&version,sizeof(uint32_t),1,f)!=1 ||
+        magic != HWT_MAGIC || version != HWT_VERSION) {
+        fprintf(stderr,"ERROR: hwt_load() unsupported format\n");
+        return NULL;
+    }
+    hwt_t* hwtl = hwt_init(0);
+    if (!hwtl) return NULL;
+    /* every leaf symbol occurs */
+    if (fread(&hwtl->n,sizeof(uint64_t),1,f)!=1 ||
+        fread(&hwtl->sigma,sizeof(uint64_t),1,f)!=1 ||
+        fread(&hwtl->height,sizeof(uint32_t),1,f)!=1 ||
+        fread(&hwtl->root,sizeof(uint64_t),1,f)!=1 ||
+        hwtl->height > HWT_MAXDEPTH || hwtl->sigma > hwtl->n ||
+        hwtl->sigma > SIZE_MAX/sizeof(hwt_node_t)) {
+        hwtl->sigma = 0;
+        hwtl->height = 0;
+        goto fail;
+    }
+
+#ifdef _HWT_DEBUG_
+    fprintf(stdout,"HWT::Load() n=%zu sigma=%zu height=%u\n",hwtl->n,hwtl->sigma,hwtl->height);
+#endif
+
+    size_t nint;
+    nint = hwtl->sigma ? hwtl->sigma-1 : 0;
+    hwtl->syms = (uint64_t*) memalloc_calloc(hwtl->sigma*sizeof(uint64_t));
+    hwtl->freq = (uint64_t*) memalloc_calloc(hwtl->sigma*sizeof(uint64_t));
+    hwtl->nodes = (hwt_node_t*) memalloc_calloc(nint*sizeof(hwt_node_t));
+    hwtl->levels = (rankbv_t**) memalloc_calloc(hwtl->height*sizeof(rankbv_t*));
+    if ((hwtl->sigma && (!hwtl->syms || !hwtl->freq)) || (nint && !hwtl->nodes) ||
+        (hwtl->height && !hwtl->levels)) goto fail;
+    if (fread(hwtl->syms,sizeof(uint64_t),hwtl->sigma,f)!=hwtl->sigma ||
+        fread(hwtl->freq,sizeof(uint64_t),hwtl->sigma,f)!=hwtl->sigma ||
+        fread(hwtl->nodes,sizeof(hwt_node_t),nint,f)!=nint ||
+        !hwt_checktree(hwtl)) goto fail;
+    for (i=0; i<hwtl->height; i++) {
+        hwtl->levels[i] = rankbv_load(f);
+        if (!hwtl->levels[i]) goto fail;
+    }
+    return hwtl;
+fail:
+    fprintf(stderr,"ERROR: hwt_load() cannot read the index\n");
+    hwt_free(hwtl);
+    return NULL;
+}
+
+void
+hwt_save(hwt_t* hwt,FILE* f)
+{
+#ifdef _HWT_DEBUG_
+    fprintf(stdout,"HWT::Write() n=%zu sigma=%zu height=%u\n",hwt->n,hwt->sigma,hwt->height);
+#endif
+    size_t i;
+    size_t nint = hwt->sigma ? hwt->sigma-1 : 0;
+    uint64_t magic = HWT_MAGIC;
+    uint32_t version = HWT_VERSION;
+    if (fwrite(&magic,sizeof(uint64_t),1,f)!=1 || fwrite(&version,sizeof(uint32_t),1,f)!=1 ||
+        fwrite(&(hwt->n),sizeof(uint64_t),1,f)!=1) {
+        fprintf(stdout,"error writing hwt->n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(hwt->sigma),sizeof(uint64_t),1,f)!=1) {
+        fprintf(stdout,"error writing hwt->sigma\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(hwt->height),sizeof(uint32_t),1,f)!=1) {
+        fprintf(stdout,"error writing hwt->height\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(hwt->root),sizeof(uint64_t),1,f)!=1) {
+        fprintf(stdout,"error writing hwt->root\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(hwt->syms,sizeof(uint64_t),hwt->sigma,f)!=hwt->sigma ||
+        fwrite(hwt->freq,sizeof(uint64_t),hwt->sigma,f)!=hwt->sigma) {
+        fprintf(stdout,"error writing hwt alphabet\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(hwt->nodes,sizeof(hwt_node_t),nint,f)!=nint) {
+        fprintf(stdout,"error writing hwt->nodes\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i=0; i<hwt->height; i++) {
+        rankbv_save(hwt->levels[i],f);
+    }
+}
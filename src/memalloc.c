@@ -0,0 +1,211 @@
+
+#include "memalloc.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* from numaif.h, so we do not depend on libnuma */
+#define MEMALLOC_MPOL_PREFERRED     1
+
+static void*
+memalloc_heap_alloc(size_t n,void* ctx)
+{
+    void* mem = NULL;
+    (void) ctx;
+    if (posix_memalign(&mem,MEMALLOC_ALIGN,n ? n : 1) != 0) return NULL;
+    memset(mem,0,n);
+    return mem;
+}
+
+static void
+memalloc_heap_free(void* mem,size_t n,void* ctx)
+{
+    (void) n;
+    (void) ctx;
+    free(mem);
+}
+
+static memalloc_t memalloc_current = { memalloc_heap_alloc, memalloc_heap_free, NULL };
+
+void
+memalloc_set(const memalloc_t* a)
+{
+    if (a) memalloc_current = *a;
+    else memalloc_current = memalloc_default();
+}
+
+const memalloc_t*
+memalloc_get(void)
+{
+    return &memalloc_current;
+}
+
+void*
+memalloc_calloc(size_t n)
+{
+    return memalloc_current.alloc(n,memalloc_current.ctx);
+}
+
+void
+memalloc_free(void* mem,size_t n)
+{
+    if (mem) memalloc_current.free(mem,n,memalloc_current.ctx);
+}
+
+void*
+memalloc_realloc(void* mem,size_t n,size_t new_n)
+{
+    void* new_mem = memalloc_calloc(new_n);
+    if (!new_mem) return NULL;
+    if (mem) {
+        memcpy(new_mem,mem,n < new_n ? n : new_n);
+        memalloc_free(mem,n);
+    }
+    return new_mem;
+}
+
+memalloc_t
+memalloc_default(void)
+{
+    memalloc_t a = { memalloc_heap_alloc, memalloc_heap_free, NULL };
+    return a;
+}
+
+/* huge page and numa mappings. ctx encodes (node+1)<<1 | huge,
+ * node == -1 means no placement policy. huge mappings are whole huge
+ * pages, so requests below MEMALLOC_HUGEMIN stay on the heap. plain
+ * mappings are whole pages and only requests below a page, which could
+ * not be placed on their own anyway, use the heap */
+static size_t
+memalloc_pagesize(void)
+{
+    static size_t pagesize = 0;
+    if (!pagesize) {
+        long ps = sysconf(_SC_PAGESIZE);
+        pagesize = ps > 0 ? (size_t) ps : 4096;
+    }
+    return pagesize;
+}
+
+static size_t
+memalloc_maplen(size_t n,int huge)
+{
+    size_t unit = huge ? MEMALLOC_HUGEPAGE : memalloc_pagesize();
+    return (n+unit-1) & ~(unit-1);
+}
+
+static int
+memalloc_onheap(size_t n,int huge)
+{
+    return huge ? n < MEMALLOC_HUGEMIN : n < memalloc_pagesize();
+}
+
+static void*
+memalloc_map_alloc(size_t n,void* ctx)
+{
+    intptr_t flags = (intptr_t) ctx;
+    int huge = flags & 1;
+    int node = (int)(flags >> 1) - 1;
+    if (memalloc_onheap(n,huge)) return memalloc_heap_alloc(n,NULL);
+
+    size_t len = memalloc_maplen(n,huge);
+    void* mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge) mem = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+#endif
+    if (mem == MAP_FAILED) {
+        /* no reserved huge pages: ask for transparent huge pages */
+        mem = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if (mem == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+        if (huge) madvise(mem,len,MADV_HUGEPAGE);
+#endif
+    }
+#ifdef SYS_mbind
+    if (node >= 0 && node < 64) {
+        unsigned long mask = 1UL << node;
+        /* placement is a hint, the mapping is usable if it fails */
+        syscall(SYS_mbind,mem,len,MEMALLOC_MPOL_PREFERRED,&mask,64,0);
+    }
+#endif
+    return mem;
+}
+
+static void
+memalloc_map_free(void* mem,size_t n,void* ctx)
+{
+    int huge = (intptr_t) ctx & 1;
+    if (memalloc_onheap(n,huge)) {
+        free(mem);
+        return;
+    }
+    munmap(mem,memalloc_maplen(n,huge));
+}
+
+memalloc_t
+memalloc_hugepage(void)
+{
+    memalloc_t a = { memalloc_map_alloc, memalloc_map_free, (void*)(intptr_t)1 };
+    return a;
+}
+
+memalloc_t
+memalloc_numa(int node,int huge)
+{
+    intptr_t flags = ((intptr_t)(node+1) << 1) | (huge ? 1 : 0);
+    memalloc_t a = { memalloc_map_alloc, memalloc_map_free, (void*)flags };
+    return a;
+}
+
+/* arena */
+static void*
+memalloc_arena_alloc(size_t n,void* ctx)
+{
+    memalloc_arena_t* arena = (memalloc_arena_t*) ctx;
+    size_t len = (n+MEMALLOC_ALIGN-1) & ~((size_t)MEMALLOC_ALIGN-1);
+    if (arena->used + len > arena->size) return memalloc_heap_alloc(n,NULL);
+    void* mem = arena->mem + arena->used;
+    arena->used += len;
+    return mem; /* fresh anonymous pages are zero */
+}
+
+static void
+memalloc_arena_release(void* mem,size_t n,void* ctx)
+{
+    memalloc_arena_t* arena = (memalloc_arena_t*) ctx;
+    char* p = (char*) mem;
+    if (p < arena->mem || p >= arena->mem+arena->size) memalloc_heap_free(mem,n,NULL);
+}
+
+memalloc_arena_t*
+memalloc_arena_create(size_t size)
+{
+    memalloc_arena_t* arena = (memalloc_arena_t*) calloc(1,sizeof(memalloc_arena_t));
+    if (!arena) return NULL;
+    arena->size = memalloc_maplen(size ? size : 1,1);
+    arena->mem = (char*) memalloc_map_alloc(arena->size,(void*)(intptr_t)1);
+    if (!arena->mem) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void
+memalloc_arena_free(memalloc_arena_t* arena)
+{
+    if (arena) {
+        munmap(arena->mem,arena->size);
+        free(arena);
+    }
+}
+
+memalloc_t
+memalloc_arena(memalloc_arena_t* arena)
+{
+    memalloc_t a = { memalloc_arena_alloc, memalloc_arena_release, arena };
+    return a;
+}
+
@@ -0,0 +1,107 @@
+
+#include "occ.h"
+#include "memalloc.h"
+
+#include <string.h>
+
+occ_t*
+occ_create(const uint64_t* C,size_t m)
+{
+    if (m <= OCC_PLAINMAX) return occ_create_type(C,m,OCC_PLAIN);
+    return occ_create_type(C,m,OCC_EF);
+}
+
+occ_t*
+occ_create_type(const uint64_t* C,size_t m,uint32_t type)
+{
+    size_t i;
+    uint64_t u = m ? C[m-1] : 0;
+    occ_t* occ;
+
+    if (type == OCC_PLAIN) {
+        occ = (occ_t*) memalloc_calloc(sizeof(occ_t)+m*sizeof(uint64_t));
+        if (!occ) return NULL;
+        memcpy(occ->D,C,m*sizeof(uint64_t));
+        occ->lwords = m;
+    } else {
+        /* l = lg(u/m) low bits, the rest in unary */
+        uint32_t l = (m && u > m) ? rankbv_bits(u/m)-1 : 0;
+        size_t lwords = (m*l)/RBVW+1;
+        rankbv_t* high = rankbv_init_sampled(m+(u>>l)+1,0,OCC_EFSAMPLERATE);
+        if (!high) return NULL;
+        for (i=0; i<m; i++) rankbv_setbit(high,(C[i]>>l)+i);
+        rankbv_build(high);
+
+        size_t hbytes = rankbv_spaceusage(high);
+        occ = (occ_t*) memalloc_calloc(sizeof(occ_t)+lwords*sizeof(uint64_t)+hbytes);
+        if (!occ) {
+            rankbv_free(high);
+            return NULL;
+        }
+        occ->l = l;
+        occ->lwords = lwords;
+        for (i=0; i<m && l; i++) {
+            uint64_t low = C[i] & ((1ULL<<l)-1);
+            size_t b = i*l;
+            occ->D[b/RBVW] |= low << (b%RBVW);
+            if (b%RBVW + l > RBVW) occ->D[b/RBVW+1] |= low >> (RBVW-b%RBVW);
+        }
+        memcpy(occ_high(occ),high,hbytes);
+        rankbv_free(high);
+    }
+    occ->m = m;
+    occ->u = u;
+    occ->type = type;
+
+    return occ;
+}
+
+void
+occ_free(occ_t* occ)
+{
+    if (occ) memalloc_free(occ,occ_spaceusage(occ));
+}
+
+size_t
+occ_length(occ_t* occ)
+{
+    return occ->m;
+}
+
+size_t
+occ_spaceusage(occ_t* occ)
+{
+    size_t bytes = sizeof(occ_t) + occ->lwords*sizeof(uint64_t);
+    if (occ->type == OCC_EF) bytes += rankbv_spaceusage(occ_high(occ));
+    return bytes;
+}
+
+occ_t*
+occ_load(FILE* f)
+{
+    size_t bytes;
+    if (fread(&bytes,sizeof(size_t),1,f) != 1) {
+        fprintf(stderr,"ERROR LOADING OCC\n");
+        return NULL;
+    }
+    void* mem = memalloc_calloc(bytes);
+    if (!mem) return NULL;
+    if (fread(mem,bytes,1,f) != 1) {
+        fprintf(stderr,"ERROR LOADING OCC\n");
+        memalloc_free(mem,bytes);
+        return NULL;
+    }
+    return (occ_t*)mem;
+}
+
+size_t
+occ_save(occ_t* occ,FILE* f)
+{
+    size_t bytes = occ_spaceusage(occ);
+
+    fwrite(&bytes,sizeof(uint64_t),1,f);
+    fwrite(occ,bytes,1,f);
+
+    return bytes+sizeof(size_t);
+}
+
@@ -1,7 +1,9 @@
 
 #include "rankbv.h"
+#include "memalloc.h"
 
 #include "string.h"
+#include <pthread.h>
 
 
 inline uint32_t rankbv_bits(size_t n)
@@ -31,25 +33,227 @@ rankbv_getdata(rankbv_t* rbv)
 {
     size_t num_sblocks = rankbv_numsblocks(rbv);
     return (uint64_t*)(((char*)rbv) + sizeof(rankbv_t) +
-                       (sizeof(uint64_t)*num_sblocks));
+                       (sizeof(uint64_t)*num_sblocks*rbv->hdr));
 }
 
 
+inline size_t
+rankbv_numsamples(rankbv_t* rbv)
+{
+    /* ones/sr + zeros/sr <= n/sr so both sample arrays fit */
+    if (!rbv->sr) return 0;
+    return rbv->n/rbv->sr+2;
+}
+
+inline uint64_t*
+rankbv_getsamples(rankbv_t* rbv)
+{
+    return rbv->S + rankbv_numsblocks(rbv)*rbv->hdr + (rbv->n/RBVW+1);
+}
+
+/* in-word select: position of the k-th (k>=0) one of x. The BMI2
+ * kernel deposits a single bit at the k-th one and counts the trailing
+ * zeros. The broadword kernel finds the byte with SWAR prefix counts and
+ * finishes with a table lookup. The kernel is picked once at startup. */
+static uint8_t rankbv_selectbyte[256*8];
+
+size_t
+rankbv_select64_broadword(uint64_t x,uint32_t k)
+{
+    const uint64_t ones8 = 0x0101010101010101ULL;
+    const uint64_t msbs8 = 0x8080808080808080ULL;
+    uint64_t s = x - ((x >> 1) & 0x5555555555555555ULL);
+    s = (s & 0x3333333333333333ULL) + ((s >> 2) & 0x3333333333333333ULL);
+    s = ((s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * ones8;
+    /* number of bytes whose prefix count is <= k */
+    uint64_t geq = ((k*ones8 | msbs8) - s) & msbs8;
+    uint32_t place = __builtin_popcountll(geq)*8;
+    uint32_t byterank = k - (uint32_t)(((s << 8) >> place) & 0xFF);
+    return place + rankbv_selectbyte[((x >> place) & 0xFF) | (byterank << 8)];
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("bmi,bmi2"))) static size_t
+rankbv_select64_bmi2(uint64_t x,uint32_t k)
+{
+    return _tzcnt_u64(_pdep_u64(1ULL << k,x));
+}
+#endif
+
+static size_t (*rankbv_select64_kernel)(uint64_t,uint32_t) = rankbv_select64_broadword;
+
+/* bulk popcount kernels for counter construction and long in-superblock
+ * scans: VPOPCNTDQ on 8 words at a time, Harley-Seal carry-save adders
+ * over 16 AVX2 vectors with a pshufb nibble lookup, or scalar popcnt. */
+uint64_t
+rankbv_popcount_scalar(const uint64_t* A,size_t k)
+{
+    size_t i;
+    uint64_t cnt = 0;
+    for (i=0; i<k; i++) cnt += __builtin_popcountll(A[i]);
+    return cnt;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static inline __m256i
+rankbv_popcount256(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_shuffle_epi8(lookup,_mm256_and_si256(v,low));
+    __m256i hi = _mm256_shuffle_epi8(lookup,_mm256_and_si256(_mm256_srli_epi16(v,4),low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo,hi),_mm256_setzero_si256());
+}
+
+#define RANKBV_CSA(h,l,a,b,c) do { \
+        __m256i u_ = _mm256_xor_si256(a,b); \
+        h = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(u_,c)); \
+        l = _mm256_xor_si256(u_,c); \
+    } while (0)
+
+__attribute__((target("avx2"))) uint64_t
+rankbv_popcount_avx2(const uint64_t* A,size_t k)
+{
+    const __m256i* V = (const __m256i*) A;
+    size_t nv = k/4, i = 0;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+    __m256i twosA,twosB,foursA,foursB,eightsA,eightsB,sixteens;
+
+#define RANKBV_LD(j) _mm256_loadu_si256(V+i+(j))
+    for (; i+16<=nv; i+=16) {
+        RANKBV_CSA(twosA,ones,ones,RANKBV_LD(0),RANKBV_LD(1));
+        RANKBV_CSA(twosB,ones,ones,RANKBV_LD(2),RANKBV_LD(3));
+        RANKBV_CSA(foursA,twos,twos,twosA,twosB);
+        RANKBV_CSA(twosA,ones,ones,RANKBV_LD(4),RANKBV_LD(5));
+        RANKBV_CSA(twosB,ones,ones,RANKBV_LD(6),RANKBV_LD(7));
+        RANKBV_CSA(foursB,twos,twos,twosA,twosB);
+        RANKBV_CSA(eightsA,fours,fours,foursA,foursB);
+        RANKBV_CSA(twosA,ones,ones,RANKBV_LD(8),RANKBV_LD(9));
+        RANKBV_CSA(twosB,ones,ones,RANKBV_LD(10),RANKBV_LD(11));
+        RANKBV_CSA(foursA,twos,twos,twosA,twosB);
+        RANKBV_CSA(twosA,ones,ones,RANKBV_LD(12),RANKBV_LD(13));
+        RANKBV_CSA(twosB,ones,ones,RANKBV_LD(14),RANKBV_LD(15));
+        RANKBV_CSA(foursB,twos,twos,twosA,twosB);
+        RANKBV_CSA(eightsB,fours,fours,foursA,foursB);
+        RANKBV_CSA(sixteens,eights,eights,eightsA,eightsB);
+        total = _mm256_add_epi64(total,rankbv_popcount256(sixteens));
+    }
+#undef RANKBV_LD
+    total = _mm256_slli_epi64(total,4);
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(rankbv_popcount256(eights),3));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(rankbv_popcount256(fours),2));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(rankbv_popcount256(twos),1));
+    total = _mm256_add_epi64(total,rankbv_popcount256(ones));
+    for (; i<nv; i++)
+        total = _mm256_add_epi64(total,rankbv_popcount256(_mm256_loadu_si256(V+i)));
+
+    uint64_t cnt = (uint64_t)_mm256_extract_epi64(total,0) + (uint64_t)_mm256_extract_epi64(total,1)
+                   + (uint64_t)_mm256_extract_epi64(total,2) + (uint64_t)_mm256_extract_epi64(total,3);
+    for (i=nv*4; i<k; i++) cnt += __builtin_popcountll(A[i]);
+    return cnt;
+}
+#undef RANKBV_CSA
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) uint64_t
+rankbv_popcount_avx512(const uint64_t* A,size_t k)
+{
+    size_t i;
+    __m512i total = _mm512_setzero_si512();
+    for (i=0; i+8<=k; i+=8)
+        total = _mm512_add_epi64(total,_mm512_popcnt_epi64(_mm512_loadu_si512(A+i)));
+    if (i<k) {
+        __mmask8 mask = (__mmask8)((1u << (k-i))-1);
+        total = _mm512_add_epi64(total,_mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(mask,A+i)));
+    }
+    return _mm512_reduce_add_epi64(total);
+}
+#endif
+
+static uint64_t (*rankbv_popcount_kernel)(const uint64_t*,size_t) = rankbv_popcount_scalar;
+
+__attribute__((constructor)) static void
+rankbv_cpuinit(void)
+{
+    uint32_t b,k,j;
+    for (b=0; b<256; b++) {
+        for (k=0,j=0; j<8; j++) {
+            if (b & (1 << j)) rankbv_selectbyte[b | (k++ << 8)] = j;
+        }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    /* pdep is microcoded and slow before zen3 */
+    if (__builtin_cpu_supports("bmi2") &&
+            !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2"))
+        rankbv_select64_kernel = rankbv_select64_bmi2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        rankbv_popcount_kernel = rankbv_popcount_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        rankbv_popcount_kernel = rankbv_popcount_avx2;
+#endif
+}
+
+uint64_t
+rankbv_popcount(const uint64_t* A,size_t k)
+{
+    return rankbv_popcount_kernel(A,k);
+}
+
+size_t
+rankbv_select64(uint64_t x,uint32_t k)
+{
+    return rankbv_select64_kernel(x,k);
+}
+
+/* position of the x-th (x>=1) one in a word */
+static inline size_t
+rankbv_selectword(uint64_t j,size_t x)
+{
+    return rankbv_select64_kernel(j,x-1);
+}
+
 rankbv_t*
 rankbv_init(size_t n,uint32_t f)
 {
-    if (!f) f = rankbv_bits(n); /* lg(n) */
-    size_t s = RBVW*f;
-    size_t num_sblocks = n/s+1;
-    size_t ints = n/RBVW+1;
+    return rankbv_init_sampled(n,f,RANKBV_SAMPLERATE);
+}
 
-    rankbv_t* rbv = (rankbv_t*) rankbv_safecalloc(sizeof(rankbv_t)
-                    + (num_sblocks*sizeof(uint64_t)) /*S[]*/
-                    + (ints*sizeof(uint64_t)));      /*A[]*/
+/* fill in the header fields of a bv of n bits */
+static void
+rankbv_layout(rankbv_t* rbv,size_t n,uint32_t f,uint32_t sr)
+{
+    uint32_t hdr = 1;
+    if (f == RANKBV_LINE) {
+        f = RANKBV_LINEWORDS;
+        hdr = 2;
+    }
+    if (!f) f = rankbv_bits(n); /* lg(n) */
+    if (!f) f = 1;
 
     rbv->n = n;
     rbv->factor = f;
-    rbv->s = s;
+    rbv->hdr = hdr;
+    rbv->version = RANKBV_VERSION;
+    rbv->s = RBVW*f;
+    rbv->sr = sr;
+}
+
+rankbv_t*
+rankbv_init_sampled(size_t n,uint32_t f,uint32_t sr)
+{
+    rankbv_t layout;
+    memset(&layout,0,sizeof(rankbv_t));
+    rankbv_layout(&layout,n,f,sr);
+
+    /* S[], A[] and the select samples */
+    rankbv_t* rbv = (rankbv_t*) memalloc_calloc(rankbv_spaceusage(&layout));
+    if (!rbv) return NULL;
+    *rbv = layout;
 
     return rbv;
 }
@@ -59,12 +263,9 @@ rankbv_create(uint64_t* A,size_t n,uint32_t f)
 {
     size_t i;
     rankbv_t* rbv = rankbv_init(n,f);
+    if (!rbv) return NULL;
     size_t ints = n/RBVW+1;
-    for (i=0; i<ints; i++) {
-        size_t block = i/rbv->factor;
-        rbv->S[(block+1)+(block*rbv->factor)+(i%rbv->factor)] = A[i];
-        /*rbv->S[i+(i/rbv->factor)+1] = A[i];*/
-    }
+    for (i=0; i<ints; i++) rbv->S[rankbv_word(rbv,i)] = A[i];
     rankbv_build(rbv);
     return rbv;
 }
@@ -73,25 +274,401 @@ void
 rankbv_free(rankbv_t* rbv)
 {
     if (rbv) {
-        free(rbv);
+        memalloc_free(rbv,rankbv_spaceusage(rbv));
     }
 }
 
+/* counters of the superblocks [sb0,sb1) as if no ones came before sb0.
+ * returns the ones in the range */
+static uint64_t
+rankbv_buildcounts(rankbv_t* rbv,size_t sb0,size_t sb1)
+{
+    size_t i,j,start;
+    uint64_t tmp,rel,cnt = 0;
+    for (i=sb0; i<sb1; i++) {
+        rbv->S[rankbv_sblock(rbv,i)] = cnt;
+        start = rankbv_sblock(rbv,i)+rbv->hdr;
+        /* the last superblock has no successor to count for */
+        if (i+1 < rankbv_numsblocks(rbv)) cnt += rankbv_popcount_kernel(rbv->S+start,rbv->factor);
+    }
+    if (rbv->hdr == 2) {
+        /* counts relative to the superblock, 9 bits per word */
+        for (i=sb0; i<sb1; i++) {
+            start = rankbv_sblock(rbv,i)+rbv->hdr;
+            tmp = rel = 0;
+            for (j=1; j<rbv->factor && i*rbv->factor+j<=rbv->n/RBVW; j++) {
+                tmp += __builtin_popcountll(rbv->S[start+j-1]);
+                rel |= tmp << (RANKBV_RELBITS*j);
+            }
+            rbv->S[rankbv_sblock(rbv,i)+1] = rel;
+        }
+    }
+    return cnt;
+}
+
 void
 rankbv_build(rankbv_t* rbv)
 {
-    size_t i,j,start,stop;
-    uint64_t tmp;
+    rankbv_buildcounts(rbv,0,rankbv_numsblocks(rbv));
+    rbv->ones = rankbv_rank1(rbv,rbv->n-1);
+
+    if (rbv->sr) rankbv_buildsamples(rbv);
+}
+
+typedef struct rankbv_buildjob {
+    rankbv_t* rbv;
+    size_t sb0;
+    size_t sb1;
+    uint64_t ones;
+} rankbv_buildjob_t;
+
+static void*
+rankbv_buildcounts_job(void* arg)
+{
+    rankbv_buildjob_t* job = (rankbv_buildjob_t*) arg;
+    job->ones = rankbv_buildcounts(job->rbv,job->sb0,job->sb1);
+    return NULL;
+}
+
+static void*
+rankbv_addcounts_job(void* arg)
+{
+    rankbv_buildjob_t* job = (rankbv_buildjob_t*) arg;
+    size_t i;
+    for (i=job->sb0; i<job->sb1; i++) job->rbv->S[rankbv_sblock(job->rbv,i)] += job->ones;
+    return NULL;
+}
+
+/* run f on every job, the first one on the calling thread. falls back to
+ * running them in turn if a thread cannot be started */
+void
+rankbv_runjobs(void* (*f)(void*),void* jobs,size_t size,uint32_t m)
+{
+    uint32_t t;
+    pthread_t tid[RANKBV_MAXTHREADS];
+    int started[RANKBV_MAXTHREADS];
+    for (t=1; t<m; t++) {
+        started[t] = pthread_create(&tid[t],NULL,f,(char*)jobs+t*size) == 0;
+        if (!started[t]) f((char*)jobs+t*size);
+    }
+    f(jobs);
+    for (t=1; t<m; t++) if (started[t]) pthread_join(tid[t],NULL);
+}
+
+void
+rankbv_build_mt(rankbv_t* rbv,uint32_t threads)
+{
+    uint32_t t;
     size_t num_sblocks = rankbv_numsblocks(rbv);
-    rbv->S[0] = 0;
-    for (i=1; i<num_sblocks; i++) {
-        rbv->S[i*rbv->factor+i] = rbv->S[(i-1)*rbv->factor+(i-1)];
-        tmp = 0;
-        start = (i-1)*rbv->factor+i; stop = start+rbv->factor;
-        for (j=start; j<stop; j++) tmp += __builtin_popcountll(rbv->S[j]);
-        rbv->S[i*rbv->factor+i] += tmp;
+    rankbv_buildjob_t job[RANKBV_MAXTHREADS];
+    if (threads > RANKBV_MAXTHREADS) threads = RANKBV_MAXTHREADS;
+    if (threads > num_sblocks) threads = num_sblocks;
+    if (threads <= 1) {
+        rankbv_build(rbv);
+        return;
+    }
+
+    /* count every superblock range on its own, then shift the ranges by
+     * the ones before them */
+    for (t=0; t<threads; t++) {
+        job[t].rbv = rbv;
+        job[t].sb0 = (num_sblocks*t)/threads;
+        job[t].sb1 = (num_sblocks*(t+1))/threads;
+    }
+    rankbv_runjobs(rankbv_buildcounts_job,job,sizeof(rankbv_buildjob_t),threads);
+    uint64_t before = 0;
+    for (t=0; t<threads; t++) {
+        uint64_t ones = job[t].ones;
+        job[t].ones = before;
+        before += ones;
     }
+    rankbv_runjobs(rankbv_addcounts_job,job+1,sizeof(rankbv_buildjob_t),threads-1);
     rbv->ones = rankbv_rank1(rbv,rbv->n-1);
+
+    if (rbv->sr) rankbv_buildsamples(rbv);
+}
+
+void
+rankbv_buildsamples(rankbv_t* rbv)
+{
+    size_t i;
+    size_t ints = rbv->n/RBVW+1;
+    size_t zeros = rbv->n - rbv->ones;
+    uint64_t* samples1 = rankbv_getsamples(rbv);
+    uint64_t* samples0 = samples1 + (rbv->ones ? (rbv->ones-1)/rbv->sr+1 : 0);
+    size_t next1 = 1, next0 = 1;  /* rank of the next one/zero to sample */
+    size_t ones_before = 0, zeros_before = 0;
+
+    for (i=0; i<ints; i++) {
+        if (i%rbv->factor == 0) {
+            /* skip superblocks that hold neither a sampled one nor zero */
+            size_t sb = i/rbv->factor;
+            if (sb+1 < rankbv_numsblocks(rbv)) {
+                size_t c1 = rbv->S[rankbv_sblock(rbv,sb+1)] - ones_before;
+                size_t c0 = rbv->s - c1;
+                if (ones_before+c1 < next1 && zeros_before+c0 < next0) {
+                    ones_before += c1;
+                    zeros_before += c0;
+                    i += rbv->factor-1;
+                    continue;
+                }
+            }
+        }
+        uint64_t word = rbv->S[rankbv_word(rbv,i)];
+        size_t c1 = __builtin_popcountll(word);
+        size_t c0 = RBVW - c1;
+        while (next1 <= rbv->ones && ones_before+c1 >= next1) {
+            *samples1++ = i*RBVW + rankbv_selectword(word,next1-ones_before);
+            next1 += rbv->sr;
+        }
+        while (next0 <= zeros && zeros_before+c0 >= next0) {
+            *samples0++ = i*RBVW + rankbv_selectword(~word,next0-zeros_before);
+            next0 += rbv->sr;
+        }
+        ones_before += c1;
+        zeros_before += c0;
+    }
+}
+
+int
+rankbv_builder_init(rankbv_builder_t* b,size_t n,uint32_t f)
+{
+    b->rbv = rankbv_init(n,f);
+    b->pos = 0;
+    b->word = 0;
+    b->ones = b->zeros = 0;
+    b->next1 = b->next0 = 1;
+    return b->rbv != NULL;
+}
+
+/* store the completed word pos/RBVW-1 (or the partial last word) */
+void
+rankbv_builder_flush(rankbv_builder_t* b)
+{
+    rankbv_t* rbv = b->rbv;
+    size_t w = (b->pos-1)/RBVW;
+    uint64_t word = b->word;
+    size_t sb = w/rbv->factor;
+
+    if (w%rbv->factor == 0) rbv->S[rankbv_sblock(rbv,sb)] = b->ones;
+    if (rbv->hdr == 2) {
+        rbv->S[rankbv_sblock(rbv,sb)+1] |= (uint64_t)(b->ones - rbv->S[rankbv_sblock(rbv,sb)])
+                                           << (RANKBV_RELBITS*(w%rbv->factor));
+    }
+    rbv->S[rankbv_word(rbv,w)] = word;
+
+    size_t c1 = __builtin_popcountll(word);
+    size_t valid = rbv->n - w*RBVW < RBVW ? rbv->n - w*RBVW : RBVW;
+    size_t c0 = valid - c1;
+    if (rbv->sr) {
+        /* ones are sampled from the front, zeros from the back of the
+         * sample area until the number of ones is known */
+        uint64_t* samples = rankbv_getsamples(rbv);
+        uint64_t* zsamples = samples + rankbv_numsamples(rbv) - 1;
+        while (b->ones+c1 >= b->next1) {
+            samples[(b->next1-1)/rbv->sr] = w*RBVW + rankbv_selectword(word,b->next1-b->ones);
+            b->next1 += rbv->sr;
+        }
+        while (b->zeros+c0 >= b->next0) {
+            *(zsamples - (b->next0-1)/rbv->sr) = w*RBVW + rankbv_selectword(~word,b->next0-b->zeros);
+            b->next0 += rbv->sr;
+        }
+    }
+    b->ones += c1;
+    b->zeros += c0;
+    b->word = 0;
+}
+
+void
+rankbv_builder_pushword(rankbv_builder_t* b,uint64_t w,size_t bits)
+{
+    size_t off = b->pos%RBVW;
+    if (bits < RBVW) w &= (1ULL<<bits)-1;
+    b->word |= w << off;
+    b->pos += bits;
+    if (off+bits >= RBVW) {
+        size_t pos = b->pos;
+        b->pos = pos - (off+bits-RBVW);  /* end of the completed word */
+        rankbv_builder_flush(b);
+        b->pos = pos;
+        b->word = off ? w >> (RBVW-off) : 0;
+    }
+}
+
+/* streaming writer. a superblock is kept until it is complete and then
+ * written, sample positions go to two temporary files until the number
+ * of ones (and so the start of the zero samples) is known */
+int
+rankbv_writer_init(rankbv_writer_t* w,FILE* f,size_t n,uint32_t factor)
+{
+    memset(w,0,sizeof(rankbv_writer_t));
+    rankbv_layout(&w->hdr,n,factor,RANKBV_SAMPLERATE);
+    w->f = f;
+    w->next1 = w->next0 = 1;
+    w->sbwords = w->hdr.hdr + w->hdr.factor;
+    w->sb = (uint64_t*) memalloc_calloc(w->sbwords*sizeof(uint64_t));
+    if (!w->sb) return 0;
+    w->s1 = tmpfile();
+    w->s0 = tmpfile();
+    w->off = ftello(f);
+    if (!w->s1 || !w->s0 || w->off < 0) {
+        fprintf(stderr,"ERROR: rankbv_writer_init() cannot create sample files\n");
+        rankbv_writer_abort(w);
+        return 0;
+    }
+
+    /* size and header, the header is written again once ones is known */
+    uint64_t bytes = rankbv_spaceusage(&w->hdr);
+    if (fwrite(&bytes,sizeof(uint64_t),1,f) != 1 ||
+        fwrite(&w->hdr,sizeof(rankbv_t),1,f) != 1) {
+        fprintf(stderr,"ERROR: rankbv_writer_init() cannot write\n");
+        rankbv_writer_abort(w);
+        return 0;
+    }
+    return 1;
+}
+
+void
+rankbv_writer_abort(rankbv_writer_t* w)
+{
+    if (w->s1) fclose(w->s1);
+    if (w->s0) fclose(w->s0);
+    memalloc_free(w->sb,w->sbwords*sizeof(uint64_t));
+    w->s1 = w->s0 = NULL;
+    w->sb = NULL;
+}
+
+/* a failed write is kept in w->err and reported by flush and finish */
+static void
+rankbv_writer_put(rankbv_writer_t* w,FILE* f,const void* mem,size_t bytes)
+{
+    if (!w->err && bytes && fwrite(mem,bytes,1,f) != 1) {
+        fprintf(stderr,"ERROR: rankbv_writer cannot write\n");
+        w->err = 1;
+    }
+}
+
+/* the same steps as rankbv_builder_flush, into the superblock buffer */
+int
+rankbv_writer_flush(rankbv_writer_t* w)
+{
+    rankbv_t* rbv = &w->hdr;
+    size_t wi = (w->pos-1)/RBVW;
+    uint64_t word = w->word;
+    size_t j = wi%rbv->factor;
+
+    if (j == 0) {
+        memset(w->sb,0,w->sbwords*sizeof(uint64_t));
+        w->sb[0] = w->ones;
+    }
+    if (rbv->hdr == 2) w->sb[1] |= (uint64_t)(w->ones - w->sb[0]) << (RANKBV_RELBITS*j);
+    w->sb[rbv->hdr+j] = word;
+    w->sbfill = j+1;
+    if (w->sbfill == rbv->factor) {
+        rankbv_writer_put(w,w->f,w->sb,w->sbwords*sizeof(uint64_t));
+        w->sbfill = 0;
+    }
+
+    size_t c1 = __builtin_popcountll(word);
+    size_t valid = rbv->n - wi*RBVW < RBVW ? rbv->n - wi*RBVW : RBVW;
+    size_t c0 = valid - c1;
+    while (w->ones+c1 >= w->next1) {
+        uint64_t x = wi*RBVW + rankbv_selectword(word,w->next1-w->ones);
+        rankbv_writer_put(w,w->s1,&x,sizeof(uint64_t));
+        w->next1 += rbv->sr;
+    }
+    while (w->zeros+c0 >= w->next0) {
+        uint64_t x = wi*RBVW + rankbv_selectword(~word,w->next0-w->zeros);
+        rankbv_writer_put(w,w->s0,&x,sizeof(uint64_t));
+        w->next0 += rbv->sr;
+    }
+    w->ones += c1;
+    w->zeros += c0;
+    w->word = 0;
+    return !w->err;
+}
+
+/* append the samples of s behind the data */
+static size_t
+rankbv_writer_copy(rankbv_writer_t* w,FILE* s)
+{
+    uint64_t buf[512];
+    size_t m,total = 0;
+    rewind(s);
+    while ((m = fread(buf,sizeof(uint64_t),512,s)) > 0) {
+        rankbv_writer_put(w,w->f,buf,m*sizeof(uint64_t));
+        total += m;
+    }
+    if (ferror(s)) w->err = 1;
+    return total;
+}
+
+int
+rankbv_writer_finish(rankbv_writer_t* w)
+{
+    rankbv_t* rbv = &w->hdr;
+    size_t ints = rbv->n/RBVW+1;
+
+    /* complete the partial word and the remaining empty words */
+    w->pos = (w->pos/RBVW)*RBVW;
+    while (!w->err && w->pos < ints*RBVW) {
+        w->pos += RBVW;
+        rankbv_writer_flush(w);
+    }
+    if (w->sbfill) rankbv_writer_put(w,w->f,w->sb,(rbv->hdr+w->sbfill)*sizeof(uint64_t));
+    rbv->ones = w->ones;
+
+    /* one samples, zero samples, then the unused rest of the area */
+    size_t m = rankbv_writer_copy(w,w->s1) + rankbv_writer_copy(w,w->s0);
+    uint64_t zero = 0;
+    for (; !w->err && m<rankbv_numsamples(rbv); m++) rankbv_writer_put(w,w->f,&zero,sizeof(uint64_t));
+
+    off_t end = ftello(w->f);
+    if (!w->err && (end < 0 || fseeko(w->f,w->off+sizeof(uint64_t),SEEK_SET) != 0)) {
+        fprintf(stderr,"ERROR: rankbv_writer_finish() cannot seek\n");
+        w->err = 1;
+    }
+    if (!w->err) {
+        rankbv_writer_put(w,w->f,rbv,sizeof(rankbv_t));
+        if (fseeko(w->f,end,SEEK_SET) != 0) w->err = 1;
+    }
+    rankbv_writer_abort(w);
+    return !w->err;
+}
+
+rankbv_t*
+rankbv_builder_finish(rankbv_builder_t* b)
+{
+    rankbv_t* rbv = b->rbv;
+    size_t ints = rbv->n/RBVW+1;
+
+    /* complete the partial word and the remaining empty words so every
+     * superblock gets its counter */
+    b->pos = (b->pos/RBVW)*RBVW;
+    while (b->pos < ints*RBVW) {
+        b->pos += RBVW;
+        rankbv_builder_flush(b);
+    }
+    rbv->ones = b->ones;
+
+    if (rbv->sr) {
+        /* move the zero samples behind the one samples */
+        uint64_t* samples = rankbv_getsamples(rbv);
+        size_t total = rankbv_numsamples(rbv);
+        size_t n1 = rbv->ones ? (rbv->ones-1)/rbv->sr+1 : 0;
+        size_t n0 = (rbv->n > rbv->ones) ? (rbv->n-rbv->ones-1)/rbv->sr+1 : 0;
+        uint64_t* z = samples + total - n0;
+        size_t i;
+        for (i=0; i<n0/2; i++) {
+            uint64_t tmp = z[i];
+            z[i] = z[n0-1-i];
+            z[n0-1-i] = tmp;
+        }
+        memmove(samples+n1,z,n0*sizeof(uint64_t));
+        if (total > n1+n0) memset(samples+n1+n0,0,(total-n1-n0)*sizeof(uint64_t));
+    }
+    b->rbv = NULL;
+    return rbv;
 }
 
 int
@@ -106,17 +683,85 @@ rankbv_rank1(rankbv_t* rbv,size_t i)
     size_t j;
     i++;
     uint64_t bs = i/rbv->s;
-    uint64_t SBlock = bs*rbv->factor+bs;
+    uint64_t SBlock = rankbv_sblock(rbv,bs);
     uint64_t resp = rbv->S[SBlock];
-    size_t start = SBlock+1;
+    size_t start = SBlock+rbv->hdr;
     size_t stop = start+(i%rbv->s)/RBVW;
     uint64_t* S = (uint64_t*) rbv->S;
-    for (j=start; j<stop; j++) resp+=__builtin_popcountll(S[j]);
-    resp += __builtin_popcountll(S[stop]&((1LL<<(i &rankbv_mask63))-1));
+    if (rbv->hdr == 2) {
+        /* relative count lives in the same line as the data */
+        resp += (S[SBlock+1] >> (RANKBV_RELBITS*(stop-start))) & ((1<<RANKBV_RELBITS)-1);
+    } else if (stop-start >= RANKBV_VECSCAN) {
+        resp += rankbv_popcount_kernel(S+start,stop-start);
+    } else {
+        for (j=start; j<stop; j++) resp+=__builtin_popcountll(S[j]);
+    }
+    resp += __builtin_popcountll(S[stop]&((1ULL<<(i &rankbv_mask63))-1));
     return resp;
 }
 
 
+void
+rankbv_access_batch(rankbv_t* rbv,const size_t* pos,size_t m,int* out)
+{
+    size_t i,j;
+    for (i=0; i<m; i+=RANKBV_BATCH) {
+        size_t stop = i+RANKBV_BATCH < m ? i+RANKBV_BATCH : m;
+        for (j=i; j<stop; j++)
+            __builtin_prefetch(&rbv->S[rankbv_word(rbv,pos[j]/RBVW)]);
+        for (j=i; j<stop; j++) out[j] = rankbv_getbit(rbv,pos[j]);
+    }
+}
+
+void
+rankbv_rank1_batch(rankbv_t* rbv,const size_t* pos,size_t m,size_t* out)
+{
+    size_t i,j;
+    for (i=0; i<m; i+=RANKBV_BATCH) {
+        size_t stop = i+RANKBV_BATCH < m ? i+RANKBV_BATCH : m;
+        for (j=i; j<stop; j++) rankbv_prefetch(rbv,pos[j]);
+        for (j=i; j<stop; j++) out[j] = rankbv_rank1(rbv,pos[j]);
+    }
+}
+
+static void
+rankbv_select_batch(rankbv_t* rbv,const size_t* x,size_t m,size_t* out,int bit)
+{
+    size_t i,j;
+    uint64_t* samples = NULL;
+    if (rbv->sr) {
+        samples = rankbv_getsamples(rbv);
+        if (!bit) samples += rbv->ones ? (rbv->ones-1)/rbv->sr+1 : 0;
+    }
+    for (i=0; i<m; i+=RANKBV_BATCH) {
+        size_t stop = i+RANKBV_BATCH < m ? i+RANKBV_BATCH : m;
+        if (rbv->sr) {
+            /* the samples first, then the lines they point to */
+            for (j=i; j<stop; j++)
+                if (x[j]) __builtin_prefetch(&samples[(x[j]-1)/rbv->sr]);
+            for (j=i; j<stop; j++) {
+                size_t k = (x[j]-1)/rbv->sr;
+                if (x[j] && x[j] <= (bit ? rbv->ones : rbv->n-rbv->ones))
+                    __builtin_prefetch(&rbv->S[rankbv_word(rbv,samples[k]/RBVW)]);
+            }
+        }
+        if (bit) for (j=i; j<stop; j++) out[j] = rankbv_select1(rbv,x[j]);
+        else for (j=i; j<stop; j++) out[j] = rankbv_select0(rbv,x[j]);
+    }
+}
+
+void
+rankbv_select0_batch(rankbv_t* rbv,const size_t* x,size_t m,size_t* out)
+{
+    rankbv_select_batch(rbv,x,m,out,0);
+}
+
+void
+rankbv_select1_batch(rankbv_t* rbv,const size_t* x,size_t m,size_t* out)
+{
+    rankbv_select_batch(rbv,x,m,out,1);
+}
+
 size_t
 rankbv_ones(rankbv_t* rbv)
 {
@@ -144,65 +789,53 @@ rankbv_select0(rankbv_t* rbv,size_t x)
 
     size_t nsb = rankbv_numsblocks(rbv);
     size_t l=0, r=nsb-1;
-    size_t mid=(l+r)/2;
-    size_t sblock = mid*rbv->factor+mid;
-    size_t rankmid = (mid*rbv->s) - rbv->S[sblock];
-    /* binary search over first level rank structure */
-    while (l<=r) {
-        if (rankmid<x)
-            l = mid+1;
-        else
-            r = mid-1;
-        mid = (l+r)/2;
-        sblock = mid*rbv->factor+mid;
-        rankmid = (mid*rbv->s) - rbv->S[sblock];
-    }
-
-    /* sequential search using popcount over a int */
-    x-=rankmid;
-    sblock++;
-    size_t zeros = RBVW - __builtin_popcountll(rbv->S[sblock]);
-    size_t ints = nsb + rbv->n/RBVW+1;
-    size_t skip = 0;
-    while (zeros < x) {
-        x-=zeros; sblock++;
-        if (sblock > ints) return rbv->n;
-        zeros = RBVW- __builtin_popcountll(rbv->S[sblock]);
-        skip++;
-    }
-
-    //sequential search using popcount over a char
-    /* binsearch over integer */
-    uint64_t j = rbv->S[sblock];
-    sblock=  mid*rbv->s + (skip*RBVW);
-    rankmid = 32 - __builtin_popcount(j&0xFFFFFFFF);
-    if (rankmid < x) {
-        j=j>>32;
-        x-=rankmid;
-        sblock+=32;
-        rankmid = 16 - __builtin_popcount(j&0x0000FFFF);
-        if (rankmid < x) {
-            j=j>>16;
-            x-=rankmid;
-            sblock+=16;
-            rankmid = 8 - __builtin_popcount(j&0x000000FF);
-            if (rankmid < x) {
-                j=j>>8;
-                x-=rankmid;
-                sblock+=8;
-            }
+    size_t w = 0, zeros;
+    uint64_t word = 0;
+    int sampled = 0;
+
+    if (rbv->sr) {
+        /* restrict the search to the superblocks between two samples */
+        size_t ones1 = rbv->ones ? (rbv->ones-1)/rbv->sr+1 : 0;
+        size_t nsamples = (rbv->n-rbv->ones-1)/rbv->sr+1;
+        uint64_t* samples = rankbv_getsamples(rbv) + ones1;
+        size_t k = (x-1)/rbv->sr;
+        size_t p = samples[k];
+        x -= k*rbv->sr;
+        if (x == 1) return p;
+        l = p/rbv->s;
+        if (k+1 < nsamples) r = samples[k+1]/rbv->s;
+        if (l == r) {
+            /* scan forward from the sampled zero */
+            x--;
+            w = p/RBVW;
+            word = ~rbv->S[rankbv_word(rbv,w)] & ~((2ULL<<(p%RBVW))-1);
+            sampled = 1;
+        } else {
+            x += k*rbv->sr;
+        }
+    }
+
+    if (!sampled) {
+        /* binary search over first level rank structure */
+        while (l<r) {
+            size_t mid = (l+r+1)/2;
+            if (mid*rbv->s - rbv->S[rankbv_sblock(rbv,mid)] < x)
+                l = mid;
+            else
+                r = mid-1;
         }
+        x -= l*rbv->s - rbv->S[rankbv_sblock(rbv,l)];
+        w = l*rbv->factor;
+        word = ~rbv->S[rankbv_word(rbv,w)];
     }
 
-    // then sequential search bit a bit
-    while (x>0) {
-        if (j%2 == 0) x--;
-        j=j>>1;
-        sblock++;
+    /* sequential search using popcount over the words */
+    while ((zeros = __builtin_popcountll(word)) < x) {
+        x-=zeros;
+        w++;
+        word = ~rbv->S[rankbv_word(rbv,w)];
     }
-    sblock--;
-    if (sblock > rbv->n)  return rbv->n;
-    else return sblock;
+    return w*RBVW + rankbv_selectword(word,x);
 }
 
 
@@ -214,59 +847,52 @@ rankbv_select1(rankbv_t* rbv,size_t x)
 
     size_t nsb = rankbv_numsblocks(rbv);
     size_t l=0, r=nsb-1;
-    size_t mid=(l+r)/2;
-    size_t sblock = mid*rbv->factor+mid;
-    size_t rankmid = rbv->S[sblock];
-    /* binary search over first level rank structure */
-    while (l<=r) {
-        if (rankmid<x)
-            l = mid+1;
-        else
-            r = mid-1;
-        mid = (l+r)/2;
-        sblock = mid*rbv->factor+mid;
-        rankmid = rbv->S[sblock];
-    }
-    /* binary search over blocks */
-    x-=rankmid;
-    sblock++;
-    size_t ones = __builtin_popcountll(rbv->S[sblock]);
-    size_t ints = nsb + rbv->n/RBVW+1;
-    size_t skip = 0;
-    while (ones < x) {
-        x-=ones; sblock++;
-        if (sblock > ints) return rbv->n;
-        ones = __builtin_popcountll(rbv->S[sblock]);
-        skip++;
-    }
-    /* binsearch over integer */
-    uint64_t j = rbv->S[sblock];
-    sblock=  mid*rbv->s + (skip*RBVW);
-    rankmid = __builtin_popcount(j&0xFFFFFFFF);
-    if (rankmid < x) {
-        j=j>>32;
-        x-=rankmid;
-        sblock+=32;
-        rankmid = __builtin_popcount(j&0x0000FFFF);
-        if (rankmid < x) {
-            j=j>>16;
-            x-=rankmid;
-            sblock+=16;
-            rankmid = __builtin_popcount(j&0x000000FF);
-            if (rankmid < x) {
-                j=j>>8;
-                x-=rankmid;
-                sblock+=8;
-            }
+    size_t w = 0, ones;
+    uint64_t word = 0;
+    int sampled = 0;
+
+    if (rbv->sr) {
+        /* restrict the search to the superblocks between two samples */
+        size_t nsamples = (rbv->ones-1)/rbv->sr+1;
+        uint64_t* samples = rankbv_getsamples(rbv);
+        size_t k = (x-1)/rbv->sr;
+        size_t p = samples[k];
+        x -= k*rbv->sr;
+        if (x == 1) return p;
+        l = p/rbv->s;
+        if (k+1 < nsamples) r = samples[k+1]/rbv->s;
+        if (l == r) {
+            /* scan forward from the sampled one */
+            x--;
+            w = p/RBVW;
+            word = rbv->S[rankbv_word(rbv,w)] & ~((2ULL<<(p%RBVW))-1);
+            sampled = 1;
+        } else {
+            x += k*rbv->sr;
         }
     }
-    /* sequential search on bits */
-    while (x>0) {
-        if (j&1) x--;
-        j=j>>1;
-        sblock++;
+
+    if (!sampled) {
+        /* binary search over first level rank structure */
+        while (l<r) {
+            size_t mid = (l+r+1)/2;
+            if (rbv->S[rankbv_sblock(rbv,mid)] < x)
+                l = mid;
+            else
+                r = mid-1;
+        }
+        x -= rbv->S[rankbv_sblock(rbv,l)];
+        w = l*rbv->factor;
+        word = rbv->S[rankbv_word(rbv,w)];
     }
-    return sblock-1;
+
+    /* sequential search using popcount over the words */
+    while ((ones = __builtin_popcountll(word)) < x) {
+        x-=ones;
+        w++;
+        word = rbv->S[rankbv_word(rbv,w)];
+    }
+    return w*RBVW + rankbv_selectword(word,x);
 }
 
 size_t
@@ -275,8 +901,9 @@ rankbv_spaceusage(rankbv_t* rbv)
     size_t bytes;
     size_t num_sblocks = rankbv_numsblocks(rbv);
     bytes = sizeof(rankbv_t);
-    bytes += sizeof(uint64_t)*(num_sblocks); /* S[] */
+    bytes += sizeof(uint64_t)*(num_sblocks*rbv->hdr); /* S[] */
     bytes += sizeof(uint64_t)*(rbv->n/RBVW+1); /* A[] */
+    bytes += sizeof(uint64_t)*rankbv_numsamples(rbv); /* select samples */
     return bytes;
 }
 
@@ -285,14 +912,29 @@ rankbv_load(FILE* f)
 {
     size_t bytes;
     /* read space */
-    if (fread(&bytes,sizeof(size_t),1,f) != 1) {
+    if (fread(&bytes,sizeof(size_t),1,f) != 1 || bytes < sizeof(rankbv_t)) {
         fprintf(stderr,"ERROR LOADING RANKBV\n");
+        return NULL;
     }
 
     /* read the bv */
-    void* mem = rankbv_safecalloc(bytes);
+    void* mem = memalloc_calloc(bytes);
+    if (!mem) return NULL;
     if (fread(mem,bytes,1,f) != 1) {
         fprintf(stderr,"ERROR LOADING RANKBV\n");
+        memalloc_free(mem,bytes);
+        return NULL;
+    }
+    if (((rankbv_t*)mem)->version != RANKBV_VERSION) {
+        fprintf(stderr,"ERROR LOADING RANKBV: unsupported format\n");
+        memalloc_free(mem,bytes);
+        return NULL;
+    }
+    /* the header has to describe the blob it came with */
+    if (!((rankbv_t*)mem)->s || rankbv_spaceusage((rankbv_t*)mem) != bytes) {
+        fprintf(stderr,"ERROR LOADING RANKBV: bad header\n");
+        memalloc_free(mem,bytes);
+        return NULL;
     }
 
     return (rankbv_t*)mem;
@@ -301,16 +943,10 @@ rankbv_load(FILE* f)
 size_t
 rankbv_save(rankbv_t* rbv,FILE* f)
 {
-    size_t ints = rbv->n/RBVW+1;
-    size_t num_sblocks = rankbv_numsblocks(rbv);
-
-    size_t bytes = sizeof(rankbv_t) + (sizeof(uint64_t)*num_sblocks) + (sizeof(uint64_t)*ints);
+    size_t bytes = rankbv_spaceusage(rbv);
 
     fwrite(&bytes,sizeof(uint64_t),1,f);
-    fwrite(rbv,sizeof(rankbv_t),1,f);
-    fwrite(rbv->S,sizeof(uint64_t),num_sblocks,f);
-    uint64_t* B = rankbv_getdata(rbv);
-    fwrite(B,sizeof(uint64_t),ints,f);
+    fwrite(rbv,bytes,1,f);
 
     return bytes+sizeof(size_t);
 }
@@ -318,7 +954,7 @@ rankbv_save(rankbv_t* rbv,FILE* f)
 void*
 rankbv_safecalloc(size_t n)
 {
-    void* mem = calloc(n,1);
+    void* mem = memalloc_calloc(n);
     if (!mem) {
         fprintf(stderr,"ERROR: rankbv_safecalloc()");
         exit(EXIT_FAILURE);
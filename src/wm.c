@@ -0,0 +1,395 @@
+
+#include "rankbv.h"
+#include "wt.h"
+#include "wm.h"
+#include "memalloc.h"
+
+/*#define _WM_DEBUG_*/
+
+wm_t*
+wm_init(size_t n)
+{
+    wm_t* wm = (wm_t*) memalloc_calloc(sizeof(wm_t));
+    if (!wm) return NULL;
+
+    wm->n = n;
+    wm->height = 0;
+    wm->max_v = 0;
+    wm->zeros = NULL;
+    wm->levels = NULL;
+
+    return wm;
+}
+
+/* levels are built top-down, partitioning the symbols stably by the
+ * current bit into one of two ping-pong buffers */
+static int
+wm_build(wm_t* wm,uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    size_t i,lvl;
+    size_t bufbytes = ((n*bits)/RBVW+1)*sizeof(uint64_t);
+    uint64_t* buf[2];
+    uint64_t* cur = A;
+    int ok = 0;
+
+    rankbv_builder_t* bld = (rankbv_builder_t*) memalloc_calloc(wm->height*sizeof(rankbv_builder_t));
+    buf[0] = (uint64_t*) memalloc_calloc(bufbytes);
+    buf[1] = (uint64_t*) memalloc_calloc(bufbytes);
+    if (!bld || !buf[0] || !buf[1]) goto done;
+    for (lvl=0; lvl<wm->height; lvl++) {
+        if (!rankbv_builder_init(&bld[lvl],n,f)) {
+            while (lvl--) rankbv_free(rankbv_builder_finish(&bld[lvl]));
+            goto done;
+        }
+    }
+
+    for (lvl=0; lvl<wm->height; lvl++) {
+        size_t z = 0;
+        for (i=0; i<n; i++) {
+            int bit = wt_marked(wt_getsym(cur,bits,i),wm->height,lvl);
+            rankbv_builder_push(&bld[lvl],bit);
+            z += !bit;
+        }
+        wm->zeros[lvl] = z;
+        wm->levels[lvl] = rankbv_builder_finish(&bld[lvl]);
+
+        if (lvl+1 == wm->height) break;
+        /* zeros keep their order in front, ones follow */
+        uint64_t* next = buf[lvl&1];
+        size_t cz = 0, co = z;
+        for (i=0; i<n; i++) {
+            uint64_t sym = wt_getsym(cur,bits,i);
+            if (wt_marked(sym,wm->height,lvl)) wt_setsym(next,bits,co++,sym);
+            else wt_setsym(next,bits,cz++,sym);
+        }
+        cur = next;
+    }
+    ok = 1;
+
+done:
+    memalloc_free(buf[0],bufbytes);
+    memalloc_free(buf[1],bufbytes);
+    memalloc_free(bld,wm->height*sizeof(rankbv_builder_t));
+    return ok;
+}
+
+wm_t*
+wm_create(uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    size_t i;
+    wm_t* wm = wm_init(n);
+    if (!wm) return NULL;
+
+    /* calc height */
+    for (i=0; i<n; i++) wm->max_v = wt_max(wt_getsym(A,bits,i),wm->max_v);
+    wm->height = wt_bits(wm->max_v);
+
+#ifdef _WM_DEBUG_
+    fprintf(stdout,"wm::create() height = %u max_v %zu\n",wm->height,wm->max_v);
+#endif
+
+    wm->zeros = (uint64_t*) memalloc_calloc(wm->height*sizeof(uint64_t));
+    wm->levels = (rankbv_t**) memalloc_calloc(wm->height*sizeof(rankbv_t*));
+    if (!wm->zeros || !wm->levels || !wm_build(wm,A,bits,n,f)) {
+        wm_free(wm);
+        return NULL;
+    }
+
+    return wm;
+}
+
+void
+wm_free(wm_t* wm)
+{
+    size_t i;
+    if (wm) {
+        if (wm->levels) {
+            for (i=0; i<wm->height; i++) rankbv_free(wm->levels[i]);
+            memalloc_free(wm->levels,wm->height*sizeof(rankbv_t*));
+        }
+        memalloc_free(wm->zeros,wm->height*sizeof(uint64_t));
+        memalloc_free(wm,sizeof(wm_t));
+    }
+}
+
+uint64_t
+wm_access(wm_t* wm,size_t pos)
+{
+    uint32_t lvl;
+    uint64_t sym = 0;
+    rankbv_t* bs;
+
+    for (lvl=0; lvl<wm->height; lvl++) {
+        bs = wm->levels[lvl];
+        if (rankbv_access(bs,pos)) {
+            sym = wt_mark(sym,wm->height,lvl);
+            pos = wm->zeros[lvl] + wm_ones(bs,pos);
+        } else {
+            pos = pos - wm_ones(bs,pos);
+        }
+    }
+    return sym;
+}
+
+size_t
+wm_rank(wm_t* wm,uint64_t sym,size_t pos)
+{
+    uint32_t lvl;
+    size_t start = 0, end = pos+1;
+    rankbv_t* bs;
+
+    if (sym > wm->max_v) return 0;
+    /* [start,end) is the part of [0,pos] holding the prefix of sym */
+    for (lvl=0; lvl<wm->height; lvl++) {
+        bs = wm->levels[lvl];
+        if (wt_marked(sym,wm->height,lvl)) {
+            start = wm->zeros[lvl] + wm_ones(bs,start);
+            end = wm->zeros[lvl] + wm_ones(bs,end);
+        } else {
+            start = start - wm_ones(bs,start);
+            end = end - wm_ones(bs,end);
+        }
+        if (start == end) return 0;
+    }
+    return end-start;
+}
+
+size_t
+wm_count(wm_t* wm,uint64_t sym)
+{
+    if (!wm->n) return 0;
+    return wm_rank(wm,sym,wm->n-1);
+}
+
+size_t
+wm_select(wm_t* wm,uint64_t sym,size_t j)
+{
+    uint32_t lvl;
+    size_t pos = 0, end = wm->n;
+    rankbv_t* bs;
+
+    if (sym > wm->max_v || !j) return (size_t)(-1);
+    /* [pos,end) holds sym on the last level */
+    for (lvl=0; lvl<wm->height; lvl++) {
+        bs = wm->levels[lvl];
+        if (wt_marked(sym,wm->height,lvl)) {
+            pos = wm->zeros[lvl] + wm_ones(bs,pos);
+            end = wm->zeros[lvl] + wm_ones(bs,end);
+        } else {
+            pos = pos - wm_ones(bs,pos);
+            end = end - wm_ones(bs,end);
+        }
+    }
+    if (j > end-pos) return (size_t)(-1);
+    pos += j-1;
+
+    /* and back up */
+    lvl = wm->height;
+    while (lvl--) {
+        bs = wm->levels[lvl];
+        if (wt_marked(sym,wm->height,lvl))
+            pos = rankbv_select1(bs,pos-wm->zeros[lvl]+1);
+        else
+            pos = rankbv_select0(bs,pos+1);
+    }
+    return pos;
+}
+
+wt_quant_t
+wm_quantile_freq(wm_t* wm,size_t left,size_t right,size_t q)
+{
+    /* decrease q as the smallest element q=1 is
+     * found by searching for 0 */
+    q--;
+    uint32_t lvl;
+    uint64_t sym = 0;
+    size_t start = left, end = right+1;
+    rankbv_t* bs;
+
+    for (lvl=0; lvl<wm->height; lvl++) {
+        bs = wm->levels[lvl];
+        size_t ones_start = wm_ones(bs,start);
+        size_t ones_end = wm_ones(bs,end);
+        size_t num_zeros = (end-start) - (ones_end-ones_start);
+
+        if (q >= num_zeros) { /* go right */
+            sym = wt_mark(sym,wm->height,lvl);
+            q = q - num_zeros;
+            start = wm->zeros[lvl] + ones_start;
+            end = wm->zeros[lvl] + ones_end;
+        } else {
+            start = start - ones_start;
+            end = end - ones_end;
+        }
+    }
+    wt_quant_t qf;
+    qf.sym = sym;
+    qf.freq = end-start;
+    return qf;
+}
+
+uint64_t
+wm_quantile(wm_t* wm,size_t left,size_t right,size_t quantile)
+{
+    wt_quant_t q = wm_quantile_freq(wm,left,right,quantile);
+    return q.sym;
+}
+
+/* best-first descent as in wt_mostfrequent on the shared context heap,
+ * a record keeps the inclusive range [left,right] of level lvl */
+const wt_result_t*
+wm_mostfrequent_ctx(wm_t* wm,wt_ctx_t* ctx,size_t left,size_t right,size_t k)
+{
+    wt_topknode_t cr,child;
+
+    ctx->n = 0;
+    ctx->res.m = 0;
+    ctx->weighted = 0;
+    if (!wm->n || left > right) return &ctx->res;
+    cr.left = left;
+    cr.right = right;
+    cr.start = cr.end = 0;
+    cr.lvl = 0;
+    cr.sym = 0;
+    cr.bound = 0;
+    if (!wt_ctx_push(ctx,&cr)) return NULL;
+
+    while (ctx->n > 0) {
+        wt_ctx_pop(ctx,&cr);
+
+        if (cr.lvl == wm->height) {  /* leaf */
+            if (!wt_ctx_additem(ctx,cr.sym,wt_topknode_size(&cr),0)) return NULL;
+            if (ctx->res.m == k) {  /* we got the top-k */
+                break;
+            }
+            continue;
+        }
+
+        rankbv_t* bs = wm->levels[cr.lvl];
+        size_t ones_start = wm_ones(bs,cr.left);
+        size_t ones_end = wm_ones(bs,cr.right+1);
+        size_t num_ones = ones_end - ones_start;
+        size_t num_zeros = wt_topknode_size(&cr) - num_ones;
+
+        child = cr;
+        child.lvl = cr.lvl+1;
+        if (num_ones) {
+            child.left = wm->zeros[cr.lvl]+ones_start;
+            child.right = wm->zeros[cr.lvl]+ones_end-1;
+            child.sym = wt_mark(cr.sym,wm->height,cr.lvl);
+            if (!wt_ctx_push(ctx,&child)) return NULL;
+        }
+        if (num_zeros) {
+            child.left = cr.left-ones_start;
+            child.right = cr.right-ones_end;
+            child.sym = cr.sym;
+            if (!wt_ctx_push(ctx,&child)) return NULL;
+        }
+    }
+    return &ctx->res;
+}
+
+wt_result_t*
+wm_mostfrequent(wm_t* wm,size_t left,size_t right,size_t k)
+{
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    return wt_ctx_result(&ctx,wm_mostfrequent_ctx(wm,&ctx,left,right,k));
+}
+
+void
+wm_print(wm_t* wm)
+{
+    size_t i;
+    if (wm) {
+        for (i=0; i<wm->height; i++) {
+            fprintf(stdout,"(%zu) z=%zu ",i,wm->zeros[i]);
+            rankbv_print(wm->levels[i]);
+        }
+    }
+}
+
+size_t
+wm_spaceusage(wm_t* wm)
+{
+    size_t i;
+    size_t levelspace = 0;
+    for (i=0; i<wm->height; i++) {
+        levelspace += rankbv_spaceusage(wm->levels[i]);
+    }
+    return sizeof(wm_t) +
+           wm->height*sizeof(uint64_t) +
+           levelspace;
+}
+
+wm_t*
+wm_load(FILE* f)
+{
+    size_t i;
+    uint64_t magic;
+    uint32_t version;
+    if (fread(&magic,sizeof(uint64_t),1,f)!=1 || fread(&version,sizeof(uint32_t),1,f)!=1 ||
+        magic != WM_MAGIC || version != WM_VERSION) {
+        fprintf(stderr,"ERROR: wm_load() unsupported format\n");
+        return NULL;
+    }
+    wm_t* wml = wm_init(0);
+    if (!wml) return NULL;
+    if (fread(&wml->n,sizeof(uint64_t),1,f)!=1 ||
+        fread(&wml->height,sizeof(uint32_t),1,f)!=1 ||
+        fread(&wml->max_v,sizeof(uint64_t),1,f)!=1 ||
+        wml->height > RBVW) {
+        wml->height = 0;
+        goto fail;
+    }
+
+#ifdef _WM_DEBUG_
+    fprintf(stdout,"WM::Load() n=%zu height=%u max_v=%zu\n",wml->n,wml->height,wml->max_v);
+#endif
+
+    wml->zeros = (uint64_t*) memalloc_calloc(wml->height*sizeof(uint64_t));
+    wml->levels = (rankbv_t**) memalloc_calloc(wml->height*sizeof(rankbv_t*));
+    if (!wml->zeros || !wml->levels) goto fail;
+    if (fread(wml->zeros,sizeof(uint64_t),wml->height,f)!=wml->height) goto fail;
+    for (i=0; i<wml->height; i++) {
+        wml->levels[i] = rankbv_load(f);
+        if (!wml->levels[i] || rankbv_length(wml->levels[i]) != wml->n ||
+            wml->zeros[i] != wml->n - rankbv_ones(wml->levels[i])) goto fail;
+    }
+    return wml;
+fail:
+    fprintf(stderr,"ERROR: wm_load() cannot read the index\n");
+    wm_free(wml);
+    return NULL;
+}
+
+void
+wm_save(wm_t* wm,FILE* f)
+{
+#ifdef _WM_DEBUG_
+    fprintf(stdout,"WM::Write() n=%zu height=%u max_v=%zu\n",wm->n,wm->height,wm->max_v);
+#endif
+    size_t i;
+    uint64_t magic = WM_MAGIC;
+    uint32_t version = WM_VERSION;
+    if (fwrite(&magic,sizeof(uint64_t),1,f)!=1 || fwrite(&version,sizeof(uint32_t),1,f)!=1 ||
+        fwrite(&(wm->n),sizeof(uint64_t),1,f)!=1) {
+        fprintf(stdout,"error writing wm->n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(wm->height),sizeof(uint32_t),1,f)!=1) {
+        fprintf(stdout,"error writing wm->height\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(wm->max_v),sizeof(uint64_t),1,f)!=1) {
+        fprintf(stdout,"error writing wm->max_v\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(wm->zeros,sizeof(uint64_t),wm->height,f)!=wm->height) {
+        fprintf(stdout,"error writing wm->zeros\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i=0; i<wm->height; i++) {
+        rankbv_save(wm->levels[i],f);
+    }
+}
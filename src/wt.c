@@ -1,143 +1,1115 @@
 
 #include "rankbv.h"
+#include "occ.h"
 #include "wt.h"
 #include "cbheap.h"
+#include "memalloc.h"
 
 /*#define _WT_DEBUG_*/
+
+/* optional parts of the index file */
+#define WT_HASOCC       1
+#define WT_HASALPHA     2
 #include <time.h>
+#include <string.h>
+#include <sys/stat.h>
 
 wt_t*
 wt_init(size_t n)
 {
-    wt_t* wt = (wt_t*) wt_safecalloc(sizeof(wt_t));
+    wt_t* wt = (wt_t*) memalloc_calloc(sizeof(wt_t));
+    if (!wt) return NULL;
 
     wt->n = n;
     wt->height = 0;
     wt->occ = NULL;
     wt->bittree = NULL;
     wt->max_v = 0;
+    wt->sigma = 0;
+    wt->alpha = NULL;
 
     return wt;
 }
 
-wt_t*
-wt_create(uint64_t* A,size_t bits,size_t n,uint32_t f)
+/* leads wt_save and wt_create_from_file output */
+static int
+wt_savemagic(FILE* f)
 {
-    size_t i;
-    wt_t* wt = wt_init(n);
+    uint64_t magic = WT_MAGIC;
+    uint32_t version = WT_VERSION;
+    return fwrite(&magic,sizeof(uint64_t),1,f) == 1 && fwrite(&version,sizeof(uint32_t),1,f) == 1;
+}
 
-    /* calc height */
-    for (i=0; i<n; i++) wt->max_v = wt_max(wt_getsym(A,bits,i),wt->max_v);
-    wt->height = wt_bits(wt->max_v);
+static int
+wt_symcmp(const void* a,const void* b)
+{
+    uint64_t sa = *(const uint64_t*)a;
+    uint64_t sb = *(const uint64_t*)b;
+    if (sa < sb) return -1;
+    if (sa > sb) return 1;
+    return 0;
+}
 
-#ifdef _WT_DEBUG_
-    fprintf(stdout,"wt::create() height = %u max_v %u\n",wt->height,wt->max_v);
-#endif
+/* collect the symbols that occur into alpha. A is only read, symbols
+ * are translated to codes as the levels are built */
+static int
+wt_remap(wt_t* wt,uint64_t* A,size_t bits,size_t n)
+{
+    size_t i,j;
+    size_t bytes = n*sizeof(uint64_t);
+    uint64_t* sorted = (uint64_t*) memalloc_calloc(bytes);
+    if (!sorted) return 0;
+    for (i=0; i<n; i++) sorted[i] = wt_getsym(A,bits,i);
+    qsort(sorted,n,sizeof(uint64_t),wt_symcmp);
+    for (i=0; i<n; i++) wt->sigma += (!i || sorted[i] != sorted[i-1]);
+
+    wt->alpha = (uint64_t*) memalloc_calloc(wt->sigma*sizeof(uint64_t));
+    if (!wt->alpha) {
+        memalloc_free(sorted,bytes);
+        return 0;
+    }
+    for (i=0,j=0; i<n; i++) {
+        if (!i || sorted[i] != sorted[i-1]) wt->alpha[j++] = sorted[i];
+    }
+    memalloc_free(sorted,bytes);
+    return 1;
+}
 
-    /* count occs */
-    uint64_t* occs = (uint64_t*) wt_safecalloc((wt->max_v+1)*sizeof(uint64_t));
-    for (i=0; i<n; i++) occs[wt_getsym(A,bits,i)]++;
-    /* cummulative counts */
-    for (i=1; i<=wt->max_v; i++) occs[i] += occs[i-1];
+/* code of an input symbol, the input only holds symbols that occur */
+static inline uint64_t
+wt_inputcode(wt_t* wt,uint64_t sym)
+{
+    return wt->alpha ? wt_lowercode(wt,sym) : sym;
+}
 
-    /* build select() struct */
-    wt->occ = rankbv_init(n+1,f);
-    for (i=0; i<=wt->max_v; i++) rankbv_setbit(wt->occ,occs[i]-1);
-    rankbv_setbit(wt->occ,n);
-    rankbv_build(wt->occ);
-    free(occs);
+/* the occ table is built from a max_v+2 histogram. hashed ids or
+ * timestamps make that far larger than the text, so count() and
+ * select() find the node bounds top-down instead */
+static int
+wt_useocc(uint64_t max_v,size_t n)
+{
+    return max_v <= 2*(uint64_t)n + OCC_PLAINMAX;
+}
 
-    /* create tree */
-    wt->bittree = (rankbv_t**) wt_safecalloc(wt->height*sizeof(rankbv_t*));
-    for (i=0; i<wt->height; i++) wt->bittree[i] = rankbv_init(n,f);
+static wt_t*
+wt_create_alpha(uint64_t* A,size_t bits,size_t n,uint32_t f,int remap,uint32_t threads)
+{
+    wt_t* wt = wt_init(n);
+    if (!wt) return NULL;
+    if (remap && n && !wt_remap(wt,A,bits,n)) {
+        wt_free(wt);
+        return NULL;
+    }
 
-    wt_build(wt,A,bits,n);
+    if (!wt_build_mt(wt,A,bits,n,f,threads)) {
+        wt_free(wt);
+        return NULL;
+    }
 
     return wt;
 }
 
+wt_t*
+wt_create(uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    return wt_create_alpha(A,bits,n,f,0,1);
+}
+
+wt_t*
+wt_create_mt(uint64_t* A,size_t bits,size_t n,uint32_t f,uint32_t threads)
+{
+    return wt_create_alpha(A,bits,n,f,0,threads);
+}
+
+wt_t*
+wt_create_remap(uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    return wt_create_alpha(A,bits,n,f,1,1);
+}
+
 void
 wt_free(wt_t* wt)
 {
     size_t i;
     if (wt) {
-        if (wt->occ) rankbv_free(wt->occ);
+        if (wt->occ) occ_free(wt->occ);
         if (wt->bittree) {
             for (i=0; i<wt->height; i++) rankbv_free(wt->bittree[i]);
-            free(wt->bittree);
+            memalloc_free(wt->bittree,wt->height*sizeof(rankbv_t*));
         }
-        free(wt);
+        memalloc_free(wt->alpha,wt->sigma*sizeof(uint64_t));
+        memalloc_free(wt,sizeof(wt_t));
     }
 }
 
-void
-wt_build(wt_t* wt,uint64_t* A,size_t bits,size_t n)
+/* codes of the current level, read from the input on the first */
+static inline uint64_t
+wt_buildsym(wt_t* wt,uint64_t* cur,uint64_t* A,size_t bits,size_t i)
 {
-    size_t i;
+    if (cur == A) return wt_inputcode(wt,wt_getsym(A,bits,i));
+    return wt_getsym(cur,wt->height,i);
+}
+
+/* node bounds of the last level give the occ table: a node of prefix p
+ * holds the codes p (its zeros) and p+1. codes that do not occur start
+ * where the next one does */
+static inline void
+wt_occnode(uint64_t* C,uint64_t p,size_t ns,size_t z)
+{
+    C[p] = ns;
+    C[p+1] = ns+z;
+}
+
+static int
+wt_occfinish(wt_t* wt,uint64_t* C)
+{
+    uint64_t c;
+    for (c=wt->max_v+1; c--; ) C[c] = wt_min(C[c],C[c+1]);
+    wt->occ = occ_create(C,wt->max_v+2);
+    return wt->occ != NULL;
+}
+
+/* ones in bits [ns,ne) */
+static size_t
+wt_bitcount(const uint64_t* bits,size_t ns,size_t ne)
+{
+    size_t c = 0;
+    while (ns < ne && ns%RBVW) {
+        c += (bits[ns/RBVW] >> (ns%RBVW)) & 1;
+        ns++;
+    }
+    c += rankbv_popcount(bits+ns/RBVW,(ne-ns)/RBVW);
+    for (ns+=((ne-ns)/RBVW)*RBVW; ns<ne; ns++) c += (bits[ns/RBVW] >> (ns%RBVW)) & 1;
+    return c;
+}
 
-    /* build levels */
-    wt_buildlvl(wt,A,bits,0,n,0);
+/* first set bit after i or n */
+static size_t
+wt_nextbit(const uint64_t* bits,size_t i,size_t n)
+{
+    size_t w = ++i/RBVW;
+    uint64_t x = i%RBVW ? bits[w] >> (i%RBVW) << (i%RBVW) : bits[w];
+    while (!x && ++w*RBVW < n) x = bits[w];
+    return x ? wt_min(w*RBVW+__builtin_ctzll(x),n) : n;
+}
+
+/* levels are built top-down without recursion, reading A exactly once.
+ * that pass copies the codes into the first of two ping-pong buffers
+ * and finds max_v, the height and how many codes sit below the top bit.
+ * level lvl holds the codes stably sorted by their top lvl bits, so its
+ * nodes are runs of equal prefix. every level is then a single pass that
+ * splits each node stably by the level bit into the other buffer and, as
+ * a code lands, records its bit on the next level and marks where the
+ * next level's nodes start. so the bounds and zeros of a node come from
+ * those bit arrays, not from another pass over the codes. the last level
+ * needs no buffer, its node bounds are the occ table */
+int
+wt_build(wt_t* wt,uint64_t* A,size_t bits,size_t n,uint32_t f)
+{
+    uint32_t lvl,h;
+    size_t i,ns,ne,z,cnt[65] = { 0 };
+    size_t bytes[2] = { ((n*bits)/RBVW+1)*sizeof(uint64_t), 0 };
+    size_t bitbytes = (n/RBVW+1)*sizeof(uint64_t);
+    size_t cbytes = 0, bldbytes = 0;
+    uint64_t* buf[2] = { NULL, NULL };
+    uint64_t* lb[2] = { NULL, NULL };  /* level bits */
+    uint64_t* nb[2] = { NULL, NULL };  /* node starts */
+    uint64_t* C = NULL;
+    rankbv_builder_t* bld = NULL;
+    uint64_t sym;
+    int ok = 0;
+
+    buf[0] = (uint64_t*) memalloc_calloc(bytes[0]);
+    if (!buf[0]) return 0;
+    for (i=0; i<n; i++) {
+        sym = wt_inputcode(wt,wt_getsym(A,bits,i));
+        wt_setsym(buf[0],bits,i,sym);
+        wt->max_v = wt_max(sym,wt->max_v);
+        cnt[wt_bits(sym)]++;
+    }
+    h = wt->height = wt_bits(wt->max_v);
 
-    /* build rank */
 #ifdef _WT_DEBUG_
-    fprintf(stdout,"\nWT::BuildRank(%zu)\n",i);
+    fprintf(stdout,"wt::create() height = %u max_v %zu\n",wt->height,wt->max_v);
 #endif
-    for (i=0; i<wt->height; i++) {
-        rankbv_build(wt->bittree[i]);
+
+    /* the copy keeps the input width, the other buffer the height */
+    bytes[1] = ((n*h)/RBVW+1)*sizeof(uint64_t);
+    bldbytes = h*sizeof(rankbv_builder_t);
+    wt->bittree = (rankbv_t**) memalloc_calloc(h*sizeof(rankbv_t*));
+    bld = (rankbv_builder_t*) memalloc_calloc(bldbytes);
+    if (!wt->bittree || !bld) goto done;
+    if (h > 1) {
+        buf[1] = (uint64_t*) memalloc_calloc(bytes[1]);
+        for (i=0; i<2; i++) {
+            lb[i] = (uint64_t*) memalloc_calloc(bitbytes);
+            nb[i] = (uint64_t*) memalloc_calloc(bitbytes);
+            if (!lb[i] || !nb[i]) goto done;
+        }
+        if (!buf[1]) goto done;
     }
+    for (lvl=0; lvl<h; lvl++) {
+        if (!rankbv_builder_init(&bld[lvl],n,f)) {
+            while (lvl--) rankbv_free(rankbv_builder_finish(&bld[lvl]));
+            goto done;
+        }
+    }
+
+    for (lvl=0; lvl<h; lvl++) {
+        uint64_t* cur = buf[lvl&1];
+        uint64_t* next = buf[(lvl+1)&1];
+        uint64_t *lcur = lb[lvl&1], *lnext = lb[(lvl+1)&1];
+        uint64_t *ncur = nb[lvl&1], *nnext = nb[(lvl+1)&1];
+        size_t width = lvl ? h : bits;
+        int last = lvl+1 == h;
+
+        if (last) {
+            /* the other buffer is done with, the histogram takes its place */
+            if (next) {
+                memalloc_free(next,bytes[(lvl+1)&1]);
+                buf[(lvl+1)&1] = NULL;
+            }
+            if (wt_useocc(wt->max_v,n)) {
+                cbytes = (wt->max_v+2)*sizeof(uint64_t);
+                C = (uint64_t*) memalloc_calloc(cbytes);
+                if (!C) {
+                    for (i=0; i<h; i++) rankbv_free(rankbv_builder_finish(&bld[i]));
+                    goto done;
+                }
+                for (i=0; i<=wt->max_v+1; i++) C[i] = n;
+            }
+        } else {
+            memset(lnext,0,bitbytes);
+            memset(nnext,0,bitbytes);
+        }
+        for (ns=0; ns<n; ns=ne) {
+            if (lvl) {
+                ne = wt_nextbit(ncur,ns,n);
+                z = (ne-ns) - wt_bitcount(lcur,ns,ne);
+            } else {  /* level 0 is one node, its zeros are below the top bit */
+                ne = n;
+                for (z=0,i=0; i<h; i++) z += cnt[i];
+            }
+            if (C) wt_occnode(C,wt_prefix(wt_getsym(cur,width,ns),h,lvl),ns,z);
+            if (last) {
+                for (i=ns; i<ne; i++) rankbv_builder_push(&bld[lvl],wt_marked(wt_getsym(cur,width,i),h,lvl));
+                continue;
+            }
+            /* zeros keep their order in front, ones follow */
+            size_t cz = ns, co = ns+z;
+            if (z) wt_setsym(nnext,1,ns,1);
+            if (co < ne) wt_setsym(nnext,1,co,1);
+            for (i=ns; i<ne; i++) {
+                sym = wt_getsym(cur,width,i);
+                size_t d = wt_marked(sym,h,lvl) ? co++ : cz++;
+                rankbv_builder_push(&bld[lvl],d >= ns+z);
+                wt_setsym(next,h,d,sym);
+                if (wt_marked(sym,h,lvl+1)) wt_setsym(lnext,1,d,1);
+            }
+        }
+    }
+
+    /* counters were filled while appending */
+    for (lvl=0; lvl<h; lvl++) {
+        wt->bittree[lvl] = rankbv_builder_finish(&bld[lvl]);
+    }
+    if (!h && wt_useocc(wt->max_v,n)) {  /* all codes are 0 */
+        cbytes = 2*sizeof(uint64_t);
+        C = (uint64_t*) memalloc_calloc(cbytes);
+        if (!C) goto done;
+        C[1] = n;
+    }
+    ok = !C || wt_occfinish(wt,C);
+
+done:
+    for (i=0; i<2; i++) {
+        memalloc_free(buf[i],bytes[i]);
+        memalloc_free(lb[i],bitbytes);
+        memalloc_free(nb[i],bitbytes);
+    }
+    memalloc_free(C,cbytes);
+    memalloc_free(bld,bldbytes);
+    return ok;
 }
 
-void
-wt_buildlvl(wt_t* wt,uint64_t* A,size_t bits,uint32_t lvl,size_t n,size_t offset)
+/* parallel construction. level lvl is the input stably sorted by the top
+ * lvl bits of the symbols, i.e. its nodes in order. every level is cut
+ * into position blocks (multiples of 64 so no bit word is shared) and a
+ * thread writes the level bits of its block and then moves the block's
+ * symbols to the next level. the destination of a symbol only needs the
+ * node bounds, found by binary search, and ranks on the finished level */
+typedef struct wt_buildjob {
+    wt_t* wt;
+    uint64_t* A;
+    size_t bits;
+    size_t n;
+    uint64_t* cur;
+    uint64_t* next;
+    rankbv_t* rbv;
+    uint32_t lvl;
+    size_t i0;  /* block [i0,i1) */
+    size_t i1;
+    uint64_t max;  /* largest code of the block */
+} wt_buildjob_t;
+
+static void*
+wt_unpack_job(void* arg)
 {
+    wt_buildjob_t* job = (wt_buildjob_t*) arg;
     size_t i;
-    if (lvl == wt->height) {
-        free(A);
+    for (i=job->i0; i<job->i1; i++) {
+        job->cur[i] = wt_inputcode(job->wt,wt_getsym(job->A,job->bits,i));
+        job->max = wt_max(job->cur[i],job->max);
+    }
+    return NULL;
+}
+
+static void*
+wt_levelbits_job(void* arg)
+{
+    wt_buildjob_t* job = (wt_buildjob_t*) arg;
+    size_t i,w;
+    for (w=job->i0/RBVW; w*RBVW<job->i1; w++) {
+        uint64_t word = 0;
+        size_t end = wt_min((w+1)*RBVW,job->i1);
+        for (i=w*RBVW; i<end; i++) {
+            word |= (uint64_t)wt_marked(job->cur[i],job->wt->height,job->lvl) << (i%RBVW);
+        }
+        job->rbv->S[rankbv_word(job->rbv,w)] = word;
+    }
+    return NULL;
+}
+
+/* first i in [lo,hi) whose node prefix is > p (upper) or >= p */
+static size_t
+wt_nodebound(const uint64_t* cur,uint32_t h,uint32_t lvl,size_t lo,size_t hi,uint64_t p,int upper)
+{
+    while (lo < hi) {
+        size_t mid = lo + (hi-lo)/2;
+        uint64_t x = wt_prefix(cur[mid],h,lvl);
+        if (x < p || (upper && x == p)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void*
+wt_scatter_job(void* arg)
+{
+    wt_buildjob_t* job = (wt_buildjob_t*) arg;
+    const uint64_t* cur = job->cur;
+    uint32_t h = job->wt->height, lvl = job->lvl;
+    size_t i = job->i0, ns = 0, ne = 0, z = 0, o = 0;
+    size_t n = job->n;
+
+    for (; i<job->i1; i++) {
+        if (i == job->i0 || i == ne) {  /* entering a node */
+            uint64_t p = wt_prefix(cur[i],h,lvl);
+            ns = (i == ne) ? ne : wt_nodebound(cur,h,lvl,0,i,p,0);
+            ne = wt_nodebound(cur,h,lvl,i,n,p,1);
+            size_t before = rankbv_rank1(job->rbv,ns-1);
+            /* zeros in the node, ones in the node before i */
+            z = (ne-ns) - (rankbv_rank1(job->rbv,ne-1) - before);
+            o = rankbv_rank1(job->rbv,i-1) - before;
+        }
+        if (wt_marked(cur[i],h,lvl)) job->next[ns+z+o++] = cur[i];
+        else job->next[i-o] = cur[i];
+    }
+    return NULL;
+}
+
+int
+wt_build_mt(wt_t* wt,uint64_t* A,size_t bits,size_t n,uint32_t f,uint32_t threads)
+{
+    uint32_t t,lvl;
+    wt_buildjob_t job[RANKBV_MAXTHREADS];
+    int ok = 0;
+
+    if (threads > RANKBV_MAXTHREADS) threads = RANKBV_MAXTHREADS;
+    if (threads > n/RBVW) threads = n/RBVW;
+    if (threads <= 1) return wt_build(wt,A,bits,n,f);
+
+    size_t bytes = n*sizeof(uint64_t);
+    uint64_t* cur = (uint64_t*) memalloc_calloc(bytes);
+    uint64_t* next = (uint64_t*) memalloc_calloc(bytes);
+    if (!cur || !next) {
+        memalloc_free(cur,bytes);
+        memalloc_free(next,bytes);
+        return 0;
+    }
+
+    size_t chunk = ((n+threads-1)/threads + RBVW-1)/RBVW*RBVW;
+    for (t=0; t<threads; t++) {
+        job[t].wt = wt;
+        job[t].A = A;
+        job[t].bits = bits;
+        job[t].n = n;
+        job[t].i0 = wt_min(t*chunk,n);
+        job[t].i1 = wt_min((t+1)*chunk,n);
+        job[t].max = 0;
+        job[t].cur = cur;
+    }
+    /* the only pass over A, it also finds the height */
+    rankbv_runjobs(wt_unpack_job,job,sizeof(wt_buildjob_t),threads);
+    for (t=0; t<threads; t++) wt->max_v = wt_max(job[t].max,wt->max_v);
+    wt->height = wt_bits(wt->max_v);
+    wt->bittree = (rankbv_t**) memalloc_calloc(wt->height*sizeof(rankbv_t*));
+    if (!wt->bittree) goto done;
+
+    for (lvl=0; lvl<wt->height; lvl++) {
+        rankbv_t* rbv = rankbv_init(n,f);
+        if (!rbv) break;
+        for (t=0; t<threads; t++) {
+            job[t].cur = cur;
+            job[t].next = next;
+            job[t].rbv = rbv;
+            job[t].lvl = lvl;
+        }
+        rankbv_runjobs(wt_levelbits_job,job,sizeof(wt_buildjob_t),threads);
+        rankbv_build_mt(rbv,threads);
+        wt->bittree[lvl] = rbv;
+        if (lvl+1 == wt->height) break;
+
+        rankbv_runjobs(wt_scatter_job,job,sizeof(wt_buildjob_t),threads);
+        uint64_t* tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    if (wt->height && !wt->bittree[wt->height-1]) goto done;
+    memalloc_free(next,bytes);
+    next = NULL;
+
+    ok = 1;
+    if (wt_useocc(wt->max_v,n)) {
+        /* node bounds of the last level, found as in the scatter */
+        uint32_t h = wt->height;
+        size_t ns,ne,z;
+        size_t cbytes = (wt->max_v+2)*sizeof(uint64_t);
+        uint64_t* C = (uint64_t*) memalloc_calloc(cbytes);
+        if (!C) {
+            ok = 0;
+            goto done;
+        }
+        for (ns=0; ns<=wt->max_v+1; ns++) C[ns] = n;
+        C[0] = 0;
+        for (ns=0; h && ns<n; ns=ne) {
+            rankbv_t* rbv = wt->bittree[h-1];
+            uint64_t p = wt_prefix(cur[ns],h,h-1);
+            ne = wt_nodebound(cur,h,h-1,ns,n,p,1);
+            z = (ne-ns) - (rankbv_rank1(rbv,ne-1) - rankbv_rank1(rbv,ns-1));
+            wt_occnode(C,p,ns,z);
+        }
+        ok = wt_occfinish(wt,C);
+        memalloc_free(C,cbytes);
+    }
+
+done:
+    memalloc_free(cur,bytes);
+    memalloc_free(next,bytes);
+    return ok;
+}
+
+/* typed construction from native uint8/16/32 arrays. a level is built in
+ * two passes: its bits are pulled out 64 symbols at a time into a word
+ * array (movemask on AVX2), then every node is split stably by those
+ * bits (pext on BMI2 moves the zeros or ones of a 64-bit word of symbols
+ * to its low end in one step). node bounds come from the cumulative
+ * histogram when occ is kept and from scanning the prefixes otherwise.
+ * kernels are chosen once at startup, index 0/1/2 is 8/16/32 bits */
+typedef void (*wt_levelbits_f)(const void* A,size_t n,uint32_t bit,uint64_t* out);
+typedef void (*wt_partition_f)(const void* A,const uint64_t* bits,size_t ns,size_t ne,size_t z,void* D);
+
+/* symbols are written up to a word past the node end, buffers keep
+ * this many symbols of slack */
+#define WT_TYPEDSLACK   8
+
+#define WT_TYPED_SCALAR(T,sfx) \
+static void \
+wt_levelbits_##sfx(const void* A_,size_t n,uint32_t bit,uint64_t* out) \
+{ \
+    const T* A = (const T*) A_; \
+    size_t i,j; \
+    for (i=0; i<n; i+=RBVW) { \
+        uint64_t w = 0; \
+        size_t e = wt_min(n-i,(size_t)RBVW); \
+        for (j=0; j<e; j++) w |= (uint64_t)((A[i+j] >> bit) & 1) << j; \
+        out[i/RBVW] = w; \
+    } \
+} \
+\
+static void \
+wt_partition_##sfx(const void* A_,const uint64_t* bits,size_t ns,size_t ne,size_t z,void* D_) \
+{ \
+    const T* A = (const T*) A_; \
+    T* D = (T*) D_; \
+    size_t i,cz = ns,co = ns+z; \
+    for (i=ns; i<ne; i++) { \
+        if ((bits[i/RBVW] >> (i%RBVW)) & 1) D[co++] = A[i]; \
+        else D[cz++] = A[i]; \
+    } \
+}
+
+WT_TYPED_SCALAR(uint8_t,u8)
+WT_TYPED_SCALAR(uint16_t,u16)
+WT_TYPED_SCALAR(uint32_t,u32)
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static void
+wt_levelbits_u8_avx2(const void* A_,size_t n,uint32_t bit,uint64_t* out)
+{
+    const uint8_t* A = (const uint8_t*) A_;
+    size_t i;
+    /* move the level bit to the top of every byte, bits from the byte
+     * below only reach the low end */
+    __m128i cnt = _mm_cvtsi32_si128(7-bit);
+    for (i=0; i+RBVW<=n; i+=RBVW) {
+        __m256i lo = _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(A+i)),cnt);
+        __m256i hi = _mm256_sll_epi64(_mm256_loadu_si256((const __m256i*)(A+i+32)),cnt);
+        out[i/RBVW] = (uint32_t)_mm256_movemask_epi8(lo) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32);
+    }
+    if (i < n) wt_levelbits_u8(A+i,n-i,bit,out+i/RBVW);
+}
+
+__attribute__((target("avx2"))) static inline uint32_t
+wt_mask32_u16(const uint16_t* A,__m128i cnt)
+{
+    __m256i a = _mm256_srai_epi16(_mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)A),cnt),15);
+    __m256i b = _mm256_srai_epi16(_mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)(A+16)),cnt),15);
+    /* packs works per 128-bit lane, put the quarters back in order */
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi16(a,b),0xD8);
+    return (uint32_t)_mm256_movemask_epi8(p);
+}
+
+__attribute__((target("avx2"))) static void
+wt_levelbits_u16_avx2(const void* A_,size_t n,uint32_t bit,uint64_t* out)
+{
+    const uint16_t* A = (const uint16_t*) A_;
+    size_t i;
+    __m128i cnt = _mm_cvtsi32_si128(15-bit);
+    for (i=0; i+RBVW<=n; i+=RBVW) {
+        out[i/RBVW] = wt_mask32_u16(A+i,cnt) | ((uint64_t)wt_mask32_u16(A+i+32,cnt) << 32);
+    }
+    if (i < n) wt_levelbits_u16(A+i,n-i,bit,out+i/RBVW);
+}
+
+__attribute__((target("avx2"))) static void
+wt_levelbits_u32_avx2(const void* A_,size_t n,uint32_t bit,uint64_t* out)
+{
+    const uint32_t* A = (const uint32_t*) A_;
+    size_t i,j;
+    __m128i cnt = _mm_cvtsi32_si128(31-bit);
+    for (i=0; i+RBVW<=n; i+=RBVW) {
+        uint64_t w = 0;
+        for (j=0; j<RBVW; j+=8) {
+            __m256i v = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i*)(A+i+j)),cnt);
+            w |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(v)) << j;
+        }
+        out[i/RBVW] = w;
+    }
+    if (i < n) wt_levelbits_u32(A+i,n-i,bit,out+i/RBVW);
+}
+
+/* K symbols of a 64-bit word per step. PAT has the low bit of every
+ * symbol set, times FILL it is the mask of the symbols picked */
+#define WT_TYPED_PEXT(T,sfx,K,PAT,FILL) \
+__attribute__((target("bmi,bmi2"))) static void \
+wt_partition_##sfx##_bmi2(const void* A_,const uint64_t* bits,size_t ns,size_t ne,size_t z,void* D_) \
+{ \
+    const T* A = (const T*) A_; \
+    T* D = (T*) D_; \
+    size_t i,cz = ns,co = ns+z,zend = ns+z; \
+    for (i=ns; i+K<=ne; i+=K) { \
+        size_t off = i%RBVW; \
+        uint64_t m = bits[i/RBVW] >> off; \
+        if (off+K > RBVW) m |= bits[i/RBVW+1] << (RBVW-off); \
+        m &= (1ULL<<K)-1; \
+        uint64_t x, M = _pdep_u64(m,PAT)*(FILL); \
+        uint32_t c1 = __builtin_popcountll(m); \
+        memcpy(&x,A+i,sizeof(uint64_t)); \
+        if (c1 < K) { \
+            uint64_t zx = _pext_u64(x,~M); \
+            /* a full word would run into the ones of this node */ \
+            memcpy(D+cz,&zx,cz+K <= zend ? sizeof(uint64_t) : (K-c1)*sizeof(T)); \
+            cz += K-c1; \
+        } \
+        if (c1) { \
+            uint64_t ox = _pext_u64(x,M); \
+            memcpy(D+co,&ox,sizeof(uint64_t)); \
+            co += c1; \
+        } \
+    } \
+    for (; i<ne; i++) { \
+        if ((bits[i/RBVW] >> (i%RBVW)) & 1) D[co++] = A[i]; \
+        else D[cz++] = A[i]; \
+    } \
+}
+
+WT_TYPED_PEXT(uint8_t,u8,8,0x0101010101010101ULL,0xFFULL)
+WT_TYPED_PEXT(uint16_t,u16,4,0x0001000100010001ULL,0xFFFFULL)
+WT_TYPED_PEXT(uint32_t,u32,2,0x0000000100000001ULL,0xFFFFFFFFULL)
+#endif
+
+static wt_levelbits_f wt_levelbits_kernel[3] = { wt_levelbits_u8, wt_levelbits_u16, wt_levelbits_u32 };
+static wt_partition_f wt_partition_kernel[3] = { wt_partition_u8, wt_partition_u16, wt_partition_u32 };
+
+__attribute__((constructor)) static void
+wt_cpuinit(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        wt_levelbits_kernel[0] = wt_levelbits_u8_avx2;
+        wt_levelbits_kernel[1] = wt_levelbits_u16_avx2;
+        wt_levelbits_kernel[2] = wt_levelbits_u32_avx2;
+    }
+    /* pext is microcoded and slow before zen3 */
+    if (__builtin_cpu_supports("bmi2") &&
+            !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2")) {
+        wt_partition_kernel[0] = wt_partition_u8_bmi2;
+        wt_partition_kernel[1] = wt_partition_u16_bmi2;
+        wt_partition_kernel[2] = wt_partition_u32_bmi2;
+    }
+#endif
+}
+
+static inline uint64_t
+wt_typedsym(const void* A,size_t w,size_t i)
+{
+    switch (w) {
+        case 1: return ((const uint8_t*)A)[i];
+        case 2: return ((const uint16_t*)A)[i];
+        default: return ((const uint32_t*)A)[i];
+    }
+}
+
+/* split every node of level lvl of src into dst */
+static void
+wt_typedsplit(wt_t* wt,const void* src,size_t w,const uint64_t* C,const uint64_t* bits,uint32_t lvl,void* dst)
+{
+    wt_partition_f part = wt_partition_kernel[w/2];
+    uint32_t h = wt->height,s = h-lvl;
+    size_t ns,ne,n = wt->n;
+    uint64_t p;
+
+    if (C) {  /* node of prefix p covers the codes [p,p+2^s) */
+        uint64_t top = wt->max_v+1;
+        for (p=0; p<top; p+=(1ULL<<s)) {
+            ns = C[p];
+            ne = C[wt_min(p+(1ULL<<s),top)];
+            if (ne > ns) part(src,bits,ns,ne,C[wt_min(p+(1ULL<<(s-1)),top)]-ns,dst);
+        }
         return;
     }
+    for (ns=0; ns<n; ns=ne) {
+        p = wt_prefix(wt_typedsym(src,w,ns),h,lvl);
+        for (ne=ns+1; ne<n && wt_prefix(wt_typedsym(src,w,ne),h,lvl) == p; ne++);
+        part(src,bits,ns,ne,(ne-ns)-wt_bitcount(bits,ns,ne),dst);
+    }
+}
 
-    /* count symbols */
-    size_t cone = 0;
-    for (i=0; i<n; i++) {
-        if (wt_marked(wt_getsym(A,bits,i) ,wt->height,lvl)) cone++;
+static wt_t*
+wt_create_typed(const void* A,size_t w,size_t n,uint32_t f)
+{
+    size_t i;
+    uint32_t lvl;
+    uint64_t* C = NULL;
+    size_t cbytes = 0;
+    wt_t* wt = wt_init(n);
+    if (!wt) return NULL;
+
+    if (w <= 2 && wt_useocc((1ULL<<(8*w))-1,n)) {
+        /* a byte or 16-bit alphabet can be counted before max_v is known,
+         * so a single pass over A gives both */
+        uint64_t c = (1ULL<<(8*w))-1;
+        cbytes = (c+2)*sizeof(uint64_t);
+        C = (uint64_t*) memalloc_calloc(cbytes);
+        if (!C) goto fail;
+        if (w == 1) for (i=0; i<n; i++) C[((const uint8_t*)A)[i]+1]++;
+        else for (i=0; i<n; i++) C[((const uint16_t*)A)[i]+1]++;
+        while (c && !C[c+1]) c--;
+        wt->max_v = c;
+    } else {
+        for (i=0; i<n; i++) wt->max_v = wt_max(wt_typedsym(A,w,i),wt->max_v);
     }
-    size_t czero = n - cone;
+    wt->height = wt_bits(wt->max_v);
+    wt->bittree = (rankbv_t**) memalloc_calloc(wt->height*sizeof(rankbv_t*));
+    if (!wt->bittree) goto fail;
 
-    /* move symbols to left/right subarray */
-    size_t cleft,cright;
-    cleft = cright = 0;
+    if (!C && wt_useocc(wt->max_v,n)) {
+        cbytes = (wt->max_v+2)*sizeof(uint64_t);
+        C = (uint64_t*) memalloc_calloc(cbytes);
+        if (!C) goto fail;
+        switch (w) {
+            case 1: for (i=0; i<n; i++) C[((const uint8_t*)A)[i]+1]++; break;
+            case 2: for (i=0; i<n; i++) C[((const uint16_t*)A)[i]+1]++; break;
+            default: for (i=0; i<n; i++) C[((const uint32_t*)A)[i]+1]++; break;
+        }
+    }
+    if (C) {
+        /* C[c] = number of symbols < c, also the node bounds below */
+        for (i=1; i<=wt->max_v+1; i++) C[i] += C[i-1];
+        wt->occ = occ_create(C,wt->max_v+2);
+        if (!wt->occ) goto fail;
+    }
 
-    uint64_t* left = (uint64_t*)  wt_safecalloc(((czero*bits)/RBVW+1)*sizeof(uint64_t));
-    uint64_t* right = (uint64_t*) wt_safecalloc(((cone*bits)/RBVW+1)*sizeof(uint64_t));
+    if (wt->height) {
+        size_t bufbytes = (n+WT_TYPEDSLACK)*w;
+        size_t bitbytes = (n/RBVW+2)*sizeof(uint64_t);
+        uint64_t* bits = (uint64_t*) memalloc_calloc(bitbytes);
+        void* buf[2];
+        buf[0] = memalloc_calloc(bufbytes);
+        buf[1] = memalloc_calloc(bufbytes);
+        const void* src = A;
+        for (lvl=0; bits && buf[0] && buf[1] && lvl<wt->height; lvl++) {
+            wt_levelbits_kernel[w/2](src,n,wt->height-lvl-1,bits);
+            wt->bittree[lvl] = rankbv_create(bits,n,f);
+            if (!wt->bittree[lvl] || lvl+1 == wt->height) break;
+            wt_typedsplit(wt,src,w,C,bits,lvl,buf[lvl&1]);
+            src = buf[lvl&1];
+        }
+        memalloc_free(bits,bitbytes);
+        memalloc_free(buf[0],bufbytes);
+        memalloc_free(buf[1],bufbytes);
+        if (!wt->bittree[wt->height-1]) goto fail;
+    }
+    memalloc_free(C,cbytes);
+    return wt;
 
+fail:
+    memalloc_free(C,cbytes);
+    wt_free(wt);
+    return NULL;
+}
+
+wt_t*
+wt_create_u8(const uint8_t* A,size_t n,uint32_t f)
+{
+    return wt_create_typed(A,1,n,f);
+}
+
+wt_t*
+wt_create_u16(const uint16_t* A,size_t n,uint32_t f)
+{
+    return wt_create_typed(A,2,n,f);
+}
+
+wt_t*
+wt_create_u32(const uint32_t* A,size_t n,uint32_t f)
+{
+    return wt_create_typed(A,4,n,f);
+}
+
+/* external memory construction. symbols stream through files of packed
+ * bits-wide codes (the wt_setsym layout) read and written in chunks of
+ * a multiple of bits words, so a chunk always ends on a symbol */
+typedef struct wt_stream {
+    FILE* f;
+    uint64_t* buf;
+    size_t words;   /* chunk size */
+    size_t bits;
+    size_t pos;     /* next symbol in buf */
+    size_t len;     /* symbols in buf */
+    size_t left;    /* symbols still in the file (reading) */
+    int err;        /* a read or write failed */
+} wt_stream_t;
+
+static int
+wt_stream_open(wt_stream_t* s,FILE* f,size_t bits,size_t bytes,size_t n)
+{
+    s->f = f;
+    s->bits = bits;
+    s->words = wt_max((bytes/sizeof(uint64_t))/bits,(size_t)1)*bits;
+    s->buf = (uint64_t*) memalloc_calloc(s->words*sizeof(uint64_t));
+    s->pos = s->len = 0;
+    s->left = n;
+    s->err = 0;
+    return s->buf != NULL;
+}
+
+static void
+wt_stream_close(wt_stream_t* s)
+{
+    memalloc_free(s->buf,s->words*sizeof(uint64_t));
+    s->buf = NULL;
+}
+
+static inline uint64_t
+wt_stream_peek(wt_stream_t* s)
+{
+    if (s->pos == s->len) {
+        size_t syms = (s->words*RBVW)/s->bits;
+        s->len = wt_min(syms,s->left);
+        size_t bytes = (s->len*s->bits+7)/8;
+        memset(s->buf,0,s->words*sizeof(uint64_t));
+        if (fread(s->buf,1,bytes,s->f) != bytes) s->err = 1;
+        s->left -= s->len;
+        s->pos = 0;
+    }
+    return wt_getsym(s->buf,s->bits,s->pos);
+}
+
+static inline uint64_t
+wt_stream_get(wt_stream_t* s)
+{
+    uint64_t sym = wt_stream_peek(s);
+    s->pos++;
+    return sym;
+}
+
+static void
+wt_stream_flush(wt_stream_t* s)
+{
+    size_t bytes = (s->len*s->bits+7)/8;
+    if (bytes && fwrite(s->buf,1,bytes,s->f) != bytes) s->err = 1;
+    memset(s->buf,0,s->words*sizeof(uint64_t));
+    s->len = 0;
+}
+
+static inline void
+wt_stream_put(wt_stream_t* s,uint64_t sym)
+{
+    wt_setsym(s->buf,s->bits,s->len++,sym);
+    if (s->len == (s->words*RBVW)/s->bits) wt_stream_flush(s);
+}
+
+static FILE*
+wt_openfile(const char* path,const char* mode)
+{
+    FILE* f = path ? fopen(path,mode) : tmpfile();
+    if (!f) fprintf(stderr,"ERROR: wt_create_from_file() cannot open %s\n",path ? path : "a temporary file");
+    return f;
+}
+
+/* first pass: max_v and, while it fits in a quarter of the budget, the
+ * histogram the occ table is built from. *hist is NULL without it */
+static int
+wt_filehist(FILE* f,size_t bits,size_t n,size_t budget,size_t bufbytes,
+            uint64_t* max_v,uint64_t** hist,size_t* histbytes)
+{
+    size_t i,limit = budget/4/sizeof(uint64_t);
+    wt_stream_t in;
+    if (!wt_stream_open(&in,f,bits,bufbytes,n)) return 0;
+    *histbytes = 2*sizeof(uint64_t);
+    uint64_t* H = (uint64_t*) memalloc_calloc(*histbytes);
+    *max_v = 0;
     for (i=0; i<n; i++) {
-        uint32_t sym = wt_getsym(A,bits,i);
-        if (wt_marked(sym,wt->height,lvl)) {
-            wt_setsym(right,bits,cright++,sym);
-            rankbv_setbit(wt->bittree[lvl],offset+i);
+        uint64_t sym = wt_stream_get(&in);
+        *max_v = wt_max(sym,*max_v);
+        if (!H) continue;
+        size_t words = *histbytes/sizeof(uint64_t);
+        if (sym+2 > words) {
+            uint64_t* G = NULL;
+            if (sym+2 <= limit && wt_useocc(sym,n)) {
+                size_t grow = wt_min(wt_max(sym+2,2*words),limit);
+                G = (uint64_t*) memalloc_realloc(H,*histbytes,grow*sizeof(uint64_t));
+                if (G) *histbytes = grow*sizeof(uint64_t);
+            }
+            if (!G) {  /* too large, count() and select() go top-down */
+                memalloc_free(H,*histbytes);
+                H = NULL;
+                continue;
+            }
+            H = G;
+        }
+        H[sym+1]++;
+    }
+    wt_stream_close(&in);
+    if (in.err) {
+        memalloc_free(H,*histbytes);
+        return 0;
+    }
+    *hist = H;
+    return 1;
+}
+
+int
+wt_create_from_file(const char* path,size_t bits,const char* out_path,size_t mem_budget)
+{
+    size_t i,n,histbytes = 0;
+    uint32_t lvl,h;
+    uint64_t max_v;
+    uint64_t* hist = NULL;
+    FILE* out = NULL;
+    FILE* run[2] = { NULL, NULL };
+    size_t cnt[2] = { 0, 0 };
+    int ok = 0;
+
+    if (bits < 1 || bits > RBVW) {
+        fprintf(stderr,"ERROR: wt_create_from_file() bits must be 1 to 64, not %zu\n",bits);
+        return 0;
+    }
+    FILE* in = wt_openfile(path,"rb");
+    if (!in) return 0;
+    off_t end;
+    if (fseeko(in,0,SEEK_END) != 0 || (end = ftello(in)) < 0) {
+        fprintf(stderr,"ERROR: wt_create_from_file() cannot seek %s\n",path);
+        fclose(in);
+        return 0;
+    }
+    n = (end*8)/bits;
+    rewind(in);
+
+    /* a level reads two runs and writes two, half the budget. the
+     * histogram and the occ table made from it get the other half */
+    size_t bufbytes = mem_budget/8;
+    if (!wt_filehist(in,bits,n,mem_budget,bufbytes,&max_v,&hist,&histbytes)) {
+        fclose(in);
+        return 0;
+    }
+    h = wt_bits(max_v);
+
+    out = wt_openfile(out_path,"wb");
+    if (!out) {
+        memalloc_free(hist,histbytes);
+        fclose(in);
+        return 0;
+    }
+    uint32_t height = h;
+    uint32_t flags = hist ? WT_HASOCC : 0;
+    if (!wt_savemagic(out) ||
+        fwrite(&n,sizeof(uint64_t),1,out) != 1 ||
+        fwrite(&height,sizeof(uint32_t),1,out) != 1 ||
+        fwrite(&flags,sizeof(uint32_t),1,out) != 1 ||
+        fwrite(&max_v,sizeof(uint64_t),1,out) != 1) {
+        memalloc_free(hist,histbytes);
+        goto done;
+    }
+    if (hist) {
+        for (i=1; i<=max_v+1; i++) hist[i] += hist[i-1];
+        occ_t* occ = occ_create(hist,max_v+2);
+        memalloc_free(hist,histbytes);
+        if (!occ) goto done;
+        occ_save(occ,out);
+        occ_free(occ);
+    }
+
+    /* level lvl comes from the input or from merging the zero and one
+     * runs of the level above: both are in node order, so taking the
+     * smaller prefix first restores the order of level lvl */
+    for (lvl=0; lvl<h; lvl++) {
+        wt_stream_t src[2],dst[2];
+        FILE* next[2] = { NULL, NULL };
+        size_t ncnt[2] = { 0, 0 };
+        rankbv_writer_t w;
+        int last = (lvl+1 == h);
+        int levelok = 0;
+
+        memset(src,0,sizeof(src));
+        memset(dst,0,sizeof(dst));
+        if (lvl == 0) {
+            rewind(in);
+            if (!wt_stream_open(&src[0],in,bits,bufbytes,n)) goto levelend;
         } else {
-            wt_setsym(left,bits,cleft++,sym);
+            for (i=0; i<2; i++) {
+                rewind(run[i]);
+                if (!wt_stream_open(&src[i],run[i],h,bufbytes,cnt[i])) goto levelend;
+            }
+        }
+        if (!last) {
+            for (i=0; i<2; i++) {
+                next[i] = wt_openfile(NULL,"w+b");
+                if (!next[i] || !wt_stream_open(&dst[i],next[i],h,bufbytes,0)) goto levelend;
+            }
+        }
+        if (!rankbv_writer_init(&w,out,n,0)) goto levelend;
+
+        for (i=0; i<n; i++) {
+            uint64_t sym;
+            if (lvl == 0) sym = wt_stream_get(&src[0]);
+            else if (!src[1].left && src[1].pos == src[1].len) sym = wt_stream_get(&src[0]);
+            else if (!src[0].left && src[0].pos == src[0].len) sym = wt_stream_get(&src[1]);
+            else {
+                uint64_t z = wt_prefix(wt_stream_peek(&src[0]),h,lvl);
+                uint64_t o = wt_prefix(wt_stream_peek(&src[1]),h,lvl);
+                sym = wt_stream_get(&src[z < o ? 0 : 1]);
+            }
+            int bit = wt_marked(sym,h,lvl);
+            rankbv_writer_push(&w,bit);
+            if (!last) {
+                wt_stream_put(&dst[bit],sym);
+                ncnt[bit]++;
+            }
+        }
+        levelok = rankbv_writer_finish(&w);
+        if (!last) for (i=0; i<2; i++) wt_stream_flush(&dst[i]);
+        for (i=0; i<2; i++) if (src[i].err || dst[i].err) levelok = 0;
+
+levelend:
+        for (i=0; i<2; i++) {
+            if (src[i].buf) wt_stream_close(&src[i]);
+            if (dst[i].buf) wt_stream_close(&dst[i]);
+            if (run[i]) fclose(run[i]);
+            run[i] = next[i];
+            cnt[i] = ncnt[i];
         }
+        if (!levelok) {
+            fprintf(stderr,"ERROR: wt_create_from_file() cannot build level %u\n",lvl);
+            goto done;
+        }
+    }
+    ok = 1;
+
+done:
+    for (i=0; i<2; i++) if (run[i]) fclose(run[i]);
+    fclose(in);
+    if (ferror(out)) ok = 0;
+    if (fclose(out) != 0) ok = 0;
+    if (!ok) {
+        /* no partial index is left behind, devices and pipes stay */
+        struct stat st;
+        fprintf(stderr,"ERROR: wt_create_from_file() cannot write %s\n",out_path);
+        if (stat(out_path,&st) == 0 && S_ISREG(st.st_mode)) remove(out_path);
     }
-    free(A);
+    return ok;
+}
+
+/* start of the node holding sym on every level, found top-down.
+ * returns the number of occurrences of sym */
+static size_t
+wt_nodes(wt_t* wt,uint64_t sym,size_t* starts)
+{
+    uint32_t lvl;
+    size_t start = 0, end = wt->n-1;
+    size_t before,ones;
+    rankbv_t* bs;
 
-    wt_buildlvl(wt,left,bits,lvl+1,cleft,offset);
-    wt_buildlvl(wt,right,bits,lvl+1,cright,offset+cleft);
+    if (!wt->n) return 0;
+    for (lvl=0; lvl<wt->height; lvl++) {
+        bs = wt->bittree[lvl];
+        starts[lvl] = start;
+
+        if (start==0) before = 0;
+        else before = rankbv_rank1(bs,start-1);
+        ones = rankbv_rank1(bs,end) - before;
+
+        if (wt_marked(sym,wt->height,lvl)) {
+            if (!ones) return 0;
+            start = end - ones + 1;
+        } else {
+            if (ones == end-start+1) return 0;
+            end = end - ones;
+        }
+    }
+    return end-start+1;
 }
 
 size_t
-wt_count(wt_t* wt,uint32_t sym)
+wt_count(wt_t* wt,uint64_t sym)
 {
-    if (sym) return rankbv_select1(wt->occ,sym) - rankbv_select1(wt->occ,sym-1) + 1;
-    return rankbv_select1(wt->occ,sym);
+    size_t starts[RBVW];
+    if (!wt_code(wt,sym,&sym) || sym > wt->max_v) return 0;
+    if (!wt->occ) return wt_nodes(wt,sym,starts);
+    return occ_get(wt->occ,sym+1) - occ_get(wt->occ,sym);
 }
 
 
-uint32_t
+uint64_t
 wt_access(wt_t* wt,size_t pos)
 {
     uint32_t lvl = 0;
-    uint32_t ret = 0;
+    uint64_t ret = 0;
     size_t start = 0;
     size_t end = wt->n - 1;
     size_t before;
@@ -163,45 +1135,60 @@ wt_access(wt_t* wt,size_t pos)
         }
         lvl++;
     }
-    return ret;
+    return wt_symbol(wt,ret);
 }
 
-size_t
-wt_select(wt_t* wt,uint32_t sym,size_t j)
+/* start of the node holding sym on every level */
+static void
+wt_starts(wt_t* wt,uint64_t sym,size_t* starts)
 {
-    uint32_t mask = (1<<wt->height)-2;
-    uint32_t sum = 2;
-    uint32_t lvl = wt->height-1;
-    size_t pos=j;
-    size_t start = 0;
-    size_t end = 0;
+    uint32_t lvl;
+    if (wt->occ) {
+        /* start of the node is the first position of its smallest symbol */
+        for (lvl=0; lvl<wt->height; lvl++)
+            starts[lvl] = occ_get(wt->occ,wt_prefix(sym,wt->height,lvl));
+    } else {
+        wt_nodes(wt,sym,starts);
+    }
+}
+
+/* map the pos-th (1-based) position of the leaf of sym back to the text */
+static size_t
+wt_selectup(wt_t* wt,uint64_t sym,const size_t* starts,size_t pos)
+{
+    uint32_t lvl = wt->height;
+    size_t start;
     rankbv_t* bs;
 
-    while (1) {
+    while (lvl--) {
         bs = wt->bittree[lvl];
-        start = sym&mask; /* get start */
-        end = wt_min(wt->max_v+1,start+sum);
-
-        if (start!=0) start = rankbv_select1(wt->occ,start)+1;
-        end = rankbv_select1(wt->occ,end+1)-1;
+        start = starts[lvl];
 
         size_t ones_start = rankbv_rank1(bs,start-1);
         if (wt_marked(sym,wt->height,lvl))
             pos = rankbv_select1(bs,ones_start+pos)-start+1;
         else
             pos = rankbv_select0(bs,start-ones_start+pos)-start+1;
-
-        mask <<=1;
-        sum <<=1;
-        if (!lvl) break;
-        lvl--;
     }
 
     return pos-1;
 }
 
 size_t
-wt_rank(wt_t* wt,uint32_t sym,size_t pos)
+wt_select(wt_t* wt,uint64_t sym,size_t j)
+{
+    size_t starts[RBVW],cnt;
+    if (!wt_code(wt,sym,&sym) || sym > wt->max_v) return (size_t)(-1);
+    /* the j-th occurrence has to exist */
+    if (wt->occ) cnt = occ_get(wt->occ,sym+1) - occ_get(wt->occ,sym);
+    else cnt = wt_nodes(wt,sym,starts);
+    if (j == 0 || j > cnt) return (size_t)(-1);
+    if (wt->occ) wt_starts(wt,sym,starts);
+    return wt_selectup(wt,sym,starts,j);
+}
+
+size_t
+wt_rank(wt_t* wt,uint64_t sym,size_t pos)
 {
     uint32_t lvl = 0;
     size_t start = 0;
@@ -210,6 +1197,7 @@ wt_rank(wt_t* wt,uint32_t sym,size_t pos)
     size_t before;
     rankbv_t* bs;
 
+    if (!wt_code(wt,sym,&sym) || sym > wt->max_v) return 0;
     while (lvl<wt->height) {
         bs = wt->bittree[lvl];
 
@@ -256,54 +1244,168 @@ wt_spaceusage(wt_t* wt)
         treespace += rankbv_spaceusage(wt->bittree[i]);
     }
     return sizeof(wt) +
-           rankbv_spaceusage(wt->occ) +
+           wt->sigma*sizeof(uint64_t) +
+           (wt->occ ? occ_spaceusage(wt->occ) : 0) +
            treespace;
 }
 
+/* level of a file from before the version word. its rankbv kept one
+ * counter word ahead of every factor data words, after a 32-byte header
+ * of n(u64), s(u32), ones(u64) and factor(u8) */
+static rankbv_t*
+wt_loadlegacybv(FILE* f)
+{
+    uint64_t bytes,n,w,words;
+    uint64_t *blob,*B;
+    uint8_t factor;
+    rankbv_t* rbv = NULL;
+    if (fread(&bytes,sizeof(uint64_t),1,f) != 1 || bytes < 32 || bytes%sizeof(uint64_t)) return NULL;
+    blob = (uint64_t*) memalloc_calloc(bytes);
+    if (!blob) return NULL;
+    if (fread(blob,bytes,1,f) == 1) {
+        n = blob[0];
+        memcpy(&factor,(char*)blob+24,1);
+        words = n/RBVW+1;
+        B = NULL;
+        if (factor && bytes/sizeof(uint64_t)-4 >= words+(words-1)/factor+1) {
+            B = (uint64_t*) memalloc_calloc(words*sizeof(uint64_t));
+        }
+        if (B) {
+            for (w=0; w<words; w++) B[w] = blob[4+w+w/factor+1];
+            if (n%RBVW) B[words-1] &= (1ULL<<(n%RBVW))-1;
+            else B[words-1] = 0;
+            rbv = rankbv_create(B,n,factor);
+            memalloc_free(B,words*sizeof(uint64_t));
+        }
+    }
+    memalloc_free(blob,bytes);
+    return rbv;
+}
+
+/* n(u64), height(u32), max_v(u32), occ bitvector, levels. the occ
+ * bitvector is skipped and the table rebuilt from the levels */
+static wt_t*
+wt_loadlegacy(FILE* f,uint64_t n)
+{
+    size_t i;
+    uint32_t max_v;
+    uint64_t bytes;
+    wt_t* wtl = wt_init(n);
+    if (!wtl) return NULL;
+    if (fread(&wtl->height,sizeof(uint32_t),1,f) != 1 ||
+        fread(&max_v,sizeof(uint32_t),1,f) != 1 ||
+        fread(&bytes,sizeof(uint64_t),1,f) != 1 ||
+        wtl->height > RBVW || wt_bits(max_v) > wtl->height ||
+        fseek(f,bytes,SEEK_CUR) != 0) {
+        fprintf(stderr,"ERROR: wt_load() not a wt index\n");
+        wt_free(wtl);
+        return NULL;
+    }
+    wtl->max_v = max_v;
+    wtl->bittree = (rankbv_t**) memalloc_calloc(wtl->height*sizeof(rankbv_t*));
+    if (!wtl->bittree) {
+        wt_free(wtl);
+        return NULL;
+    }
+    for (i=0; i<wtl->height; i++) {
+        wtl->bittree[i] = wt_loadlegacybv(f);
+        if (!wtl->bittree[i] || rankbv_length(wtl->bittree[i]) != n) {
+            fprintf(stderr,"ERROR: wt_load() cannot read level %zu\n",i);
+            wt_free(wtl);
+            return NULL;
+        }
+    }
+    if (wt_useocc(wtl->max_v,n)) {
+        size_t cbytes = (wtl->max_v+2)*sizeof(uint64_t);
+        uint64_t* C = (uint64_t*) memalloc_calloc(cbytes);
+        if (!C) {
+            wt_free(wtl);
+            return NULL;
+        }
+        for (i=0; i<=wtl->max_v; i++) C[i+1] = C[i] + wt_count(wtl,i);
+        wtl->occ = occ_create(C,wtl->max_v+2);
+        memalloc_free(C,cbytes);
+        if (!wtl->occ) {
+            wt_free(wtl);
+            return NULL;
+        }
+    }
+    return wtl;
+}
+
 wt_t*
 wt_load(FILE* f)
 {
     size_t i;
-    wt_t* wtl = wt_init(0);
-    if (fread(&wtl->n,sizeof(uint64_t),1,f)!=1) {
-        fprintf(stdout,"error reading wt->n\n");
-        exit(EXIT_FAILURE);
+    uint64_t magic;
+    uint32_t version;
+    if (fread(&magic,sizeof(uint64_t),1,f)!=1) {
+        fprintf(stderr,"ERROR: wt_load() cannot read the header\n");
+        return NULL;
     }
-    if (fread(&wtl->height,sizeof(uint32_t),1,f)!=1) {
-        fprintf(stdout,"error reading wt->height\n");
-        exit(EXIT_FAILURE);
+    if (magic != WT_MAGIC) return wt_loadlegacy(f,magic);
+    if (fread(&version,sizeof(uint32_t),1,f)!=1 || version != WT_VERSION) {
+        fprintf(stderr,"ERROR: wt_load() unsupported format\n");
+        return NULL;
     }
-    if (fread(&wtl->max_v,sizeof(uint32_t),1,f)!=1) {
-        fprintf(stdout,"error reading wt->max_v\n");
-        exit(EXIT_FAILURE);
+    wt_t* wtl = wt_init(0);
+    if (!wtl) return NULL;
+    uint32_t flags;
+    if (fread(&wtl->n,sizeof(uint64_t),1,f)!=1 ||
+        fread(&wtl->height,sizeof(uint32_t),1,f)!=1 ||
+        fread(&flags,sizeof(uint32_t),1,f)!=1 ||
+        fread(&wtl->max_v,sizeof(uint64_t),1,f)!=1 ||
+        wtl->height > RBVW) {
+        wtl->height = 0;
+        goto fail;
     }
 
 #ifdef _WT_DEBUG_
-    fprintf(stdout,"WT::Load() n=%zu height=%u max_v=%u\n",wtl->n,wtl->height,wtl->max_v);
+    fprintf(stdout,"WT::Load() n=%zu height=%u max_v=%zu\n",wtl->n,wtl->height,wtl->max_v);
 #endif
 
+    if (flags & WT_HASALPHA) {
+        /* every symbol of the alphabet occurs */
+        if (fread(&wtl->sigma,sizeof(uint64_t),1,f)!=1 || wtl->sigma > wtl->n ||
+            wtl->sigma > SIZE_MAX/sizeof(uint64_t)) {
+            wtl->sigma = 0;
+            goto fail;
+        }
+        wtl->alpha = (uint64_t*) memalloc_calloc(wtl->sigma*sizeof(uint64_t));
+        if (!wtl->alpha ||
+            fread(wtl->alpha,sizeof(uint64_t),wtl->sigma,f)!=wtl->sigma) goto fail;
+    }
+    if (flags & WT_HASOCC) {
 #ifdef _WT_DEBUG_
-    fprintf(stdout,"WT::Load() rankbv_load(wt->occ)\n");
+        fprintf(stdout,"WT::Load() occ_load(wt->occ)\n");
 #endif
-    wtl->occ = rankbv_load(f);
-    wtl->bittree = (rankbv_t**) wt_safecalloc(wtl->height*sizeof(rankbv_t*));
+        wtl->occ = occ_load(f);
+        if (!wtl->occ) goto fail;
+    }
+    wtl->bittree = (rankbv_t**) memalloc_calloc(wtl->height*sizeof(rankbv_t*));
+    if (!wtl->bittree) goto fail;
     for (i=0; i<wtl->height; i++) {
 #ifdef _WT_DEBUG_
         fprintf(stdout,"WT::Load() rankbv_load(wt->bittree[%zu])\n",i);
 #endif
         wtl->bittree[i] = rankbv_load(f);
+        if (!wtl->bittree[i] || rankbv_length(wtl->bittree[i]) != wtl->n) goto fail;
     }
     return wtl;
+fail:
+    fprintf(stderr,"ERROR: wt_load() cannot read the index\n");
+    wt_free(wtl);
+    return NULL;
 }
 
 void
 wt_save(wt_t* wt,FILE* f)
 {
 #ifdef _WT_DEBUG_
-    fprintf(stdout,"WT::Write() n=%zu height=%u max_v=%u\n",wt->n,wt->height,wt->max_v);
+    fprintf(stdout,"WT::Write() n=%zu height=%u max_v=%zu\n",wt->n,wt->height,wt->max_v);
 #endif
     size_t i;
-    if (fwrite(&(wt->n),sizeof(uint64_t),1,f)!=1) {
+    if (!wt_savemagic(f) || fwrite(&(wt->n),sizeof(uint64_t),1,f)!=1) {
         fprintf(stdout,"error writing wt->n\n");
         exit(EXIT_FAILURE);
     }
@@ -312,15 +1414,29 @@ wt_save(wt_t* wt,FILE* f)
         fprintf(stdout,"error writing wt->height\n");
         exit(EXIT_FAILURE);
     }
-    if (fwrite(&(wt->max_v),sizeof(uint32_t),1,f)!=1) {
+    uint32_t flags = (wt->occ ? WT_HASOCC : 0) | (wt->alpha ? WT_HASALPHA : 0);
+    if (fwrite(&flags,sizeof(uint32_t),1,f)!=1) {
+        fprintf(stdout,"error writing wt flags\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&(wt->max_v),sizeof(uint64_t),1,f)!=1) {
         fprintf(stdout,"error writing wt->max_v\n");
         exit(EXIT_FAILURE);
     }
 
+    if (wt->alpha) {
+        if (fwrite(&(wt->sigma),sizeof(uint64_t),1,f)!=1 ||
+            fwrite(wt->alpha,sizeof(uint64_t),wt->sigma,f)!=wt->sigma) {
+            fprintf(stdout,"error writing wt->alpha\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (wt->occ) {
 #ifdef _WT_DEBUG_
-    fprintf(stdout,"WT::Write() rankbv_save(wt->occ)\n");
+        fprintf(stdout,"WT::Write() occ_save(wt->occ)\n");
 #endif
-    rankbv_save(wt->occ,f);
+        occ_save(wt->occ,f);
+    }
     for (i=0; i<wt->height; i++) {
 #ifdef _WT_DEBUG_
         fprintf(stdout,"WT::Write() rankbv_save(wt->bittree[%zu])\n",i);
@@ -335,7 +1451,7 @@ wt_quantile_freq(wt_t* wt,size_t left,size_t right,size_t q)
     /* decrease q as the smallest element q=1 is
      * found by searching for 0 */
     q--;
-    uint32_t sym = 0;
+    uint64_t sym = 0;
     size_t freq = 0;
     uint32_t lvl = 0;
     size_t start = 0, end = wt->n-1;
@@ -382,106 +1498,710 @@ wt_quantile_freq(wt_t* wt,size_t left,size_t right,size_t q)
         lvl++;
     }
     wt_quant_t qf;
-    qf.sym = sym;
+    qf.sym = wt_symbol(wt,sym);
     qf.freq = freq;
     return qf;
 }
 
-uint32_t
+uint64_t
 wt_quantile(wt_t* wt,size_t left,size_t right,size_t quantile)
 {
     wt_quant_t q = wt_quantile_freq(wt,left,right,quantile);
     return q.sym;
 }
 
-int topkrange_cmp(const void* a,const void* b)
+int
+wt_ctx_grow(wt_ctx_t* ctx)
 {
-    wt_topkrange_t* wa = (wt_topkrange_t*)a;
-    wt_topkrange_t* wb = (wt_topkrange_t*)b;
-    return (wb->right-wb->left+1) - (wa->right-wa->left+1);
+    size_t size = 2*ctx->size;
+    wt_topknode_t* heap = (wt_topknode_t*) memalloc_calloc(size*sizeof(wt_topknode_t));
+    if (!heap) return 0;
+    memcpy(heap,ctx->heap,ctx->n*sizeof(wt_topknode_t));
+    if (ctx->heap != ctx->inlheap) memalloc_free(ctx->heap,ctx->size*sizeof(wt_topknode_t));
+    ctx->heap = heap;
+    ctx->size = size;
+    return 1;
 }
 
-wt_topkrange_t*
-new_topk_range(size_t l,size_t r,size_t s,size_t e,uint32_t lvl,uint32_t sym,size_t f)
+int
+wt_ctx_additem(wt_ctx_t* ctx,uint64_t sym,size_t freq,double score)
 {
-    wt_topkrange_t* res = (wt_topkrange_t*) wt_safecalloc(sizeof(wt_topkrange_t));
-    res->left = l;
-    res->right = r;
-    res->start = s;
-    res->end = e;
-    res->lvl = lvl;
-    res->sym = sym;
-    res->freq = f;
-    return res;
+    if (ctx->res.m == ctx->res.size) {
+        size_t size = 2*ctx->res.size;
+        wt_item_t* items = (wt_item_t*) memalloc_calloc(size*sizeof(wt_item_t));
+        if (!items) return 0;
+        memcpy(items,ctx->res.items,ctx->res.m*sizeof(wt_item_t));
+        if (ctx->res.items != ctx->inlitems) memalloc_free(ctx->res.items,ctx->res.size*sizeof(wt_item_t));
+        ctx->res.items = items;
+        ctx->res.size = size;
+    }
+    ctx->res.items[ctx->res.m].sym = sym;
+    ctx->res.items[ctx->res.m].freq = freq;
+    ctx->res.items[ctx->res.m].weight = 0;
+    ctx->res.items[ctx->res.m].score = score;
+    ctx->res.m++;
+    return 1;
 }
 
-wt_result_t*
-wt_mostfrequent(wt_t* wt,size_t left,size_t right,size_t k)
+void
+wt_ctx_init(wt_ctx_t* ctx)
 {
-    size_t before,newleft,newright;
+    ctx->heap = ctx->inlheap;
+    ctx->n = 0;
+    ctx->size = WT_CTX_INLINE;
+    ctx->weighted = 0;
+    ctx->res.items = ctx->inlitems;
+    ctx->res.size = WT_CTX_INLINE;
+    ctx->res.m = 0;
+}
 
-    wt_result_t* res = wt_newresult();
-    cbheap_t* h = cbheap_create(topkrange_cmp,free);
-    cbheap_insert(h,new_topk_range(left,right,0,wt->n-1,0,0,0));
-
-    while (h->n > 0) {
-        wt_topkrange_t* cr = (wt_topkrange_t*) cbheap_top(h);
-        size_t rleft = cr->left;
-        size_t rright = cr->right;
-        size_t rstart = cr->start;
-        size_t rend = cr->end;
-        uint32_t rlvl = cr->lvl;
-        uint32_t rsym = cr->sym;
-        size_t rfreq = cr->freq;
-
-        /* remove old range */
-        cbheap_delete_top(h); /* deletes cr */
-
-        rankbv_t* bs = wt->bittree[cr->lvl];
-        if (cr->lvl == wt->height) {  /* leaf node */
-            wt_addresult(res,rsym,rfreq,0);
-            if (res->m == k) {  /* we got the top-k */
+void
+wt_ctx_destroy(wt_ctx_t* ctx)
+{
+    if (ctx->heap != ctx->inlheap) memalloc_free(ctx->heap,ctx->size*sizeof(wt_topknode_t));
+    if (ctx->res.items != ctx->inlitems) memalloc_free(ctx->res.items,ctx->res.size*sizeof(wt_item_t));
+    wt_ctx_init(ctx);
+}
+
+/* node of code prefix sym on level lvl in the bound table */
+static inline double
+wt_weights_bound(const wt_weights_t* w,uint32_t lvl,uint64_t sym)
+{
+    uint32_t shift = w->height-lvl;
+    return w->maxw[w->off[lvl] + (shift >= RBVW ? 0 : sym >> shift)];
+}
+
+wt_weights_t*
+wt_weights_create(wt_t* wt,const double* weight,size_t m)
+{
+    uint64_t ncodes,c;
+    uint32_t lvl,h = wt->height;
+    size_t i,total = 0;
+
+    ncodes = wt->alpha ? wt->sigma : wt->max_v+1;
+    if (!ncodes) return NULL;
+    wt_weights_t* w = (wt_weights_t*) memalloc_calloc(sizeof(wt_weights_t));
+    if (!w) return NULL;
+    w->height = h;
+    w->off = (size_t*) memalloc_calloc((h+1)*sizeof(size_t));
+    if (!w->off) {
+        wt_weights_free(w);
+        return NULL;
+    }
+    /* level lvl holds the nodes 0..(ncodes-1)>>(h-lvl) */
+    for (lvl=0; lvl<=h; lvl++) {
+        uint32_t shift = h-lvl;
+        w->off[lvl] = total;
+        total += (shift >= RBVW ? 0 : (ncodes-1) >> shift) + 1;
+    }
+    w->size = total;
+    w->maxw = (double*) memalloc_calloc(total*sizeof(double));
+    if (!w->maxw) {
+        wt_weights_free(w);
+        return NULL;
+    }
+    for (c=0; c<ncodes; c++) {
+        uint64_t sym = wt_symbol(wt,c);
+        double x = sym < m ? weight[sym] : 0;
+        if (!(x >= 0)) {  /* negative or NaN breaks the bounds */
+            wt_weights_free(w);
+            return NULL;
+        }
+        w->maxw[w->off[h]+c] = x;
+    }
+    /* a node bounds the weights of its children */
+    for (lvl=h; lvl>0; lvl--) {
+        size_t nchild = (lvl == h ? total : w->off[lvl+1]) - w->off[lvl];
+        for (i=0; i<nchild; i++) {
+            double* p = &w->maxw[w->off[lvl-1]+i/2];
+            if (w->maxw[w->off[lvl]+i] > *p) *p = w->maxw[w->off[lvl]+i];
+        }
+    }
+    return w;
+}
+
+void
+wt_weights_free(wt_weights_t* w)
+{
+    if (!w) return;
+    if (w->maxw) memalloc_free(w->maxw,w->size*sizeof(double));
+    if (w->off) memalloc_free(w->off,(w->height+1)*sizeof(size_t));
+    memalloc_free(w,sizeof(wt_weights_t));
+}
+
+/* best-first descent. with weights a node is keyed on its range size
+ * times the largest weight below it, which bounds the score of every
+ * leaf in its subtree, and a leaf on its exact score. a popped leaf is
+ * then at least as good as anything left in the heap, so the first k
+ * leaves popped are the answer */
+static const wt_result_t*
+wt_topk(wt_t* wt,const wt_weights_t* w,wt_ctx_t* ctx,size_t left,size_t right,size_t k)
+{
+    size_t before;
+    wt_topknode_t cr,child;
+
+    ctx->n = 0;
+    ctx->res.m = 0;
+    ctx->weighted = (w != NULL);
+    if (!wt->n || left > right) return &ctx->res;
+    cr.left = left;
+    cr.right = right;
+    cr.start = 0;
+    cr.end = wt->n-1;
+    cr.lvl = 0;
+    cr.sym = 0;
+    cr.bound = w ? (right-left+1)*wt_weights_bound(w,0,0) : 0;
+    if (!wt_ctx_push(ctx,&cr)) return NULL;
+
+    while (ctx->n > 0) {
+        wt_ctx_pop(ctx,&cr);
+
+        if (cr.lvl == wt->height) {  /* leaf node */
+            if (!wt_ctx_additem(ctx,wt_symbol(wt,cr.sym),wt_topknode_size(&cr),cr.bound)) return NULL;
+            if (ctx->res.m == k) {  /* we got the top-k */
                 break;
             }
             continue;
         }
+        rankbv_t* bs = wt->bittree[cr.lvl];
         /* calc start of level bound */
-        if (cr->start == 0) before = 0;
-        else before = rankbv_rank1(bs,rstart-1);
+        if (cr.start == 0) before = 0;
+        else before = rankbv_rank1(bs,cr.start-1);
 
         /* number of 1s before T[l..r] */
-        size_t rank_before_left = rankbv_rank1(bs,rstart+rleft-1);
+        size_t rank_before_left = rankbv_rank1(bs,cr.start+cr.left-1);
         /* number of 1s before T[r] */
-        size_t rank_before_right = rankbv_rank1(bs,rstart+rright);
+        size_t rank_before_right = rankbv_rank1(bs,cr.start+cr.right);
         /* number of 1s in T[l..r] */
         size_t num_ones = rank_before_right - rank_before_left;
         /* number of 0s in T[l..r] */
-        size_t num_zeros = (rright-rleft+1) - num_ones;
+        size_t num_zeros = (cr.right-cr.left+1) - num_ones;
         /* new interval bounds */
-        size_t newintbound = rend - (rankbv_rank1(bs,rend)-before);
+        size_t newintbound = cr.end - (rankbv_rank1(bs,cr.end)-before);
 
+        child.lvl = cr.lvl+1;
         if (num_ones) {  /* right child */
-            size_t sym = wt_mark(rsym,wt->height,rlvl);
+            child.sym = wt_mark(cr.sym,wt->height,cr.lvl);
             /* number of 1s before T[l..r] within the current node */
-            newleft = rank_before_left - before;
+            child.left = rank_before_left - before;
             /* number of 1s in T[l..r] */
-            newright = rank_before_right - before - 1;
+            child.right = rank_before_right - before - 1;
             /* calc starting pos of right childnode */
-            size_t start = newintbound + 1;
-            cbheap_insert(h,new_topk_range(newleft,newright,start,rend,rlvl+1,sym,num_ones));
+            child.start = newintbound + 1;
+            child.end = cr.end;
+            child.bound = w ? num_ones*wt_weights_bound(w,child.lvl,child.sym) : 0;
+            if (!wt_ctx_push(ctx,&child)) return NULL;
         }
         if (num_zeros) {  /* left child */
+            child.sym = cr.sym;
             /* number of zeros before T[l..r] within the current node */
-            newleft = rleft - (rank_before_left - before);
+            child.left = cr.left - (rank_before_left - before);
             /* number of zeros in T[l..r] + left bound */
-            newright = rright - (rank_before_right - before);
+            child.right = cr.right - (rank_before_right - before);
             /* calc end pos of left childnode */
-            size_t end = newintbound;
-            cbheap_insert(h,new_topk_range(newleft,newright,rstart,end,rlvl+1,rsym,num_zeros));
+            child.start = cr.start;
+            child.end = newintbound;
+            child.bound = w ? num_zeros*wt_weights_bound(w,child.lvl,child.sym) : 0;
+            if (!wt_ctx_push(ctx,&child)) return NULL;
+        }
+    }
+    return &ctx->res;
+}
+
+const wt_result_t*
+wt_mostfrequent_ctx(wt_t* wt,wt_ctx_t* ctx,size_t left,size_t right,size_t k)
+{
+    return wt_topk(wt,NULL,ctx,left,right,k);
+}
+
+const wt_result_t*
+wt_topk_weighted_ctx(wt_t* wt,const wt_weights_t* w,wt_ctx_t* ctx,size_t left,size_t right,size_t k)
+{
+    return wt_topk(wt,w,ctx,left,right,k);
+}
+
+/* copy a context result into one the caller owns */
+wt_result_t*
+wt_ctx_result(wt_ctx_t* ctx,const wt_result_t* r)
+{
+    wt_result_t* res = NULL;
+    if (r) {
+        res = wt_newresult_size(r->m ? r->m : 1);
+        memcpy(res->items,r->items,r->m*sizeof(wt_item_t));
+        res->m = r->m;
+    }
+    wt_ctx_destroy(ctx);
+    return res;
+}
+
+wt_result_t*
+wt_mostfrequent(wt_t* wt,size_t left,size_t right,size_t k)
+{
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    return wt_ctx_result(&ctx,wt_topk(wt,NULL,&ctx,left,right,k));
+}
+
+wt_result_t*
+wt_topk_weighted(wt_t* wt,const wt_weights_t* w,size_t left,size_t right,size_t k)
+{
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    return wt_ctx_result(&ctx,wt_topk(wt,w,&ctx,left,right,k));
+}
+
+/* ranges of a node are node relative and half-open [sp,ep). the two
+ * children of a node on level lvl use frames 2*lvl+1 and 2*lvl+2 */
+static void
+wt_intersectlvl(wt_t* wt,wt_result_t* res,wt_range_t* frames,size_t m,size_t threshold,
+                uint32_t lvl,size_t start,size_t end,uint64_t sym)
+{
+    size_t i;
+    wt_range_t* R = frames + (lvl ? 2*lvl-1 : 0)*m;
+    if (lvl && (sym & 1ULL<<(wt->height-lvl))) R += m;
+
+    if (lvl == wt->height) {  /* leaf */
+        size_t freq = 0, nonempty = 0;
+        for (i=0; i<m; i++) {
+            freq += R[i].ep - R[i].sp;
+            nonempty += R[i].ep > R[i].sp;
         }
+        wt_addresult(res,wt_symbol(wt,sym),freq,nonempty);
+        return;
+    }
+
+    rankbv_t* bs = wt->bittree[lvl];
+    wt_range_t* left = frames + (2*lvl+1)*m;
+    wt_range_t* right = left + m;
+    size_t before = rankbv_rank1(bs,start-1);
+    size_t cleft = 0, cright = 0;
+    for (i=0; i<m; i++) {
+        if (R[i].ep > R[i].sp) {
+            /* 1s before sp and ep within the node */
+            size_t ob = rankbv_rank1(bs,start+R[i].sp-1) - before;
+            size_t oe = rankbv_rank1(bs,start+R[i].ep-1) - before;
+            left[i].sp = R[i].sp - ob;
+            left[i].ep = R[i].ep - oe;
+            right[i].sp = ob;
+            right[i].ep = oe;
+        } else {
+            left[i].sp = left[i].ep = right[i].sp = right[i].ep = 0;
+        }
+        cleft += left[i].ep > left[i].sp;
+        cright += right[i].ep > right[i].sp;
+    }
+
+    size_t ones = rankbv_rank1(bs,end) - before;
+    if (cleft >= threshold) {
+        wt_intersectlvl(wt,res,frames,m,threshold,lvl+1,start,end-ones,sym);
+    }
+    if (cright >= threshold) {
+        wt_intersectlvl(wt,res,frames,m,threshold,lvl+1,end-ones+1,end,
+                        wt_mark(sym,wt->height,lvl));
+    }
+}
+
+wt_result_t*
+wt_intersect(wt_t* wt,wt_range_t* ranges,size_t m,size_t threshold)
+{
+    size_t i,nonempty = 0;
+    /* absent symbols are never reported */
+    if (!threshold) threshold = 1;
 
+    wt_result_t* res = wt_newresult();
+    size_t framebytes = (2*wt->height+1)*m*sizeof(wt_range_t);
+    wt_range_t* frames = (wt_range_t*) memalloc_calloc(framebytes);
+    if (!frames) {
+        wt_freeresult(res);
+        return NULL;
+    }
+    for (i=0; i<m; i++) {
+        if (ranges[i].sp <= ranges[i].ep) {
+            frames[i].sp = ranges[i].sp;
+            frames[i].ep = ranges[i].ep+1;
+            nonempty++;
+        }
+    }
+    /* all ranges are descended together, a node is only visited
+     * if at least threshold of them reach it */
+    if (wt->n && nonempty >= threshold) {
+        wt_intersectlvl(wt,res,frames,m,threshold,0,0,wt->n-1,0);
     }
-    cbheap_free(h);
+    memalloc_free(frames,framebytes);
     return res;
 }
 
+/* cursor counting the symbols < x in the node relative range [sp,ep)
+ * of node [start,end], one level at a time */
+typedef struct wt_lesscur {
+    size_t start;
+    size_t end;
+    size_t sp;
+    size_t ep;
+    size_t cnt;
+    uint64_t x;
+} wt_lesscur_t;
+
+static inline void
+wt_lesscur_init(wt_t* wt,wt_lesscur_t* c,size_t l,size_t r,uint64_t x)
+{
+    c->start = 0;
+    c->end = wt->n-1;
+    c->sp = l;
+    c->ep = r+1;
+    c->cnt = 0;
+    c->x = x;
+}
+
+static inline void
+wt_lesscur_prefetch(rankbv_t* bs,wt_lesscur_t* c)
+{
+    rankbv_prefetch(bs,c->start-1);
+    rankbv_prefetch(bs,c->start+c->sp-1);
+    rankbv_prefetch(bs,c->start+c->ep-1);
+    rankbv_prefetch(bs,c->end);
+}
+
+static inline void
+wt_lesscur_step(wt_t* wt,wt_lesscur_t* c,uint32_t lvl)
+{
+    rankbv_t* bs = wt->bittree[lvl];
+    size_t before = rankbv_rank1(bs,c->start-1);
+    /* 1s before sp and ep within the node */
+    size_t ob = rankbv_rank1(bs,c->start+c->sp-1) - before;
+    size_t oe = rankbv_rank1(bs,c->start+c->ep-1) - before;
+    size_t ones = rankbv_rank1(bs,c->end) - before;
+
+    if (wt_marked(c->x,wt->height,lvl)) {
+        /* everything in the left child is smaller */
+        c->cnt += (c->ep-c->sp) - (oe-ob);
+        c->sp = ob;
+        c->ep = oe;
+        c->start = c->end - ones + 1;
+    } else {
+        c->sp -= ob;
+        c->ep -= oe;
+        c->end = c->end - ones;
+    }
+}
+
+/* clamp a query to the index. returns 0 if it is empty, otherwise
+ * whether hi covers max_v, i.e. needs no upper descent */
+static inline int
+wt_rangeq_clamp(wt_t* wt,size_t* l,size_t* r,uint64_t* lo,uint64_t* hi,int* upper)
+{
+    if (!wt->n || *l > *r || *lo > *hi || *l >= wt->n) return 0;
+    if (!wt_coderange(wt,lo,hi) || *lo > wt->max_v) return 0;
+    if (*r >= wt->n) *r = wt->n-1;
+    *upper = *hi < wt->max_v;
+    return 1;
+}
+
+size_t
+wt_range_count(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi)
+{
+    uint32_t lvl;
+    int upper;
+    wt_lesscur_t clo,chi;
+
+    if (!wt_rangeq_clamp(wt,&l,&r,&lo,&hi,&upper)) return 0;
+    /* #symbols < hi+1 minus #symbols < lo */
+    wt_lesscur_init(wt,&clo,l,r,lo);
+    wt_lesscur_init(wt,&chi,l,r,hi+1);
+    for (lvl=0; lvl<wt->height && clo.sp<clo.ep; lvl++) wt_lesscur_step(wt,&clo,lvl);
+    if (!upper) return (r-l+1) - clo.cnt;
+    for (lvl=0; lvl<wt->height && chi.sp<chi.ep; lvl++) wt_lesscur_step(wt,&chi,lvl);
+    return chi.cnt - clo.cnt;
+}
+
+void
+wt_range_count_batch(wt_t* wt,const wt_rangeq_t* q,size_t m,size_t* out)
+{
+    size_t i,j;
+    uint32_t lvl;
+    wt_lesscur_t cur[2*RANKBV_BATCH];
+    int upper[RANKBV_BATCH];
+    int valid[RANKBV_BATCH];
+
+    for (i=0; i<m; i+=RANKBV_BATCH) {
+        size_t stop = i+RANKBV_BATCH < m ? i+RANKBV_BATCH : m;
+        size_t nc = 2*(stop-i);
+        for (j=i; j<stop; j++) {
+            size_t l = q[j].l, r = q[j].r;
+            uint64_t lo = q[j].lo, hi = q[j].hi;
+            wt_lesscur_t* c = &cur[2*(j-i)];
+            valid[j-i] = wt_rangeq_clamp(wt,&l,&r,&lo,&hi,&upper[j-i]);
+            if (valid[j-i]) {
+                wt_lesscur_init(wt,&c[0],l,r,lo);
+                wt_lesscur_init(wt,&c[1],l,r,upper[j-i] ? hi+1 : 0);
+                if (!upper[j-i]) c[1].ep = c[1].sp;
+            } else {
+                c[0].sp = c[0].ep = c[1].sp = c[1].ep = 0;
+            }
+        }
+        /* all descents of the group advance a level together, the lines
+         * of the next level are prefetched before any rank is resolved */
+        for (lvl=0; lvl<wt->height; lvl++) {
+            rankbv_t* bs = wt->bittree[lvl];
+            for (j=0; j<nc; j++)
+                if (cur[j].sp < cur[j].ep) wt_lesscur_prefetch(bs,&cur[j]);
+            for (j=0; j<nc; j++)
+                if (cur[j].sp < cur[j].ep) wt_lesscur_step(wt,&cur[j],lvl);
+        }
+        for (j=i; j<stop; j++) {
+            wt_lesscur_t* c = &cur[2*(j-i)];
+            if (!valid[j-i]) out[j] = 0;
+            else if (!upper[j-i]) out[j] = (wt_min(q[j].r,wt->n-1)-q[j].l+1) - c[0].cnt;
+            else out[j] = c[1].cnt - c[0].cnt;
+        }
+    }
+}
+
+/* child nodes of f and the parts of its range [sp,ep) they hold */
+static inline void
+wt_children(wt_t* wt,const wt_iterframe_t* f,wt_iterframe_t* left,wt_iterframe_t* right)
+{
+    rankbv_t* bs = wt->bittree[f->lvl];
+    size_t before = rankbv_rank1(bs,f->start-1);
+    /* 1s before sp and ep within the node */
+    size_t ob = rankbv_rank1(bs,f->start+f->sp-1) - before;
+    size_t oe = rankbv_rank1(bs,f->start+f->ep-1) - before;
+    size_t ones = rankbv_rank1(bs,f->end) - before;
+
+    left->start = f->start;
+    left->end = f->end - ones;
+    left->sp = f->sp - ob;
+    left->ep = f->ep - oe;
+    left->sym = f->sym;
+    left->lvl = f->lvl+1;
+
+    right->start = f->end - ones + 1;
+    right->end = f->end;
+    right->sp = ob;
+    right->ep = oe;
+    right->sym = wt_mark(f->sym,wt->height,f->lvl);
+    right->lvl = f->lvl+1;
+}
+
+void
+wt_iter_init(wt_iter_t* it,wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi)
+{
+    int upper;
+    it->wt = wt;
+    it->top = 0;
+    it->leaf.sp = it->leaf.ep = 0;
+    it->k = 0;
+    if (!wt_rangeq_clamp(wt,&l,&r,&lo,&hi,&upper)) return;
+    it->lo = lo;
+    it->hi = hi;
+
+    wt_iterframe_t* root = &it->stack[it->top++];
+    root->start = 0;
+    root->end = wt->n-1;
+    root->sp = l;
+    root->ep = r+1;
+    root->sym = 0;
+    root->lvl = 0;
+}
+
+/* depth first to the next leaf overlapping [lo,hi]. the right child is
+ * pushed first so leaves come in symbol order, the stack never holds
+ * more than height+1 frames */
+static int
+wt_iter_leaf(wt_iter_t* it)
+{
+    wt_t* wt = it->wt;
+    while (it->top) {
+        wt_iterframe_t f = it->stack[--it->top];
+        if (f.lvl == wt->height) {
+            it->leaf = f;
+            it->k = 0;
+            return 1;
+        }
+
+        wt_iterframe_t c[2];
+        /* symbols below a child differ in the low height-lvl-1 bits */
+        uint64_t low = (1ULL<<(wt->height-f.lvl-1))-1;
+        wt_children(wt,&f,&c[0],&c[1]);
+        if (c[1].ep > c[1].sp && c[1].sym <= it->hi && (c[1].sym|low) >= it->lo)
+            it->stack[it->top++] = c[1];
+        if (c[0].ep > c[0].sp && c[0].sym <= it->hi && (c[0].sym|low) >= it->lo)
+            it->stack[it->top++] = c[0];
+    }
+    return 0;
+}
+
+int
+wt_iter_next(wt_iter_t* it,uint64_t* sym,size_t* freq)
+{
+    if (!wt_iter_leaf(it)) return 0;
+    *sym = wt_symbol(it->wt,it->leaf.sym);
+    *freq = it->leaf.ep - it->leaf.sp;
+    return 1;
+}
+
+int
+wt_iter_nextpos(wt_iter_t* it,size_t* pos,uint64_t* sym)
+{
+    if (it->k == it->leaf.ep - it->leaf.sp) {
+        if (!wt_iter_leaf(it)) return 0;
+        wt_starts(it->wt,it->leaf.sym,it->starts);
+    }
+    *sym = wt_symbol(it->wt,it->leaf.sym);
+    *pos = wt_selectup(it->wt,it->leaf.sym,it->starts,it->leaf.sp+it->k+1);
+    it->k++;
+    return 1;
+}
+
+size_t
+wt_range_report(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi,wt_report_f f,void* ctx)
+{
+    wt_iter_t it;
+    uint64_t sym;
+    size_t freq,m = 0;
+    wt_iter_init(&it,wt,l,r,lo,hi);
+    while (wt_iter_next(&it,&sym,&freq)) {
+        m++;
+        if (f(sym,freq,ctx)) break;
+    }
+    return m;
+}
+
+size_t
+wt_range_report_pos(wt_t* wt,size_t l,size_t r,uint64_t lo,uint64_t hi,wt_reportpos_f f,void* ctx)
+{
+    wt_iter_t it;
+    uint64_t sym;
+    size_t pos,m = 0;
+    wt_iter_init(&it,wt,l,r,lo,hi);
+    while (wt_iter_nextpos(&it,&pos,&sym)) {
+        m++;
+        if (f(pos,sym,ctx)) break;
+    }
+    return m;
+}
+
+/* smallest (largest if prev) symbol >= x (<= x) below f. children that
+ * cannot hold one are skipped, once a child lies strictly beyond x its
+ * first non-empty path is the answer, so few nodes are revisited */
+static int
+wt_nextvalue(wt_t* wt,const wt_iterframe_t* f,uint64_t x,int prev,wt_quant_t* res)
+{
+    size_t i;
+    wt_iterframe_t c[2];
+
+    if (f->lvl == wt->height) {
+        res->sym = f->sym;
+        res->freq = f->ep - f->sp;
+        return 1;
+    }
+    uint64_t low = (1ULL<<(wt->height-f->lvl-1))-1;
+    wt_children(wt,f,&c[0],&c[1]);
+    for (i=0; i<2; i++) {
+        wt_iterframe_t* child = &c[prev ? 1-i : i];
+        if (child->ep == child->sp) continue;
+        if (!prev && (child->sym|low) < x) continue;
+        if (prev && child->sym > x) continue;
+        if (wt_nextvalue(wt,child,x,prev,res)) return 1;
+    }
+    return 0;
+}
+
+static wt_quant_t
+wt_range_value(wt_t* wt,size_t l,size_t r,uint64_t x,int prev)
+{
+    int upper;
+    uint64_t lo = prev ? 0 : x;
+    uint64_t hi = prev ? x : ~0ULL;
+    wt_quant_t res;
+    res.sym = 0;
+    res.freq = 0;
+    if (!wt_rangeq_clamp(wt,&l,&r,&lo,&hi,&upper)) return res;
+    /* x in codes */
+    x = prev ? hi : lo;
+
+    wt_iterframe_t root;
+    root.start = 0;
+    root.end = wt->n-1;
+    root.sp = l;
+    root.ep = r+1;
+    root.sym = 0;
+    root.lvl = 0;
+    if (wt_nextvalue(wt,&root,x,prev,&res)) res.sym = wt_symbol(wt,res.sym);
+    return res;
+}
+
+wt_quant_t
+wt_range_next_value(wt_t* wt,size_t l,size_t r,uint64_t x)
+{
+    return wt_range_value(wt,l,r,x,0);
+}
+
+wt_quant_t
+wt_range_prev_value(wt_t* wt,size_t l,size_t r,uint64_t x)
+{
+    return wt_range_value(wt,l,r,x,1);
+}
+
+/* decode the node range f into out. idx[0..ep-sp) holds the output slot
+ * of every position of the range, tmp is scratch of the same size. both
+ * children are visited left to right, so every level is read in
+ * increasing position order */
+static void
+wt_extractlvl(wt_t* wt,const wt_iterframe_t* f,size_t* idx,size_t* tmp,uint64_t* out)
+{
+    size_t i,m = f->ep - f->sp;
+    size_t cz = 0, co = 0;
+    wt_iterframe_t c[2];
+
+    if (f->lvl == wt->height || !m) return;
+
+    rankbv_t* bs = wt->bittree[f->lvl];
+    uint64_t bit = 1ULL<<(wt->height-f->lvl-1);
+    size_t p = f->start + f->sp;
+    uint64_t w = bs->S[rankbv_word(bs,p/RBVW)] >> (p%RBVW);
+    for (i=0; i<m; i++,p++) {
+        if (i && p%RBVW == 0) w = bs->S[rankbv_word(bs,p/RBVW)];
+        /* stable split of the output slots into left and right child */
+        if (w & 1) {
+            out[idx[i]] |= bit;
+            tmp[co++] = idx[i];
+        } else {
+            idx[cz++] = idx[i];
+        }
+        w >>= 1;
+    }
+    memcpy(idx+cz,tmp,co*sizeof(size_t));
+
+    wt_children(wt,f,&c[0],&c[1]);
+    wt_extractlvl(wt,&c[0],idx,tmp,out);
+    wt_extractlvl(wt,&c[1],idx+cz,tmp+cz,out);
+}
+
+int
+wt_extract(wt_t* wt,size_t l,size_t r,uint64_t* out)
+{
+    size_t i;
+    if (l > r || r >= wt->n) return 0;
+    size_t m = r-l+1;
+    size_t bytes = 2*m*sizeof(size_t);
+    size_t* idx = (size_t*) memalloc_calloc(bytes);
+    if (!idx) return 0;
+    for (i=0; i<m; i++) {
+        idx[i] = i;
+        out[i] = 0;
+    }
+
+    wt_iterframe_t root;
+    root.start = 0;
+    root.end = wt->n-1;
+    root.sp = l;
+    root.ep = r+1;
+    root.sym = 0;
+    root.lvl = 0;
+    wt_extractlvl(wt,&root,idx,idx+m,out);
+    if (wt->alpha) for (i=0; i<m; i++) out[i] = wt->alpha[out[i]];
+
+    memalloc_free(idx,bytes);
+    return 1;
+}
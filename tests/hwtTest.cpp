@@ -0,0 +1,289 @@
+#include "TestHarness.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "hwt.h"
+
+/* zipf-ish: symbol k (0-based rank) with probability ~ 1/(k+1) */
+static uint64_t* init_TZipf(size_t n,size_t sigma,uint64_t** copy)
+{
+    size_t i;
+    double* cdf = (double*) malloc(sigma*sizeof(double));
+    double sum = 0;
+    for (i=0; i<sigma; i++) {
+        sum += 1.0/(i+1);
+        cdf[i] = sum;
+    }
+    uint64_t* T = (uint64_t*) calloc(((n*16)/64+1),sizeof(uint64_t));
+    *copy = (uint64_t*) malloc(n*sizeof(uint64_t));
+    for (i=0; i<n; i++) {
+        double u = (rand()/(double)RAND_MAX)*sum;
+        size_t k = std::lower_bound(cdf,cdf+sigma,u) - cdf;
+        if (k >= sigma) k = sigma-1;
+        /* spread the ranks over the value space */
+        (*copy)[i] = (k*7919) % 40000;
+        wt_setsym(T,16,i,(*copy)[i]);
+    }
+    free(cdf);
+    return T;
+}
+
+TEST(hwt , accessrankselect)
+{
+    size_t n = 50000,i,j;
+    uint64_t* Tcopy;
+    uint64_t* T = init_TZipf(n,500,&Tcopy);
+
+    hwt_t* hwt = hwt_create(T,16,n,4);
+    CHECK(hwt != NULL);
+
+    for (i=0; i<n; i++) CHECK(hwt_access(hwt,i) == Tcopy[i]);
+    for (i=0; i<200; i++) {
+        size_t pos = rand() % n;
+        size_t cnt = 0;
+        for (j=0; j<=pos; j++) if (Tcopy[j]==Tcopy[pos]) cnt++;
+        CHECK(hwt_rank(hwt,Tcopy[pos],pos) == cnt);
+        CHECK(hwt_select(hwt,Tcopy[pos],cnt) == pos);
+        CHECK(hwt_count(hwt,Tcopy[pos]) == (size_t)std::count(Tcopy,Tcopy+n,Tcopy[pos]));
+    }
+    /* no rank k < 500 maps to 2 */
+    CHECK(hwt_rank(hwt,2,n-1) == 0);
+    CHECK(hwt_count(hwt,2) == 0);
+    CHECK(hwt_select(hwt,2,1) == (size_t)-1);
+
+    hwt_free(hwt);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(hwt , entropyshape)
+{
+    size_t n = 50000,i;
+    uint64_t* Tcopy;
+    uint64_t* T = init_TZipf(n,500,&Tcopy);
+
+    hwt_t* hwt = hwt_create(T,16,n,4);
+
+    /* total level bits stay within n(H0+2) */
+    double H0 = 0;
+    for (i=0; i<hwt->sigma; i++) {
+        double p = hwt->freq[i]/(double)n;
+        H0 -= p*log2(p);
+    }
+    size_t bits = 0;
+    for (i=0; i<hwt->height; i++) bits += rankbv_length(hwt->levels[i]);
+    CHECK(bits <= n*(H0+2));
+    CHECK(bits < n*wt_bits(hwt->sigma-1));
+
+    /* the most frequent symbol has a short path */
+    uint32_t d;
+    hwt_leaf(hwt,0,NULL,&d);
+    CHECK(d <= 3);
+
+    hwt_free(hwt);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(hwt , quantiletopk)
+{
+    size_t n = 50000,i,k;
+    uint64_t* Tcopy;
+    uint64_t* T = init_TZipf(n,500,&Tcopy);
+
+    hwt_t* hwt = hwt_create(T,16,n,4);
+
+    for (k=0; k<20; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % (n-l);
+        size_t m = r-l+1;
+        uint64_t* sorted = (uint64_t*) malloc(m*sizeof(uint64_t));
+        memcpy(sorted,Tcopy+l,m*sizeof(uint64_t));
+        std::sort(sorted,sorted+m);
+        size_t q = 1 + rand() % m;
+        wt_quant_t qf = hwt_quantile_freq(hwt,l,r,q);
+        CHECK(qf.sym == sorted[q-1]);
+        CHECK(qf.freq == (size_t)std::count(sorted,sorted+m,sorted[q-1]));
+
+        wt_result_t* res = hwt_mostfrequent(hwt,l,r,5);
+        for (i=0; i<res->m; i++) {
+            CHECK(res->items[i].freq == (size_t)std::count(sorted,sorted+m,res->items[i].sym));
+            if (i) CHECK(res->items[i-1].freq >= res->items[i].freq);
+        }
+        wt_freeresult(res);
+        free(sorted);
+    }
+
+    /* a reused context gives the same answers */
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    for (k=0; k<20; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % (n-l);
+        wt_result_t* res = hwt_mostfrequent(hwt,l,r,10);
+        const wt_result_t* cres = hwt_mostfrequent_ctx(hwt,&ctx,l,r,10);
+        CHECK(cres != NULL && cres->m == res->m);
+        for (i=0; cres && i<res->m; i++) CHECK(cres->items[i].freq == res->items[i].freq);
+        wt_freeresult(res);
+    }
+    CHECK(hwt_mostfrequent_ctx(hwt,&ctx,5,4,10)->m == 0);
+    wt_ctx_destroy(&ctx);
+
+    hwt_free(hwt);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(hwt , skewed)
+{
+    /* symbol i occurs fib(i+1) times, every weight balanced split peels
+     * off about one symbol so the tree is as deep as it gets */
+    size_t sigma = 28,n = 0,i,j;
+    size_t f[28];
+    f[0] = f[1] = 1;
+    for (i=2; i<sigma; i++) f[i] = f[i-1]+f[i-2];
+    for (i=0; i<sigma; i++) n += f[i];
+    uint64_t* T = (uint64_t*) calloc(((n*8)/64+1),sizeof(uint64_t));
+    uint64_t* Tcopy = (uint64_t*) malloc(n*sizeof(uint64_t));
+    size_t pos = 0;
+    for (i=0; i<sigma; i++) for (j=0; j<f[i]; j++) Tcopy[pos++] = i;
+    std::random_shuffle(Tcopy,Tcopy+n);
+    for (i=0; i<n; i++) wt_setsym(T,8,i,Tcopy[i]);
+
+    hwt_t* hwt = hwt_create(T,8,n,4);
+    CHECK(hwt != NULL);
+    CHECK(hwt->height <= HWT_MAXDEPTH);
+    for (i=0; i<n; i+=97) CHECK(hwt_access(hwt,i) == Tcopy[i]);
+    for (i=0; i<sigma; i++) {
+        CHECK(hwt_count(hwt,i) == f[i]);
+        CHECK(hwt_select(hwt,i,f[i]) != (size_t)-1);
+    }
+    wt_result_t* res = hwt_mostfrequent(hwt,0,n-1,3);
+    CHECK(res->m == 3);
+    CHECK(res->items[0].sym == sigma-1 && res->items[0].freq == f[sigma-1]);
+    CHECK(res->items[2].freq == f[sigma-3]);
+    wt_freeresult(res);
+
+    hwt_free(hwt);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(hwt , saveload)
+{
+    size_t n = 20000,i;
+    uint64_t* Tcopy;
+    uint64_t* T = init_TZipf(n,100,&Tcopy);
+
+    hwt_t* hwt = hwt_create(T,16,n,0);
+    FILE* f = tmpfile();
+    hwt_save(hwt,f);
+    rewind(f);
+    hwt_t* hwtl = hwt_load(f);
+    fclose(f);
+
+    CHECK(hwtl != NULL);
+    CHECK(hwt_spaceusage(hwtl) == hwt_spaceusage(hwt));
+    for (i=0; i<n; i++) CHECK(hwt_access(hwtl,i) == Tcopy[i]);
+
+    /* a wt index is not read as an hwt */
+    wt_t* wt = wt_create(T,16,n,0);
+    f = tmpfile();
+    wt_save(wt,f);
+    rewind(f);
+    CHECK(hwt_load(f) == NULL);
+    fclose(f);
+    wt_free(wt);
+
+    /* a single symbol needs no levels */
+    uint64_t one[2] = { 0, 0 };
+    for (i=0; i<64; i++) wt_setsym(one,1,i,1);
+    hwt_t* h1 = hwt_create(one,1,64,0);
+    CHECK(h1->height == 0);
+    CHECK(hwt_access(h1,10) == 1);
+    CHECK(hwt_rank(h1,1,10) == 11);
+    CHECK(hwt_select(h1,1,5) == 4);
+    CHECK(hwt_quantile(h1,3,9,2) == 1);
+    hwt_free(h1);
+
+    hwt_free(hwt);
+    hwt_free(hwtl);
+    free(T);
+    free(Tcopy);
+}
+
+/* a file holding the first len bytes of buf */
+static FILE* prefix_file(const char* buf,size_t len)
+{
+    FILE* f = tmpfile();
+    fwrite(buf,1,len,f);
+    rewind(f);
+    return f;
+}
+
+TEST(hwt , loadtruncated)
+{
+    size_t n = 20000,len,i;
+    uint64_t* Tcopy;
+    uint64_t* T = init_TZipf(n,100,&Tcopy);
+    hwt_t* hwt = hwt_create(T,16,n,0);
+    FILE* f = tmpfile();
+    hwt_save(hwt,f);
+    len = ftell(f);
+    rewind(f);
+    char* buf = (char*) malloc(len);
+    CHECK(fread(buf,1,len,f) == len);
+    fclose(f);
+
+    /* every field of the header cut short and a spread of cuts in the
+     * body, none of them exits */
+    for (i=0; i<len; i += (i < 64 ? 4 : len/16)) {
+        f = prefix_file(buf,i);
+        CHECK(hwt_load(f) == NULL);
+        fclose(f);
+    }
+
+    /* magic, version, n, sigma, height, root, syms, freq, nodes */
+    uint32_t h = HWT_MAXDEPTH+1;
+    memcpy(buf+28,&h,sizeof(h));
+    f = prefix_file(buf,len);
+    CHECK(hwt_load(f) == NULL);
+    fclose(f);
+    h = hwt->height;
+    memcpy(buf+28,&h,sizeof(h));
+
+    uint64_t root = hwt->sigma;
+    memcpy(buf+32,&root,sizeof(root));
+    f = prefix_file(buf,len);
+    CHECK(hwt_load(f) == NULL);
+    fclose(f);
+    root = hwt->root;
+    memcpy(buf+32,&root,sizeof(root));
+
+    /* the first node points back at itself */
+    size_t child0 = 40 + 16*hwt->sigma + offsetof(hwt_node_t,child);
+    uint64_t self = 0;
+    memcpy(buf+child0,&self,sizeof(self));
+    f = prefix_file(buf,len);
+    CHECK(hwt_load(f) == NULL);
+    fclose(f);
+    memcpy(buf+child0,&hwt->nodes[0].child[0],sizeof(uint64_t));
+
+    /* restored, it loads again */
+    f = prefix_file(buf,len);
+    hwt_t* hwtl = hwt_load(f);
+    fclose(f);
+    CHECK(hwtl != NULL);
+    for (i=0; hwtl && i<n; i+=101) CHECK(hwt_access(hwtl,i) == Tcopy[i]);
+    hwt_free(hwtl);
+
+    free(buf);
+    hwt_free(hwt);
+    free(T);
+    free(Tcopy);
+}
@@ -0,0 +1,70 @@
+#include "TestHarness.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "occ.h"
+
+uint64_t* init_C(size_t m,size_t maxgap)
+{
+    uint64_t* C = (uint64_t*) malloc(m*sizeof(uint64_t));
+    C[0] = 0;
+    for (size_t i=1; i<m; i++) C[i] = C[i-1] + rand()%maxgap;
+    return C;
+}
+
+TEST(occ , plain)
+{
+    size_t m = 1000;
+    uint64_t* C = init_C(m,50);
+    occ_t* occ = occ_create(C,m);
+
+    CHECK(occ->type == OCC_PLAIN);
+    CHECK(occ_length(occ) == m);
+    for (size_t i=0; i<m; i++) CHECK(occ_get(occ,i) == C[i]);
+
+    occ_free(occ);
+    free(C);
+}
+
+TEST(occ , eliasfano)
+{
+    size_t gaps[4] = {1,2,100,100000};
+    for (size_t g=0; g<4; g++) {
+        size_t m = OCC_PLAINMAX+1000;
+        uint64_t* C = init_C(m,gaps[g]);
+        occ_t* occ = occ_create(C,m);
+
+        CHECK(occ->type == OCC_EF);
+        CHECK(occ_spaceusage(occ) < m*sizeof(uint64_t));
+        for (size_t i=0; i<m; i++) CHECK(occ_get(occ,i) == C[i]);
+
+        occ_free(occ);
+        free(C);
+    }
+}
+
+TEST(occ , saveload)
+{
+    for (uint32_t type=OCC_PLAIN; type<=OCC_EF; type++) {
+        size_t m = 5000;
+        uint64_t* C = init_C(m,300);
+        occ_t* occ = occ_create_type(C,m,type);
+
+        FILE* f = fopen("occ.test","w");
+        occ_save(occ,f);
+        fclose(f);
+        f = fopen("occ.test","r");
+        occ_t* occl = occ_load(f);
+        fclose(f);
+
+        CHECK(occl->type == type);
+        CHECK(occ_spaceusage(occ) == occ_spaceusage(occl));
+        for (size_t i=0; i<m; i++) CHECK(occ_get(occl,i) == C[i]);
+
+        remove("occ.test");
+        occ_free(occ);
+        occ_free(occl);
+        free(C);
+    }
+}
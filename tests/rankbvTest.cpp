@@ -9,8 +9,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "rankbv.h"
+#include "memalloc.h"
 
 TEST(rankbv , saveload)
 {
@@ -32,6 +34,7 @@ TEST(rankbv , saveload)
     CHECK(rbv->s == rbvl->s);
     CHECK(rbv->ones == rbvl->ones);
     CHECK(rbv->factor == rbvl->factor);
+    CHECK(rbv->sr == rbvl->sr);
 
     for (size_t i=0; i<rankbv_length(rbv); i++) {
         CHECK(rankbv_access(rbv,i)==rankbv_access(rbvl,i));
@@ -51,6 +54,38 @@ TEST(rankbv , saveload)
     rankbv_free(rbvl);
 }
 
+TEST(rankbv , loadshort)
+{
+    /* a blob smaller than the header is refused before it is read */
+    FILE* f = tmpfile();
+    uint64_t blob[3] = { 16, RANKBV_VERSION, RANKBV_VERSION };
+    fwrite(blob,sizeof(blob),1,f);
+    rewind(f);
+    CHECK(rankbv_load(f) == NULL);
+    fclose(f);
+
+    /* and so is one shorter than its header says */
+    rankbv_t* rbv = rankbv_init(1000,0);
+    for (size_t i=0; i<1000; i+=3) rankbv_setbit(rbv,i);
+    rankbv_build(rbv);
+    f = tmpfile();
+    rankbv_save(rbv,f);
+    size_t len = ftell(f);
+    rewind(f);
+    char* buf = (char*) malloc(len);
+    CHECK(fread(buf,1,len,f) == len);
+    fclose(f);
+    uint64_t bytes = len-sizeof(uint64_t)-sizeof(uint64_t);
+    memcpy(buf,&bytes,sizeof(bytes));
+    f = tmpfile();
+    fwrite(buf,1,len-sizeof(uint64_t),f);
+    rewind(f);
+    CHECK(rankbv_load(f) == NULL);
+    fclose(f);
+    free(buf);
+    rankbv_free(rbv);
+}
+
 TEST(rankbv , mmap)
 {
     uint32_t A[14] = {1,2,4,8,16,32,64,128,256,512,1024,2048,4096,0};
@@ -204,3 +239,356 @@ TEST(rankbv , rank)
 
 
 
+TEST(rankbv , selectsampled)
+{
+    size_t n = 100000;
+    uint32_t density[4] = {2,7,100,5000};
+    for (size_t d=0; d<4; d++) {
+        rankbv_t* rbv = rankbv_init_sampled(n,4,64);
+        rankbv_t* rbvp = rankbv_init_sampled(n,4,0);
+        for (size_t i=0; i<n; i++) {
+            if (rand()%density[d]==0) {
+                rankbv_setbit(rbv,i);
+                rankbv_setbit(rbvp,i);
+            }
+        }
+        rankbv_build(rbv);
+        rankbv_build(rbvp);
+
+        CHECK(rankbv_ones(rbv)==rankbv_ones(rbvp));
+        CHECK(rankbv_numsamples(rbvp)==0);
+
+        size_t numones = rankbv_ones(rbv);
+        size_t numzeros = rankbv_length(rbv) - numones;
+        for (size_t i=1; i<=numones; i++) {
+            size_t pos = rankbv_select1(rbv,i);
+            CHECK(pos==rankbv_select1(rbvp,i));
+            CHECK(rankbv_access(rbv,pos)==1);
+            CHECK(rankbv_rank1(rbv,pos)==i);
+        }
+        for (size_t i=1; i<=numzeros; i++) {
+            size_t pos = rankbv_select0(rbv,i);
+            CHECK(pos==rankbv_select0(rbvp,i));
+            CHECK(rankbv_access(rbv,pos)==0);
+            CHECK(pos+1-rankbv_rank1(rbv,pos)==i);
+        }
+        CHECK(rankbv_select1(rbv,numones+1)==(size_t)-1);
+
+        rankbv_free(rbv);
+        rankbv_free(rbvp);
+    }
+}
+
+TEST(rankbv , linelayout)
+{
+    size_t n = 100003;
+    rankbv_t* rbv = rankbv_init(n,0);
+    rankbv_t* rbvl = rankbv_init(n,RANKBV_LINE);
+    for (size_t i=0; i<n; i++) {
+        if (rand()%3==0) {
+            rankbv_setbit(rbv,i);
+            rankbv_setbit(rbvl,i);
+        }
+    }
+    rankbv_build(rbv);
+    rankbv_build(rbvl);
+
+    CHECK(((uintptr_t)rbvl->S) % 64 == 0);
+    CHECK(rbvl->factor == RANKBV_LINEWORDS);
+    CHECK(rbvl->hdr == 2);
+    CHECK(rankbv_ones(rbv)==rankbv_ones(rbvl));
+
+    for (size_t i=0; i<n; i++) {
+        CHECK(rankbv_access(rbv,i)==rankbv_access(rbvl,i));
+        CHECK(rankbv_rank1(rbv,i)==rankbv_rank1(rbvl,i));
+    }
+    size_t numones = rankbv_ones(rbv);
+    size_t numzeros = rankbv_length(rbv) - numones;
+    for (size_t i=1; i<=numones; i++) {
+        CHECK(rankbv_select1(rbv,i)==rankbv_select1(rbvl,i));
+    }
+    for (size_t i=1; i<=numzeros; i++) {
+        CHECK(rankbv_select0(rbv,i)==rankbv_select0(rbvl,i));
+    }
+
+    rankbv_free(rbv);
+    rankbv_free(rbvl);
+
+    uint32_t A[14] = {1,2,4,8,16,32,64,128,256,512,1024,2048,4096,0};
+    rbv = rankbv_create((uint64_t*)A,13*32,RANKBV_LINE);
+
+    CHECK(rankbv_rank1(rbv,5)==1);
+    CHECK(rankbv_rank1(rbv,40)==2);
+    CHECK(rankbv_rank1(rbv,66)==3);
+    CHECK(rankbv_rank1(rbv,100)==4);
+    CHECK(rankbv_rank1(rbv,13*32-1)==13);
+    CHECK(rankbv_select1(rbv,13)==12*32+12);
+
+    rankbv_free(rbv);
+}
+
+TEST(rankbv , batch)
+{
+    /* with the default select samples and with none (sr == 0) */
+    for (size_t sr=0; sr<2; sr++) {
+        size_t n = 200000, m = 1001;
+        rankbv_t* rbv = sr ? rankbv_init(n,0) : rankbv_init_sampled(n,0,0);
+        for (size_t i=0; i<n; i++) if (rand()%5==0) rankbv_setbit(rbv,i);
+        rankbv_build(rbv);
+
+        size_t numones = rankbv_ones(rbv);
+        size_t numzeros = n - numones;
+        size_t* pos = (size_t*) malloc(m*sizeof(size_t));
+        size_t* x1 = (size_t*) malloc(m*sizeof(size_t));
+        size_t* x0 = (size_t*) malloc(m*sizeof(size_t));
+        size_t* out = (size_t*) malloc(m*sizeof(size_t));
+        int* bits = (int*) malloc(m*sizeof(int));
+        for (size_t i=0; i<m; i++) {
+            pos[i] = rand()%n;
+            x1[i] = rand()%numones+1;
+            x0[i] = rand()%numzeros+1;
+        }
+
+        rankbv_access_batch(rbv,pos,m,bits);
+        for (size_t i=0; i<m; i++) CHECK(bits[i]==rankbv_access(rbv,pos[i]));
+        rankbv_rank1_batch(rbv,pos,m,out);
+        for (size_t i=0; i<m; i++) CHECK(out[i]==rankbv_rank1(rbv,pos[i]));
+        rankbv_select1_batch(rbv,x1,m,out);
+        for (size_t i=0; i<m; i++) CHECK(out[i]==rankbv_select1(rbv,x1[i]));
+        rankbv_select0_batch(rbv,x0,m,out);
+        for (size_t i=0; i<m; i++) CHECK(out[i]==rankbv_select0(rbv,x0[i]));
+
+        free(pos); free(x1); free(x0); free(out); free(bits);
+        rankbv_free(rbv);
+    }
+}
+
+TEST(rankbv , select64)
+{
+    for (size_t t=0; t<10000; t++) {
+        uint64_t x = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+        if (t%4==0) x &= ((uint64_t)rand() << 32) | rand();
+        if (t==0) x = ~0ULL;
+        if (t==1) x = 1ULL << 63;
+        uint32_t k = 0;
+        for (uint32_t j=0; j<64; j++) {
+            if ((x >> j) & 1) {
+                CHECK(rankbv_select64(x,k)==j);
+                CHECK(rankbv_select64_broadword(x,k)==j);
+                k++;
+            }
+        }
+    }
+}
+
+TEST(rankbv , popcount)
+{
+    size_t m = 1000;
+    uint64_t* A = (uint64_t*) malloc(m*sizeof(uint64_t));
+    for (size_t i=0; i<m; i++) A[i] = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+    A[7] = ~0ULL;
+
+    for (size_t k=0; k<m; k+=(k<80 ? 1 : 37)) {
+        for (size_t off=0; off<3; off++) {
+            uint64_t cnt = rankbv_popcount_scalar(A+off,k);
+            CHECK(rankbv_popcount(A+off,k)==cnt);
+#if defined(__x86_64__)
+            if (__builtin_cpu_supports("avx2"))
+                CHECK(rankbv_popcount_avx2(A+off,k)==cnt);
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+                CHECK(rankbv_popcount_avx512(A+off,k)==cnt);
+#endif
+        }
+    }
+    free(A);
+
+    /* long in-superblock scans */
+    size_t n = 300000;
+    rankbv_t* rbv = rankbv_init(n,200);
+    rankbv_t* rbvp = rankbv_init(n,2);
+    for (size_t i=0; i<n; i++) {
+        if (rand()%3==0) {
+            rankbv_setbit(rbv,i);
+            rankbv_setbit(rbvp,i);
+        }
+    }
+    rankbv_build(rbv);
+    rankbv_build(rbvp);
+    for (size_t i=0; i<n; i+=7) CHECK(rankbv_rank1(rbv,i)==rankbv_rank1(rbvp,i));
+    for (size_t i=1; i<=rankbv_ones(rbv); i+=5) CHECK(rankbv_select1(rbv,i)==rankbv_select1(rbvp,i));
+    rankbv_free(rbv);
+    rankbv_free(rbvp);
+}
+
+TEST(rankbv , allocators)
+{
+    memalloc_arena_t* arena = memalloc_arena_create(1<<20);
+    memalloc_t allocs[4] = { memalloc_default(), memalloc_hugepage(),
+                             memalloc_numa(0,0), memalloc_arena(arena) };
+    size_t sizes[2] = {5000, 20000000};
+
+    for (size_t a=0; a<4; a++) {
+        memalloc_set(&allocs[a]);
+        for (size_t s=0; s<2; s++) {
+            size_t n = sizes[s];
+            rankbv_t* rbv = rankbv_init(n,RANKBV_LINE);
+            CHECK(rbv != NULL);
+            CHECK(((uintptr_t)rbv) % MEMALLOC_ALIGN == 0);
+            for (size_t i=0; i<n; i+=3) rankbv_setbit(rbv,i);
+            rankbv_build(rbv);
+            CHECK(rankbv_ones(rbv) == (n+2)/3);
+            CHECK(rankbv_rank1(rbv,n-1) == (n+2)/3);
+            CHECK(rankbv_select1(rbv,100) == 297);
+            rankbv_free(rbv);
+        }
+    }
+    CHECK(arena->used > 0);
+
+    /* plain mappings are rounded to pages, sub-page requests use the heap */
+    memalloc_t numa = memalloc_numa(-1,0);
+    size_t msizes[3] = {100, 4097, 3*MEMALLOC_HUGEPAGE+1};
+    for (size_t s=0; s<3; s++) {
+        unsigned char* mem = (unsigned char*) numa.alloc(msizes[s],numa.ctx);
+        CHECK(mem != NULL);
+        CHECK(((uintptr_t)mem) % MEMALLOC_ALIGN == 0);
+        CHECK(mem[0] == 0 && mem[msizes[s]-1] == 0);
+        mem[msizes[s]-1] = 1;
+        numa.free(mem,msizes[s],numa.ctx);
+    }
+    memalloc_set(NULL);
+    memalloc_arena_free(arena);
+}
+
+TEST(rankbv , builder)
+{
+    size_t sizes[4] = {0, 63, 64*7*3, 100001};
+    uint32_t factors[3] = {0, 3, RANKBV_LINE};
+    for (size_t s=0; s<4; s++) {
+        for (size_t f=0; f<3; f++) {
+            size_t n = sizes[s];
+            rankbv_t* rbv = rankbv_init(n,factors[f]);
+            rankbv_builder_t b, bw;
+            CHECK(rankbv_builder_init(&b,n,factors[f]));
+            CHECK(rankbv_builder_init(&bw,n,factors[f]));
+
+            /* bits one by one and in chunks of random length */
+            uint64_t chunk = 0;
+            size_t clen = 0, want = rand()%65;
+            for (size_t i=0; i<n; i++) {
+                int bit = (rand()%3==0);
+                if (bit) rankbv_setbit(rbv,i);
+                rankbv_builder_push(&b,bit);
+                chunk |= (uint64_t)bit << clen;
+                if (++clen == want) {
+                    rankbv_builder_pushword(&bw,chunk,clen);
+                    chunk = clen = 0;
+                    want = rand()%64+1;
+                }
+            }
+            if (clen) rankbv_builder_pushword(&bw,chunk,clen);
+            rankbv_build(rbv);
+            rankbv_t* rbvb = rankbv_builder_finish(&b);
+            rankbv_t* rbvw = rankbv_builder_finish(&bw);
+
+            CHECK(rankbv_spaceusage(rbv) == rankbv_spaceusage(rbvb));
+            CHECK(memcmp(rbv,rbvb,rankbv_spaceusage(rbv)) == 0);
+            CHECK(memcmp(rbv,rbvw,rankbv_spaceusage(rbv)) == 0);
+
+            rankbv_free(rbv);
+            rankbv_free(rbvb);
+            rankbv_free(rbvw);
+        }
+    }
+}
+
+TEST(rankbv , buildmt)
+{
+    size_t sizes[4] = {0, 64*3*5, 100001, 1000000};
+    uint32_t factors[3] = {0, 3, RANKBV_LINE};
+    uint32_t threads[3] = {2, 3, 8};
+    for (size_t s=0; s<4; s++) {
+        for (size_t f=0; f<3; f++) {
+            size_t n = sizes[s];
+            rankbv_t* rbv = rankbv_init(n,factors[f]);
+            for (size_t i=0; i<n; i++) if (rand()%3==0) rankbv_setbit(rbv,i);
+            size_t bytes = rankbv_spaceusage(rbv);
+            rankbv_t* rbvt = (rankbv_t*) malloc(bytes);
+            memcpy(rbvt,rbv,bytes);
+            rankbv_build(rbv);
+            for (size_t t=0; t<3; t++) {
+                rankbv_build_mt(rbvt,threads[t]);
+                CHECK(memcmp(rbv,rbvt,bytes) == 0);
+            }
+            free(rbvt);
+            rankbv_free(rbv);
+        }
+    }
+}
+
+TEST(rankbv , writer)
+{
+    size_t sizes[4] = {0, 64*7*3, 100001, 1000000};
+    uint32_t factors[3] = {0, 3, RANKBV_LINE};
+    for (size_t s=0; s<4; s++) {
+        for (size_t f=0; f<3; f++) {
+            size_t n = sizes[s];
+            rankbv_t* rbv = rankbv_init(n,factors[f]);
+            rankbv_writer_t w;
+            FILE* out = tmpfile();
+            fputs("xyz",out);  /* the bv need not start the file */
+            CHECK(rankbv_writer_init(&w,out,n,factors[f]));
+            for (size_t i=0; i<n; i++) {
+                int bit = (rand()%(s+2)==0);
+                if (bit) rankbv_setbit(rbv,i);
+                rankbv_writer_push(&w,bit);
+            }
+            rankbv_writer_finish(&w);
+            rankbv_build(rbv);
+            fputs("end",out);
+
+            fseek(out,3,SEEK_SET);
+            rankbv_t* rbvl = rankbv_load(out);
+            CHECK(rbvl != NULL);
+            CHECK(rankbv_spaceusage(rbvl) == rankbv_spaceusage(rbv));
+            CHECK(memcmp(rbv,rbvl,rankbv_spaceusage(rbv)) == 0);
+            char tail[4] = { 0 };
+            CHECK(fread(tail,1,3,out) == 3 && strcmp(tail,"end") == 0);
+            fclose(out);
+
+            rankbv_free(rbv);
+            rankbv_free(rbvl);
+        }
+    }
+}
+
+TEST(rankbv , large)
+{
+    /* more than 2^32 bits: positions, ranks and superblock offsets
+     * must not be truncated to 32 bits */
+    size_t n = (1ULL<<32) + 12345;
+    rankbv_t* rbv = rankbv_init(n,0);
+    CHECK(rbv != NULL);
+    if (!rbv) return;
+    size_t step = (1ULL<<20)+7;
+    size_t ones = 0;
+    for (size_t i=3; i<n; i+=step) {
+        rankbv_setbit(rbv,i);
+        ones++;
+    }
+    rankbv_setbit(rbv,n-1);
+    ones++;
+    rankbv_build(rbv);
+
+    CHECK(rankbv_ones(rbv) == ones);
+    CHECK(rankbv_access(rbv,n-1) == 1);
+    CHECK(rankbv_rank1(rbv,n-1) == ones);
+    CHECK(rankbv_rank1(rbv,n-2) == ones-1);
+    CHECK(rankbv_select1(rbv,ones) == n-1);
+    for (size_t k=1; k<ones; k+=97) {
+        size_t pos = 3+(k-1)*step;
+        CHECK(rankbv_select1(rbv,k) == pos);
+        CHECK(rankbv_rank1(rbv,pos) == k);
+        CHECK(rankbv_select0(rbv,pos+1-(k-1)) == pos+1);
+    }
+    rankbv_free(rbv);
+}
@@ -0,0 +1,255 @@
+#include "TestHarness.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "wm.h"
+#include "wtindex.h"
+
+static uint8_t* init_TRand(size_t* n)
+{
+    size_t i;
+    uint8_t* T = (uint8_t*) malloc(50000);
+
+    for (i=0; i<50000; i++) {
+        T[i] = rand() % 256;
+    }
+    *n = 50000;
+    return T;
+}
+
+TEST(wm , accessrankselect)
+{
+    size_t n,i,j;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wm_t* wm = wm_create((uint64_t*)T,8,n,4);
+    CHECK(wm != NULL);
+    CHECK(wm->height == 8);
+
+    for (i=0; i<n; i++) CHECK(wm_access(wm,i) == Tcopy[i]);
+
+    for (i=0; i<200; i++) {
+        size_t pos = rand() % n;
+        size_t sym = Tcopy[pos];
+        size_t cnt = 0;
+        for (j=0; j<=pos; j++) if (Tcopy[j]==sym) cnt++;
+        CHECK(wm_rank(wm,sym,pos) == cnt);
+        CHECK(wm_select(wm,sym,cnt) == pos);
+    }
+
+    size_t count[256] = {0};
+    for (i=0; i<n; i++) count[ Tcopy[i] ]++;
+    for (i=0; i<256; i++) CHECK(wm_count(wm,i) == count[i]);
+    CHECK(wm_count(wm,256) == 0);
+    CHECK(wm_select(wm,Tcopy[0],count[Tcopy[0]]+1) == (size_t)-1);
+    CHECK(wm_select(wm,Tcopy[0],0) == (size_t)-1);
+    CHECK(wm_select(wm,256,1) == (size_t)-1);
+
+    wm_free(wm);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wm , saveload)
+{
+    size_t n,i,j;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wm_t* wm = wm_create((uint64_t*)T,8,n,4);
+    FILE* f = tmpfile();
+    wm_save(wm,f);
+    rewind(f);
+    wm_t* wml = wm_load(f);
+    fclose(f);
+
+    CHECK(wml != NULL);
+    CHECK(wm_spaceusage(wml) == wm_spaceusage(wm));
+    for (i=0; i<n; i++) CHECK(wm_access(wml,i) == Tcopy[i]);
+    for (i=0; i<200; i++) {
+        size_t pos = rand() % n;
+        for (j=0; j<256; j+=17) {
+            CHECK(wm_rank(wm,j,pos) == wm_rank(wml,j,pos));
+        }
+    }
+
+    /* a wt index is not read as a matrix */
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+    f = tmpfile();
+    wt_save(wt,f);
+    rewind(f);
+    CHECK(wm_load(f) == NULL);
+    fclose(f);
+    wt_free(wt);
+
+    wm_free(wm);
+    wm_free(wml);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wm , quantile)
+{
+    size_t n,i;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wm_t* wm = wm_create((uint64_t*)T,8,n,4);
+
+    for (i=0; i<20; i++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % (n-l);
+        size_t m = r-l+1;
+        uint8_t* sorted = (uint8_t*) malloc(m);
+        memcpy(sorted,Tcopy+l,m);
+        std::sort(sorted,sorted+m);
+        size_t q = 1 + rand() % m;
+        wt_quant_t qf = wm_quantile_freq(wm,l,r,q);
+        CHECK(qf.sym == sorted[q-1]);
+        CHECK(qf.freq == (size_t)std::count(sorted,sorted+m,sorted[q-1]));
+        free(sorted);
+    }
+
+    wm_free(wm);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wm , mostfrequent)
+{
+    uint64_t* T = (uint64_t*) calloc(4,sizeof(uint64_t));
+    uint64_t S[] = { 7,2,2,4,7,4,6,7,3,6,7,4,6,5,18,7,4,2,1 };
+    for (size_t i=0; i<19; i++) wt_setsym(T,6,i,S[i]);
+
+    wm_t* wm = wm_create(T,6,19,4);
+
+    wt_result_t* res = wm_mostfrequent(wm,0,18,2);
+
+    CHECK(res->m == 2);
+    CHECK(res->items[0].sym == 7);
+    CHECK(res->items[1].sym == 4);
+    CHECK(res->items[0].freq == 5);
+    CHECK(res->items[1].freq == 4);
+
+    /* the context answers the same and can be reused */
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    const wt_result_t* cres = wm_mostfrequent_ctx(wm,&ctx,0,18,2);
+    CHECK(cres != NULL && cres->m == 2);
+    CHECK(cres->items[0].sym == 7 && cres->items[1].sym == 4);
+    cres = wm_mostfrequent_ctx(wm,&ctx,14,16,3);
+    CHECK(cres->m == 3);
+    CHECK(cres->items[0].freq == 1 && cres->items[2].freq == 1);
+    CHECK(wm_mostfrequent_ctx(wm,&ctx,5,4,2)->m == 0);
+    wt_ctx_destroy(&ctx);
+
+    wt_freeresult(res);
+    wm_free(wm);
+    free(T);
+}
+
+TEST(wm , widesymbols)
+{
+    size_t n = 2000,i,j;
+    uint64_t* T = (uint64_t*) calloc(n,sizeof(uint64_t));
+    uint64_t* Tcopy = (uint64_t*) malloc(n*sizeof(uint64_t));
+    for (i=0; i<n; i++) {
+        Tcopy[i] = ((rand()%11)+1) * 0x9E3779B97F4A7C15ULL;
+        wt_setsym(T,64,i,Tcopy[i]);
+    }
+
+    wm_t* wm = wm_create(T,64,n,4);
+    CHECK(wm->height == 64);
+
+    for (i=0; i<n; i++) CHECK(wm_access(wm,i) == Tcopy[i]);
+    for (i=0; i<100; i++) {
+        size_t pos = rand() % n;
+        size_t cnt = 0;
+        for (j=0; j<=pos; j++) if (Tcopy[j]==Tcopy[pos]) cnt++;
+        CHECK(wm_rank(wm,Tcopy[pos],pos) == cnt);
+        CHECK(wm_select(wm,Tcopy[pos],cnt) == pos);
+    }
+
+    wm_free(wm);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(wm , engine)
+{
+    size_t n,i;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    /* whichever engine the build selected answers the same queries */
+    wtindex_t* idx = wtindex_create((uint64_t*)T,8,n,4);
+    CHECK(idx != NULL);
+    CHECK(wtindex_length(idx) == n);
+    for (i=0; i<n; i+=7) CHECK(wtindex_access(idx,i) == Tcopy[i]);
+    CHECK(wtindex_rank(idx,Tcopy[0],0) == 1);
+    CHECK(wtindex_select(idx,Tcopy[0],1) == 0);
+    CHECK(wtindex_quantile(idx,0,0,1) == Tcopy[0]);
+
+    wt_result_t* res = wtindex_mostfrequent(idx,0,n-1,1);
+    CHECK(res->m == 1);
+    CHECK(res->items[0].freq == wtindex_count(idx,res->items[0].sym));
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    const wt_result_t* cres = wtindex_mostfrequent_ctx(idx,&ctx,0,n-1,1);
+    CHECK(cres != NULL && cres->m == 1 && cres->items[0].freq == res->items[0].freq);
+    wt_ctx_destroy(&ctx);
+    wt_freeresult(res);
+
+    wtindex_free(idx);
+    free(Tcopy);
+    free(T);
+}
+
+/* a file holding the first len bytes of buf */
+static FILE* prefix_file(const char* buf,size_t len)
+{
+    FILE* f = tmpfile();
+    fwrite(buf,1,len,f);
+    rewind(f);
+    return f;
+}
+
+TEST(wm , loadtruncated)
+{
+    size_t n,len,i;
+    uint8_t* T = init_TRand(&n);
+    wm_t* wm = wm_create((uint64_t*)T,8,n,4);
+    FILE* f = tmpfile();
+    wm_save(wm,f);
+    len = ftell(f);
+    rewind(f);
+    char* buf = (char*) malloc(len);
+    CHECK(fread(buf,1,len,f) == len);
+    fclose(f);
+
+    /* every field of the header cut short and a spread of cuts in the
+     * body, none of them exits */
+    for (i=0; i<len; i += (i < 64 ? 4 : len/16)) {
+        f = prefix_file(buf,i);
+        CHECK(wm_load(f) == NULL);
+        fclose(f);
+    }
+    /* magic, version, n, height */
+    uint32_t h = 65;
+    memcpy(buf+20,&h,sizeof(h));
+    f = prefix_file(buf,len);
+    CHECK(wm_load(f) == NULL);
+    fclose(f);
+
+    free(buf);
+    wm_free(wm);
+    free(T);
+}
@@ -9,9 +9,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
+#include <algorithm>
 
 #include "wt.h"
+#include "memalloc.h"
 
 uint8_t* init_T(size_t* n)
 {
@@ -80,9 +83,73 @@ TEST(wt , saveload)
     wt_free(wt);
     wt_free(wtl);
     free(Tcopy);
+    free(T);
 }
 
 
+/* rankbv of the format before the version word: a 32-byte header and
+ * one counter word ahead of every factor data words */
+static void save_legacybv(rankbv_t* rbv,FILE* f)
+{
+    uint64_t n = rankbv_length(rbv),i;
+    uint32_t factor = 4;
+    size_t words = n/64+1;
+    size_t total = (n/(64*factor)+1) + words;
+    uint64_t* S = (uint64_t*) calloc(total,sizeof(uint64_t));
+    uint64_t hdr[4] = { n, 64*factor, rankbv_ones(rbv), factor };
+    for (i=0; i<n; i++) {
+        if (rankbv_access(rbv,i)) S[i/64 + i/(64*factor) + 1] |= 1ULL << (i%64);
+    }
+    uint64_t bytes = sizeof(hdr) + total*sizeof(uint64_t);
+    fwrite(&bytes,sizeof(uint64_t),1,f);
+    fwrite(hdr,sizeof(hdr),1,f);
+    fwrite(S,sizeof(uint64_t),total,f);
+    free(S);
+}
+
+TEST(wt , loadlegacy)
+{
+    size_t n,i;
+    uint8_t* T = init_TRand(&n);
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    /* n, height, 32-bit max_v, occ bitvector, levels */
+    FILE* f = tmpfile();
+    uint32_t height = wt->height, max_v = wt->max_v;
+    fwrite(&wt->n,sizeof(uint64_t),1,f);
+    fwrite(&height,sizeof(uint32_t),1,f);
+    fwrite(&max_v,sizeof(uint32_t),1,f);
+    save_legacybv(wt->bittree[0],f);  /* stands in for occ, it is skipped */
+    for (i=0; i<wt->height; i++) save_legacybv(wt->bittree[i],f);
+    rewind(f);
+    wt_t* wtl = wt_load(f);
+    fclose(f);
+
+    CHECK(wtl != NULL);
+    CHECK(wtl->occ != NULL);
+    for (i=0; i<n; i++) CHECK(wt_access(wtl,i) == T[i]);
+    for (i=0; i<256; i++) CHECK(wt_count(wtl,i) == wt_count(wt,i));
+    for (i=0; i<200; i++) {
+        size_t pos = rand() % n;
+        CHECK(wt_select(wtl,T[pos],wt_rank(wt,T[pos],pos)) == pos);
+    }
+    wt_free(wtl);
+
+    /* a newer version is refused, not misread */
+    f = tmpfile();
+    uint64_t magic = WT_MAGIC;
+    uint32_t version = WT_VERSION+1;
+    fwrite(&magic,sizeof(uint64_t),1,f);
+    fwrite(&version,sizeof(uint32_t),1,f);
+    wt_save(wt,f);
+    rewind(f);
+    CHECK(wt_load(f) == NULL);
+    fclose(f);
+
+    wt_free(wt);
+    free(T);
+}
+
 TEST(wt , select)
 {
     size_t n,i,j;
@@ -100,8 +167,29 @@ TEST(wt , select)
         CHECK(wt_select(wt,sym,cnt) == pos);
     }
 
+    /* occurrences that do not exist */
+    size_t last = n-1;
+    size_t cnt = wt_count(wt,Tcopy[last]);
+    CHECK(wt_select(wt,Tcopy[last],cnt) == last);
+    CHECK(wt_select(wt,Tcopy[last],cnt+1) == (size_t)-1);
+    CHECK(wt_select(wt,Tcopy[last],0) == (size_t)-1);
+    CHECK(wt_select(wt,256,1) == (size_t)-1);
+    CHECK(wt_select(wt,1ULL<<40,1) == (size_t)-1);
+
+    /* the same without an occ table */
+    uint64_t W[3] = { 5, 1ULL<<40, 5 };
+    wt_t* ws = wt_create(W,64,3,0);
+    CHECK(ws->occ == NULL);
+    CHECK(wt_select(ws,5,2) == 2);
+    CHECK(wt_select(ws,5,3) == (size_t)-1);
+    CHECK(wt_select(ws,5,0) == (size_t)-1);
+    CHECK(wt_select(ws,7,1) == (size_t)-1);
+    CHECK(wt_select(ws,1ULL<<41,1) == (size_t)-1);
+    wt_free(ws);
+
     wt_free(wt);
     free(Tcopy);
+    free(T);
 }
 
 TEST(wt , access)
@@ -115,6 +203,7 @@ TEST(wt , access)
     }
 
     wt_free(wt);
+    free(T);
 
     T = init_TRand(&n);
     uint8_t* Tcopy = (uint8_t*) malloc(n);
@@ -127,6 +216,7 @@ TEST(wt , access)
 
     wt_free(wt);
     free(Tcopy);
+    free(T);
 }
 
 TEST(wt , rank)
@@ -149,6 +239,7 @@ TEST(wt , rank)
 
     wt_free(wt);
     free(Tcopy);
+    free(T);
 }
 
 TEST(wt , setgetsym)
@@ -199,6 +290,7 @@ TEST(wt , quantile)
     CHECK(wt_quantile(wt,8,13,6) == 17);
 
     wt_free(wt);
+    free(T);
 }
 
 TEST(wt , mostfrequent)
@@ -237,4 +329,984 @@ TEST(wt , mostfrequent)
     wt_freeresult(res);
 
     wt_free(wt);
+    free(T);
+}
+
+TEST(wt , mostfrequentctx)
+{
+    size_t n,i,k;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    for (k=0; k<50; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % (n-l);
+        size_t kk = 1 + rand() % 10;
+        size_t freq[256] = { 0 };
+        for (i=l; i<=r; i++) freq[Tcopy[i]]++;
+
+        const wt_result_t* res = wt_mostfrequent_ctx(wt,&ctx,l,r,kk);
+        wt_result_t* ref = wt_mostfrequent(wt,l,r,kk);
+        CHECK(res->m == ref->m);
+        for (i=0; i<res->m; i++) {
+            CHECK(res->items[i].sym == ref->items[i].sym);
+            CHECK(res->items[i].freq == freq[res->items[i].sym]);
+            if (i) CHECK(res->items[i-1].freq >= res->items[i].freq);
+        }
+        wt_freeresult(ref);
+    }
+
+    /* all 256 symbols: heap and result grow past the inline buffers */
+    const wt_result_t* res = wt_mostfrequent_ctx(wt,&ctx,0,n-1,256);
+    CHECK(res->m == 256);
+    CHECK(ctx.heap != ctx.inlheap);
+    size_t total = 0;
+    for (i=0; i<res->m; i++) total += res->items[i].freq;
+    CHECK(total == n);
+
+    /* grown buffers are kept for the next query */
+    wt_topknode_t* heap = ctx.heap;
+    res = wt_mostfrequent_ctx(wt,&ctx,10,20,1);
+    CHECK(res->m == 1);
+    CHECK(ctx.heap == heap);
+
+    wt_ctx_destroy(&ctx);
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , topkweighted)
+{
+    size_t n,i,j,k;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    /* a few heavy symbols, symbols >= 200 weigh 0 */
+    double weight[200];
+    for (i=0; i<200; i++) weight[i] = (i % 17 == 0) ? 50.0 + i : (rand() % 100)/10.0;
+    wt_weights_t* w = wt_weights_create(wt,weight,200);
+    CHECK(w != NULL);
+
+    wt_ctx_t ctx;
+    wt_ctx_init(&ctx);
+    for (k=0; k<50; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % (n-l);
+        size_t kk = 1 + rand() % 10;
+        size_t freq[256] = { 0 };
+        double score[256];
+        for (i=l; i<=r; i++) freq[Tcopy[i]]++;
+        for (i=0; i<256; i++) score[i] = freq[i]*(i < 200 ? weight[i] : 0);
+
+        const wt_result_t* res = wt_topk_weighted_ctx(wt,w,&ctx,l,r,kk);
+        size_t occ = 0;
+        for (i=0; i<256; i++) if (freq[i]) occ++;
+        CHECK(res->m == std::min(kk,occ));
+        for (i=0; i<res->m; i++) {
+            uint64_t s = res->items[i].sym;
+            CHECK(res->items[i].freq == freq[s]);
+            CHECK(res->items[i].score == score[s]);
+            if (i) CHECK(res->items[i-1].score >= res->items[i].score);
+        }
+        /* nothing left out scores higher than the last reported */
+        if (res->m) {
+            double last = res->items[res->m-1].score;
+            for (i=0; i<256; i++) {
+                int found = 0;
+                for (j=0; j<res->m; j++) if (res->items[j].sym == i) found = 1;
+                if (!found) CHECK(score[i] <= last);
+            }
+        }
+    }
+
+    /* the heavy symbols win over the whole text */
+    size_t all[256] = { 0 };
+    for (i=0; i<n; i++) all[Tcopy[i]]++;
+    wt_result_t* res = wt_topk_weighted(wt,w,0,n-1,3);
+    CHECK(res->m == 3);
+    for (i=0; i<3; i++) {
+        CHECK(res->items[i].sym % 17 == 0);
+        CHECK(res->items[i].score == all[res->items[i].sym]*weight[res->items[i].sym]);
+    }
+    wt_freeresult(res);
+
+    weight[5] = -1;
+    CHECK(wt_weights_create(wt,weight,200) == NULL);
+
+    wt_ctx_destroy(&ctx);
+    wt_weights_free(w);
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , itemcmp)
+{
+    wt_item_t a = { 1, 10, 1, 0 };
+    wt_item_t b = { 2, 30, 2, 0 };
+    CHECK(wt_item_cmp(&a,&b) < 0);
+    CHECK(wt_item_cmp(&b,&a) > 0);
+    CHECK(wt_item_cmp(&a,&a) == 0);
+}
+
+TEST(wt , count)
+{
+    size_t n,i;
+    uint8_t* T = init_TRand(&n);
+    size_t count[256] = {0};
+    for (i=0; i<n; i++) count[ T[i] ]++;
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    for (i=0; i<256; i++) {
+        CHECK(wt_count(wt,i) == count[i]);
+    }
+    CHECK(wt_count(wt,256) == 0);
+
+    wt_free(wt);
+    free(T);
+}
+
+TEST(wt , selectsparse)
+{
+    size_t n = 5000,i,j;
+    uint64_t* T = (uint64_t*) calloc(n,sizeof(uint64_t));
+    uint32_t* Tcopy = (uint32_t*) malloc(n*sizeof(uint32_t));
+    /* only every 7th symbol occurs */
+    for (i=0; i<n; i++) {
+        Tcopy[i] = (rand()%100)*7+3;
+        wt_setsym(T,10,i,Tcopy[i]);
+    }
+
+    wt_t* wt = wt_create(T,10,n,4);
+
+    for (i=0; i<200; i++) {
+        size_t pos = rand() % n;
+        size_t cnt = 0;
+        for (j=0; j<=pos; j++) if (Tcopy[j]==Tcopy[pos]) cnt++;
+        CHECK(wt_select(wt,Tcopy[pos],cnt) == pos);
+    }
+    CHECK(wt_count(wt,4) == 0);
+
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , intersect)
+{
+    size_t n,i,j,k;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    for (k=0; k<20; k++) {
+        size_t m = 1 + rand() % 5;
+        size_t threshold = rand() % (m+1);
+        wt_range_t ranges[5];
+        size_t freq[256] = {0}, in[256] = {0};
+        for (i=0; i<m; i++) {
+            ranges[i].sp = rand() % n;
+            ranges[i].ep = ranges[i].sp + rand() % 300;
+            if (ranges[i].ep >= n) ranges[i].ep = n-1;
+            size_t seen[256] = {0};
+            for (j=ranges[i].sp; j<=ranges[i].ep; j++) {
+                freq[Tcopy[j]]++;
+                if (!seen[Tcopy[j]]++) in[Tcopy[j]]++;
+            }
+        }
+
+        wt_result_t* res = wt_intersect(wt,ranges,m,threshold);
+        size_t expected = 0, r = 0;
+        for (j=0; j<256; j++) {
+            if (!in[j] || in[j] < threshold) continue;
+            expected++;
+            if (r < res->m) {
+                CHECK(res->items[r].sym == j);
+                CHECK(res->items[r].freq == freq[j]);
+                CHECK(res->items[r].weight == in[j]);
+            }
+            r++;
+        }
+        CHECK(res->m == expected);
+        wt_freeresult(res);
+    }
+
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , rangecount)
+{
+    size_t n,i,j;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    size_t m = 500;
+    wt_rangeq_t* q = (wt_rangeq_t*) malloc(m*sizeof(wt_rangeq_t));
+    size_t* out = (size_t*) malloc(m*sizeof(size_t));
+    for (i=0; i<m; i++) {
+        q[i].l = rand() % n;
+        q[i].r = q[i].l + rand() % 2000;
+        q[i].lo = rand() % 300;
+        q[i].hi = q[i].lo + rand() % 100;
+    }
+    q[0].lo = 0; q[0].hi = ~0ULL;
+    q[1].l = 10; q[1].r = 5;
+    q[2].lo = 20; q[2].hi = 10;
+
+    wt_range_count_batch(wt,q,m,out);
+    for (i=0; i<m; i++) {
+        size_t cnt = 0;
+        for (j=q[i].l; j<=q[i].r && j<n; j++)
+            if (Tcopy[j] >= q[i].lo && Tcopy[j] <= q[i].hi) cnt++;
+        CHECK(wt_range_count(wt,q[i].l,q[i].r,q[i].lo,q[i].hi) == cnt);
+        CHECK(out[i] == cnt);
+    }
+
+    free(q);
+    free(out);
+    wt_free(wt);
+    free(T);
+    free(Tcopy);
+}
+
+typedef struct report_ctx {
+    size_t m;
+    size_t stop;
+    uint64_t sym[512];
+    size_t val[512];
+} report_ctx_t;
+
+static int report_sym(uint64_t sym,size_t freq,void* ctx)
+{
+    report_ctx_t* c = (report_ctx_t*) ctx;
+    c->sym[c->m] = sym;
+    c->val[c->m++] = freq;
+    return c->m == c->stop;
+}
+
+static int report_pos(size_t pos,uint64_t sym,void* ctx)
+{
+    report_ctx_t* c = (report_ctx_t*) ctx;
+    c->sym[c->m] = sym;
+    c->val[c->m++] = pos;
+    return c->m == c->stop;
+}
+
+TEST(wt , rangereport)
+{
+    size_t n,i,j,k;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    for (k=0; k<50; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % 400;
+        uint64_t lo = rand() % 256;
+        uint64_t hi = lo + rand() % 64;
+        size_t freq[256] = {0}, expected = 0, total = 0;
+        for (j=l; j<=r && j<n; j++) {
+            if (Tcopy[j] >= lo && Tcopy[j] <= hi) {
+                if (!freq[Tcopy[j]]++) expected++;
+                total++;
+            }
+        }
+
+        report_ctx_t c;
+        c.m = 0;
+        c.stop = 0;
+        CHECK(wt_range_report(wt,l,r,lo,hi,report_sym,&c) == expected);
+        CHECK(c.m == expected);
+        for (i=0; i<c.m; i++) {
+            CHECK(c.val[i] == freq[c.sym[i]]);
+            if (i) CHECK(c.sym[i-1] < c.sym[i]);
+        }
+
+        c.m = 0;
+        CHECK(wt_range_report_pos(wt,l,r,lo,hi,report_pos,&c) == total);
+        for (i=0; i<c.m; i++) {
+            CHECK(c.val[i] >= l && c.val[i] <= r);
+            CHECK(Tcopy[c.val[i]] == c.sym[i]);
+            if (i && c.sym[i-1] == c.sym[i]) CHECK(c.val[i-1] < c.val[i]);
+        }
+
+        /* early stop */
+        c.m = 0;
+        c.stop = 1;
+        CHECK(wt_range_report(wt,l,r,lo,hi,report_sym,&c) == wt_min(expected,(size_t)1));
+
+        /* the iterator pulls the same tuples */
+        wt_iter_t it;
+        uint64_t sym;
+        size_t f,m = 0;
+        wt_iter_init(&it,wt,l,r,lo,hi);
+        while (wt_iter_next(&it,&sym,&f)) {
+            CHECK(f == freq[sym]);
+            m++;
+        }
+        CHECK(m == expected);
+    }
+
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , rangenextprev)
+{
+    size_t n,i,j;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+
+    for (i=0; i<500; i++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % 50;
+        uint64_t x = rand() % 260;
+        size_t freq[256] = {0};
+        for (j=l; j<=r && j<n; j++) freq[Tcopy[j]]++;
+
+        wt_quant_t nv = wt_range_next_value(wt,l,r,x);
+        wt_quant_t pv = wt_range_prev_value(wt,l,r,x);
+        uint64_t next = x, prev = wt_min(x,(uint64_t)255);
+        while (next < 256 && !freq[next]) next++;
+        while (prev > 0 && !freq[prev]) prev--;
+
+        if (next < 256) {
+            CHECK(nv.sym == next);
+            CHECK(nv.freq == freq[next]);
+        } else {
+            CHECK(nv.freq == 0);
+        }
+        if (freq[prev]) {
+            CHECK(pv.sym == prev);
+            CHECK(pv.freq == freq[prev]);
+        } else {
+            CHECK(pv.freq == 0);
+        }
+    }
+
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , extract)
+{
+    size_t n,i,k;
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+
+    wt_t* wt = wt_create((uint64_t*)T,8,n,4);
+    uint64_t* out = (uint64_t*) malloc(n*sizeof(uint64_t));
+
+    CHECK(wt_extract(wt,0,n-1,out));
+    for (i=0; i<n; i++) CHECK(out[i] == Tcopy[i]);
+    for (k=0; k<100; k++) {
+        size_t l = rand() % n;
+        size_t r = l + rand() % 1000;
+        if (r >= n) r = n-1;
+        CHECK(wt_extract(wt,l,r,out));
+        for (i=l; i<=r; i++) CHECK(out[i-l] == Tcopy[i]);
+    }
+    CHECK(!wt_extract(wt,10,5,out));
+    CHECK(!wt_extract(wt,0,n,out));
+
+    free(out);
+    wt_free(wt);
+    free(Tcopy);
+    free(T);
+}
+
+TEST(wt , remap)
+{
+    size_t n = 20000,i,j;
+    uint64_t alpha[300];
+    /* 300 distinct symbols spread up to 2^30 */
+    for (i=0; i<300; i++) alpha[i] = ((uint64_t)i*3579139) % (1ULL<<30);
+    uint64_t* T = (uint64_t*) calloc((n*30)/64+1,sizeof(uint64_t));
+    uint64_t* Tcopy = (uint64_t*) malloc(n*sizeof(uint64_t));
+    for (i=0; i<n; i++) {
+        Tcopy[i] = alpha[rand()%300];
+        wt_setsym(T,30,i,Tcopy[i]);
+    }
+
+    wt_t* wt = wt_create_remap(T,30,n,4);
+    CHECK(wt->sigma == 300);
+    CHECK(wt->height == wt_bits(299));
+
+    FILE* f = tmpfile();
+    wt_save(wt,f);
+    rewind(f);
+    wt_t* wtl = wt_load(f);
+    fclose(f);
+    CHECK(wtl != NULL);
+    CHECK(wtl->sigma == 300);
+    CHECK(wt_spaceusage(wtl) == wt_spaceusage(wt));
+
+    for (i=0; i<n; i++) CHECK(wt_access(wtl,i) == Tcopy[i]);
+    for (i=0; i<100; i++) {
+        size_t pos = rand() % n;
+        size_t cnt = 0;
+        for (j=0; j<=pos; j++) if (Tcopy[j]==Tcopy[pos]) cnt++;
+        CHECK(wt_rank(wtl,Tcopy[pos],pos) == cnt);
+        CHECK(wt_select(wtl,Tcopy[pos],cnt) == pos);
+        CHECK(wt_count(wtl,Tcopy[pos]) == (size_t)std::count(Tcopy,Tcopy+n,Tcopy[pos]));
+    }
+    /* the alphabet are multiples of 3579139 below 2^30, alpha[1]+1 is not one */
+    CHECK(wt_rank(wtl,alpha[1]+1,n-1) == 0);
+    CHECK(wt_count(wtl,alpha[1]+1) == 0);
+    CHECK(wt_select(wtl,alpha[1]+1,1) == (size_t)-1);
+
+    size_t l = 1000, r = 2999, m = r-l+1;
+    uint64_t* sorted = (uint64_t*) malloc(m*sizeof(uint64_t));
+    memcpy(sorted,Tcopy+l,m*sizeof(uint64_t));
+    std::sort(sorted,sorted+m);
+    for (i=1; i<=m; i+=101) CHECK(wt_quantile(wtl,l,r,i) == sorted[i-1]);
+
+    wt_result_t* res = wt_mostfrequent(wtl,l,r,3);
+    for (i=0; i<res->m; i++)
+        CHECK(res->items[i].freq == (size_t)std::count(sorted,sorted+m,res->items[i].sym));
+    wt_freeresult(res);
+
+    uint64_t lo = 1ULL<<28, hi = 1ULL<<29;
+    size_t cnt = 0;
+    for (i=l; i<=r; i++) cnt += (Tcopy[i] >= lo && Tcopy[i] <= hi);
+    CHECK(wt_range_count(wtl,l,r,lo,hi) == cnt);
+    CHECK(wt_range_count(wtl,l,r,alpha[1]+1,alpha[1]+1) == 0);
+
+    wt_iter_t it;
+    uint64_t sym;
+    size_t freq,total = 0;
+    wt_iter_init(&it,wtl,l,r,lo,hi);
+    while (wt_iter_next(&it,&sym,&freq)) {
+        CHECK(sym >= lo && sym <= hi);
+        CHECK(freq == (size_t)std::count(sorted,sorted+m,sym));
+        total += freq;
+    }
+    CHECK(total == cnt);
+
+    uint64_t* lb = std::lower_bound(sorted,sorted+m,lo);
+    wt_quant_t nv = wt_range_next_value(wtl,l,r,lo);
+    CHECK(nv.freq && nv.sym == *lb);
+    wt_quant_t pv = wt_range_prev_value(wtl,l,r,lo);
+    CHECK(pv.freq && pv.sym == *(lb-1));
+
+    uint64_t* out = (uint64_t*) malloc(m*sizeof(uint64_t));
+    CHECK(wt_extract(wtl,l,r,out));
+    for (i=0; i<m; i++) CHECK(out[i] == Tcopy[l+i]);
+
+    free(out);
+    free(sorted);
+    wt_free(wt);
+    wt_free(wtl);
+    free(T);
+    free(Tcopy);
+}
+
+static uint64_t
+wide_sym(size_t i,size_t bits)
+{
+    /* a handful of hashed ids that need all bits */
+    uint64_t h = ((i % 13)+1) * 0x9E3779B97F4A7C15ULL;
+    return bits < 64 ? h >> (64-bits) : h;
+}
+
+TEST(wt , widesymbols)
+{
+    size_t widths[] = { 40, 64 };
+    size_t n = 3000,i,j;
+    uint64_t* Tcopy = (uint64_t*) malloc(n*sizeof(uint64_t));
+
+    for (size_t w=0; w<2; w++) {
+        size_t bits = widths[w];
+        uint64_t* T = (uint64_t*) calloc((n*bits)/64+1,sizeof(uint64_t));
+        for (i=0; i<n; i++) {
+            Tcopy[i] = wide_sym(rand(),bits);
+            wt_setsym(T,bits,i,Tcopy[i]);
+        }
+        for (i=0; i<n; i++) CHECK(wt_getsym(T,bits,i) == Tcopy[i]);
+
+        wt_t* wt = wt_create(T,bits,n,4);
+        CHECK(wt != NULL);
+        CHECK(wt->occ == NULL);
+
+        /* save and reload, queries run against both */
+        FILE* f = tmpfile();
+        wt_save(wt,f);
+        rewind(f);
+        wt_t* wtl = wt_load(f);
+        fclose(f);
+        CHECK(wtl != NULL);
+        CHECK(wtl->max_v == wt->max_v);
+        CHECK(wtl->height == bits);
+
+        for (i=0; i<n; i++) CHECK(wt_access(wtl,i) == Tcopy[i]);
+
+        for (i=0; i<100; i++) {
+            size_t pos = rand() % n;
+            size_t cnt = 0;
+            for (j=0; j<=pos; j++) if (Tcopy[j]==Tcopy[pos]) cnt++;
+            CHECK(wt_rank(wt,Tcopy[pos],pos) == cnt);
+            CHECK(wt_select(wt,Tcopy[pos],cnt) == pos);
+            CHECK(wt_select(wtl,Tcopy[pos],cnt) == pos);
+        }
+        for (i=0; i<13; i++) {
+            uint64_t sym = wide_sym(i,bits);
+            size_t cnt = 0;
+            for (j=0; j<n; j++) if (Tcopy[j]==sym) cnt++;
+            CHECK(wt_count(wtl,sym) == cnt);
+            CHECK(wt_count(wtl,sym+1) == 0);
+        }
+
+        /* quantile and top-k over a range */
+        size_t l = 100, r = 1099;
+        size_t m = r-l+1;
+        uint64_t* sorted = (uint64_t*) malloc(m*sizeof(uint64_t));
+        memcpy(sorted,Tcopy+l,m*sizeof(uint64_t));
+        std::sort(sorted,sorted+m);
+        for (i=1; i<=m; i+=97) CHECK(wt_quantile(wt,l,r,i) == sorted[i-1]);
+
+        wt_result_t* res = wt_mostfrequent(wt,l,r,3);
+        CHECK(res->m == 3);
+        for (i=0; i<res->m; i++) {
+            size_t cnt = 0;
+            for (j=l; j<=r; j++) if (Tcopy[j]==res->items[i].sym) cnt++;
+            CHECK(cnt == res->items[i].freq);
+            if (i) CHECK(res->items[i-1].freq >= res->items[i].freq);
+        }
+        wt_freeresult(res);
+
+        free(sorted);
+        wt_free(wtl);
+        wt_free(wt);
+        free(T);
+    }
+    free(Tcopy);
+}
+
+static size_t failafter;
+
+static void* failing_alloc(size_t n,void* ctx)
+{
+    if (!failafter) return NULL;
+    failafter--;
+    return calloc(n,1);
+}
+
+static void failing_free(void* mem,size_t n,void* ctx)
+{
+    free(mem);
+}
+
+/* bytes of the saved index, for comparing two builds */
+static char* wt_bytes(wt_t* wt,size_t* len)
+{
+    FILE* f = tmpfile();
+    wt_save(wt,f);
+    *len = ftell(f);
+    rewind(f);
+    char* buf = (char*) malloc(*len);
+    if (fread(buf,1,*len,f) != *len) *len = 0;
+    fclose(f);
+    return buf;
+}
+
+TEST(wt , createmt)
+{
+    size_t widths[] = { 8, 20, 64 };
+    size_t sizes[] = { 100, 5000, 200003 };
+    uint32_t threads[] = { 2, 3, 8 };
+    size_t i,w,s,t;
+
+    for (w=0; w<3; w++) {
+        size_t bits = widths[w];
+        for (s=0; s<3; s++) {
+            size_t n = sizes[s];
+            size_t words = (n*bits)/64+1;
+            uint64_t* Tcopy = (uint64_t*) malloc(n*sizeof(uint64_t));
+            uint64_t* T = (uint64_t*) calloc(words,sizeof(uint64_t));
+            for (i=0; i<n; i++) {
+                /* skewed so some nodes are empty or tiny */
+                Tcopy[i] = bits == 64 ? wide_sym(rand(),bits) : (rand() % (1+rand()%1000)) * (bits == 20 ? 997 : 1) % (1ULL<<bits);
+                wt_setsym(T,bits,i,Tcopy[i]);
+            }
+            size_t len,lenmt;
+            wt_t* wt = wt_create(T,bits,n,4);
+            char* ser = wt_bytes(wt,&len);
+
+            for (t=0; t<3; t++) {
+                wt_t* wtmt = wt_create_mt(T,bits,n,4,threads[t]);
+                CHECK(wtmt != NULL);
+                char* par = wt_bytes(wtmt,&lenmt);
+                CHECK(len == lenmt);
+                CHECK(memcmp(ser,par,len) == 0);
+                for (i=0; i<n; i+=97) CHECK(wt_access(wtmt,i) == Tcopy[i]);
+                free(par);
+                wt_free(wtmt);
+            }
+            free(ser);
+            free(T);
+            free(Tcopy);
+            wt_free(wt);
+        }
+    }
+}
+
+static size_t memlive, mempeak;
+
+static void* counting_alloc(size_t n,void* ctx)
+{
+    memlive += n;
+    if (memlive > mempeak) mempeak = memlive;
+    return calloc(n,1);
+}
+
+static void counting_free(void* mem,size_t n,void* ctx)
+{
+    memlive -= n;
+    free(mem);
+}
+
+TEST(wt , buildmemory)
+{
+    size_t n = 200000,i;
+    size_t words = n/8+1;
+    uint64_t* T = (uint64_t*) calloc(words,sizeof(uint64_t));
+    for (i=0; i<n; i++) wt_setsym(T,8,i,rand() % 256);
+    uint64_t* Tcopy = (uint64_t*) malloc(words*sizeof(uint64_t));
+    memcpy(Tcopy,T,words*sizeof(uint64_t));
+
+    memalloc_t a = { counting_alloc, counting_free, NULL };
+    memalloc_set(&a);
+    memlive = mempeak = 0;
+    wt_t* wt = wt_create(T,8,n,4);
+    CHECK(wt != NULL);
+    /* everything still live is the index, the rest was construction */
+    size_t index = memlive;
+    size_t copy = ((n*8)/64+1)*sizeof(uint64_t);
+    size_t levelbits = 4*(n/64+1)*sizeof(uint64_t);
+    size_t buffers = copy + ((n*wt->height)/64+1)*sizeof(uint64_t) + levelbits + wt->height*sizeof(rankbv_builder_t);
+    size_t histogram = copy + levelbits + (wt->max_v+2)*sizeof(uint64_t) + wt->height*sizeof(rankbv_builder_t);
+    CHECK(mempeak - index <= std::max(buffers,histogram));
+    /* the old recursive build held about two packed copies per node path,
+     * the level and node start bits add n/2 bytes */
+    CHECK(mempeak - index <= 2*words*sizeof(uint64_t) + levelbits + 4096);
+    wt_free(wt);
+    CHECK(memlive == 0);
+    memalloc_set(NULL);
+
+    /* the input is only read */
+    CHECK(memcmp(T,Tcopy,words*sizeof(uint64_t)) == 0);
+    wt = wt_create_remap(T,8,n,4);
+    CHECK(memcmp(T,Tcopy,words*sizeof(uint64_t)) == 0);
+    for (i=0; i<n; i+=101) CHECK(wt_access(wt,i) == wt_getsym(T,8,i));
+    wt_free(wt);
+
+    free(T);
+    free(Tcopy);
+}
+
+TEST(wt , createfromfile)
+{
+    size_t widths[] = { 8, 16, 20, 64 };
+    size_t n = 200000,i,w;
+    char in[] = "/tmp/wtTestInXXXXXX";
+    char out[] = "/tmp/wtTestOutXXXXXX";
+    close(mkstemp(in));
+    close(mkstemp(out));
+
+    for (w=0; w<4; w++) {
+        size_t bits = widths[w];
+        size_t words = (n*bits)/64+1;
+        uint64_t* T = (uint64_t*) calloc(words,sizeof(uint64_t));
+        for (i=0; i<n; i++) {
+            uint64_t sym = bits == 64 ? wide_sym(rand(),bits) : rand() % (1ULL << (bits == 8 ? 8 : 12));
+            wt_setsym(T,bits,i,sym);
+        }
+        FILE* f = fopen(in,"wb");
+        CHECK(fwrite(T,1,(n*bits)/8,f) == (n*bits)/8);
+        fclose(f);
+
+        /* a budget below the input that still holds the 4098-word histogram */
+        size_t budget = 160*1024;
+        memalloc_t a = { counting_alloc, counting_free, NULL };
+        memalloc_set(&a);
+        memlive = mempeak = 0;
+        CHECK(wt_create_from_file(in,bits,out,budget));
+        CHECK(mempeak <= budget);
+        CHECK(memlive == 0);
+        memalloc_set(NULL);
+
+        /* the same file wt_save writes */
+        wt_t* wt = wt_create(T,bits,n,0);
+        size_t len;
+        char* ser = wt_bytes(wt,&len);
+        f = fopen(out,"rb");
+        char* ext = (char*) malloc(len+1);
+        CHECK(fread(ext,1,len+1,f) == len);
+        fclose(f);
+        CHECK(memcmp(ser,ext,len) == 0);
+        free(ext);
+        free(ser);
+
+        f = fopen(out,"rb");
+        wt_t* wtl = wt_load(f);
+        fclose(f);
+        for (i=0; i<n; i+=37) CHECK(wt_access(wtl,i) == wt_getsym(T,bits,i));
+        wt_free(wtl);
+
+        /* no room for the histogram: occ is left out */
+        if (bits == 16) {
+            CHECK(wt_create_from_file(in,bits,out,8*1024));
+            f = fopen(out,"rb");
+            wtl = wt_load(f);
+            fclose(f);
+            CHECK(wtl->occ == NULL);
+            uint64_t sym = wt_getsym(T,bits,5);
+            CHECK(wt_count(wtl,sym) == wt_count(wt,sym));
+            wt_free(wtl);
+        }
+        wt_free(wt);
+        free(T);
+    }
+
+    /* errors are returned, not fatal, and leave no partial index */
+    CHECK(wt_create_from_file("/nonexistent/wtTestIn",8,out,160*1024) == 0);
+    CHECK(access(out,F_OK) == 0);
+    CHECK(wt_create_from_file(in,8,"/nonexistent/wtTestOut",160*1024) == 0);
+    CHECK(access("/nonexistent/wtTestOut",F_OK) != 0);
+    CHECK(wt_create_from_file(in,0,"wtTestBits",160*1024) == 0);
+    CHECK(wt_create_from_file(in,65,"wtTestBits",160*1024) == 0);
+    CHECK(access("wtTestBits",F_OK) != 0);
+    if (access("/dev/full",W_OK) == 0) {  /* a full disk */
+        memalloc_t a = { counting_alloc, counting_free, NULL };
+        memalloc_set(&a);
+        memlive = 0;
+        CHECK(wt_create_from_file(in,8,"/dev/full",160*1024) == 0);
+        CHECK(memlive == 0);
+        memalloc_set(NULL);
+        CHECK(access("/dev/full",F_OK) == 0);
+    }
+
+    unlink(in);
+    unlink(out);
+}
+
+TEST(wt , createtyped)
+{
+    size_t widths[] = { 8, 16, 32 };
+    size_t sizes[] = { 0, 1, 63, 1000, 100001 };
+    size_t i,w,s;
+
+    for (w=0; w<3; w++) {
+        size_t bits = widths[w];
+        for (s=0; s<5; s++) {
+            size_t n = sizes[s];
+            /* u32 also with a sparse alphabet that has no occ */
+            for (int sparse=0; sparse<=(bits == 32); sparse++) {
+                void* A = malloc(n*bits/8+1);
+                uint64_t* T = (uint64_t*) calloc((n*bits)/64+1,sizeof(uint64_t));
+                for (i=0; i<n; i++) {
+                    uint64_t sym = sparse ? (uint32_t)rand()*2654435761U : rand() % (bits == 8 ? 256 : 3000);
+                    wt_setsym(T,bits,i,sym);
+                }
+                /* T is a plain array at these widths */
+                memcpy(A,T,n*bits/8);
+
+                wt_t* wt = wt_create(T,bits,n,4);
+                wt_t* wtt = bits == 8 ? wt_create_u8((uint8_t*)A,n,4) :
+                            bits == 16 ? wt_create_u16((uint16_t*)A,n,4) :
+                            wt_create_u32((uint32_t*)A,n,4);
+                CHECK(wtt != NULL);
+                CHECK(!sparse || !n || wtt->occ == NULL);
+                size_t len,lent;
+                char* ser = wt_bytes(wt,&len);
+                char* typ = wt_bytes(wtt,&lent);
+                CHECK(len == lent);
+                CHECK(memcmp(ser,typ,len) == 0);
+                /* the input is only read */
+                CHECK(memcmp(A,T,n*bits/8) == 0);
+                free(ser);
+                free(typ);
+                wt_free(wt);
+                wt_free(wtt);
+                free(T);
+                free(A);
+            }
+        }
+    }
+}
+
+TEST(wt , allocfailure)
+{
+    size_t n,i;
+    memalloc_t a = { failing_alloc, failing_free, NULL };
+    memalloc_set(&a);
+    /* every allocation step fails once without exiting or leaking */
+    for (size_t k=0; k<4; k++) {
+        failafter = k;
+        uint8_t* T = init_T(&n);
+        CHECK(wt_create((uint64_t*)T,8,n,4) == NULL);
+        free(T);
+    }
+    /* the threaded build either fails or builds all of it, occ included */
+    uint64_t B[1000/8];
+    for (i=0; i<1000; i++) ((uint8_t*)B)[i] = i % 8;
+    for (size_t k=0; k<1000; k++) {
+        failafter = k;
+        wt_t* wt = wt_create_mt(B,8,1000,4,2);
+        if (wt) {
+            CHECK(wt->occ != NULL);
+            wt_free(wt);
+            break;
+        }
+    }
+    memalloc_set(NULL);
+
+    memalloc_arena_t* arena = memalloc_arena_create(1<<22);
+    a = memalloc_arena(arena);
+    memalloc_set(&a);
+    uint8_t* T = init_TRand(&n);
+    uint8_t* Tcopy = (uint8_t*) malloc(n);
+    memcpy(Tcopy,T,n);
+    wt_t* wt = wt_create((uint64_t*)T,8,n,0);
+    for (i=0; i<n; i++) CHECK(wt_access(wt,i) == Tcopy[i]);
+    wt_free(wt);
+    memalloc_set(NULL);
+    memalloc_arena_free(arena);
+    free(T);
+    free(Tcopy);
+}
+
+TEST(wt , large)
+{
+    /* more than 2^32 symbols: positions, counts and top-k frequencies
+     * pass 2^32. wt_create would need several GB for the input and its
+     * buffers, so the two levels are laid out directly: symbol 3 every
+     * step positions from 3, symbol 1 every step from 5, 0 elsewhere */
+    size_t n = (1ULL<<32) + 12345;
+    size_t step = (1ULL<<20)+7;
+    size_t i,k,c3 = 0,c1 = 0;
+    wt_t* wt = wt_init(n);
+    wt->height = 2;
+    wt->max_v = 3;
+    wt->bittree = (rankbv_t**) memalloc_calloc(2*sizeof(rankbv_t*));
+    wt->bittree[0] = rankbv_init(n,0);
+    wt->bittree[1] = rankbv_init(n,0);
+    CHECK(wt->bittree[0] != NULL && wt->bittree[1] != NULL);
+    if (!wt->bittree[0] || !wt->bittree[1]) {
+        wt_free(wt);
+        return;
+    }
+    for (i=3; i<n; i+=step) {
+        rankbv_setbit(wt->bittree[0],i);
+        c3++;
+    }
+    /* level 1: the 0/1 node in input order, then the node of the 3s */
+    for (i=5; i<n; i+=step) {
+        rankbv_setbit(wt->bittree[1],i-(i-3)/step-1);
+        c1++;
+    }
+    for (i=n-c3; i<n; i++) rankbv_setbit(wt->bittree[1],i);
+    rankbv_build(wt->bittree[0]);
+    rankbv_build(wt->bittree[1]);
+    size_t c0 = n-c1-c3;
+    uint64_t C[5] = { 0, c0, c0+c1, c0+c1, n };
+    wt->occ = occ_create(C,5);
+
+    CHECK(wt_count(wt,0) == c0);
+    CHECK(wt_count(wt,3) == c3);
+    CHECK(wt_access(wt,n-1) == 0);
+    CHECK(wt_access(wt,3+(c3-1)*step) == 3);
+    CHECK(wt_access(wt,5+(c1-1)*step) == 1);
+    CHECK(wt_rank(wt,0,n-1) == c0);
+    CHECK(wt_rank(wt,3,n-1) == c3);
+    CHECK(wt_select(wt,0,c0) == n-1);
+    for (k=1; k<=c3; k+=97) {
+        size_t pos = 3+(k-1)*step;
+        CHECK(wt_select(wt,3,k) == pos);
+        CHECK(wt_select(wt,1,k) == pos+2);
+        CHECK(wt_rank(wt,3,pos) == k);
+        /* zeros before pos: all but the 3s and 1s seen so far */
+        CHECK(wt_rank(wt,0,pos) == pos+1-k-(k-1));
+    }
+
+    wt_result_t* res = wt_mostfrequent(wt,0,n-1,2);
+    CHECK(res->m == 2);
+    CHECK(res->items[0].sym == 0 && res->items[0].freq == c0);
+    CHECK(res->items[0].freq > (1ULL<<32));
+    wt_freeresult(res);
+    wt_quant_t q = wt_quantile_freq(wt,0,n-1,c0+1);
+    CHECK(q.sym == 1 && q.freq == c1);
+    CHECK(wt_quantile(wt,0,n-1,n) == 3);
+
+    wt_free(wt);
+}
+
+/* a file holding the first len bytes of buf */
+static FILE* prefix_file(const char* buf,size_t len)
+{
+    FILE* f = tmpfile();
+    fwrite(buf,1,len,f);
+    rewind(f);
+    return f;
+}
+
+TEST(wt , loadtruncated)
+{
+    size_t n,len,i,k;
+    uint8_t* T = init_TRand(&n);
+    wt_t* wts[2] = { wt_create((uint64_t*)T,8,n,4), wt_create_remap((uint64_t*)T,8,n,4) };
+
+    for (k=0; k<2; k++) {
+        char* buf = wt_bytes(wts[k],&len);
+        /* every field of the header cut short and a spread of cuts in
+         * the body, none of them exits */
+        for (i=0; i<len; i += (i < 64 ? 4 : len/16)) {
+            FILE* f = prefix_file(buf,i);
+            CHECK(wt_load(f) == NULL);
+            fclose(f);
+        }
+        /* magic, version, n, height, flags, max_v, sigma */
+        uint32_t h = 65;
+        memcpy(buf+20,&h,sizeof(h));
+        FILE* f = prefix_file(buf,len);
+        CHECK(wt_load(f) == NULL);
+        fclose(f);
+        if (wts[k]->alpha) {
+            uint64_t sigma = ~0ULL;
+            h = wts[k]->height;
+            memcpy(buf+20,&h,sizeof(h));
+            memcpy(buf+36,&sigma,sizeof(sigma));
+            f = prefix_file(buf,len);
+            CHECK(wt_load(f) == NULL);
+            fclose(f);
+        }
+        free(buf);
+        wt_free(wts[k]);
+    }
+    free(T);
 }